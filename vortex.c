@@ -1,5 +1,5 @@
+#define _GNU_SOURCE // for copy_file_range
 #include <dirent.h>
-#include <openssl/sha.h>
 #include <openssl/evp.h>
 #include "uthash.h"
 #include <magic.h>
@@ -9,6 +9,29 @@
 #include <errno.h> // Add this header for error handling
 #include <sys/stat.h> // Add this header for mkdir function
 #include <sys/types.h> // Add this header for mkdir function
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <time.h>
+#include <ctype.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+#ifdef VORTEX_WITH_BLAKE3
+    #include <blake3.h>
+#endif
+#ifdef VORTEX_WITH_XXHASH
+    #include <xxhash.h>
+#endif
+#ifdef VORTEX_WITH_ZSTD
+    #include <zstd.h>
+    #include <zdict.h>
+#endif
 
 #ifdef _WIN32
     #include <windows.h>
@@ -16,648 +39,8954 @@
     #include <unistd.h>
 #endif
 
-#define MAX_BUF_SIZE 1024
+#ifndef _WIN32
+    #include <sys/mman.h>
+    #include <sys/resource.h>
+    #include <sys/file.h> // flock
+    #include <signal.h>
+#endif
 
-void process_files_recursive(const char *directory, const char *sorted_root_directory);
-void process_file(const char *filename, const char *sorted_root_directory, const char *mime_type);
-const char *get_mime_type(const char *filename);
-int is_directory_empty(const char *directory);
-int remove_directory(const char *path);
+#ifdef __linux__
+    #include <sys/ioctl.h>
+    #include <sys/sendfile.h>
+    #include <linux/fs.h> // FICLONE
+    #include <linux/fiemap.h>
+    #include <sys/syscall.h> // getdents64, io_uring
+    #include <sys/inotify.h>
+    #include <poll.h>
+    #if __has_include(<linux/io_uring.h>)
+        #include <linux/io_uring.h>
+        #define VORTEX_HAVE_IO_URING
+    #endif
+#endif
 
-// Hashing function
-char *sha256_hash_file(const char *path)
-{
-    FILE *file = fopen(path, "rb");
-    if (!file)
-        return NULL;
+// Persistent index of stored objects, kept in the sorted root
+#define INDEX_FILE_NAME ".vortex-index"
+#define INDEX_VERSION 1
+#define TYPES_FILE_NAME ".vortex-types"
 
-    unsigned char hash[EVP_MAX_MD_SIZE];
-    unsigned int hash_len;
-    EVP_MD_CTX *mdctx = EVP_MD_CTX_new();
+// External digest index used in memory-bounded mode and by queries, built from the index above.
+// Queries that have to build it sort the text index in QUERY_MEMORY unless --max-memory says otherwise.
+#define DIGEST_INDEX_FILE_NAME ".vortex-digests"
+#define DIGEST_INDEX_VERSION 2
+#define BLOOM_BITS_PER_OBJECT 10
+#define BLOOM_HASHES 7
+#define QUERY_MEMORY (256ULL << 20)
 
-    EVP_DigestInit(mdctx, EVP_sha256());
+// Size of each of the head, middle and tail samples used to rule out duplicates cheaply
+#define PARTIAL_BLOCK_SIZE 4096
 
-    char buffer[MAX_BUF_SIZE];
-    int bytesRead = 0;
-    while ((bytesRead = fread(buffer, 1, MAX_BUF_SIZE, file)))
-    {
-        EVP_DigestUpdate(mdctx, buffer, bytesRead);
-    }
+// Objects smaller than pack_threshold, if it is set, are appended to pack files in a directory of this
+// name below their MIME directory rather than stored one per file. A pack is closed and the next one
+// started once it grows past PACK_MAX_SIZE.
+#define PACK_DIR_NAME ".vortex-packs"
+#define PACK_MAX_SIZE (1LL << 30)
+#define PACK_THRESHOLD_LIMIT (16 << 20)
 
-    EVP_DigestFinal(mdctx, hash, &hash_len);
-    EVP_MD_CTX_free(mdctx);
-    fclose(file);
+off_t pack_threshold = 0;
 
-    char *outputBuffer = malloc(sizeof(char) * ((hash_len * 2) + 1));
-    if (!outputBuffer)
-        return NULL;
+// Files of chunk_threshold bytes and up, if it is set, are cut into content-defined chunks. Each chunk
+// is stored once, under CHUNK_DIR_NAME, and the file as a manifest listing its chunks, named like the
+// object with MANIFEST_SUFFIX added. Chunk boundaries follow the content, so files that differ by a
+// few bytes share all but the chunks around the difference.
+#define CHUNK_DIR_NAME ".vortex-chunks"
+#define MANIFEST_SUFFIX ".vortex-manifest"
+#define MANIFEST_VERSION 1
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_AVG_SIZE (64 * 1024)
+#define CHUNK_MAX_SIZE (256 * 1024)
 
-    for (int i = 0; i < hash_len; i++)
-    {
-        sprintf(outputBuffer + (i * 2), "%02x", hash[i]);
-    }
+off_t chunk_threshold = 0;
 
-    return outputBuffer;
-}
+// Objects of compressible types that are stored as files of their own can be compressed with zstd,
+// and are then named like the object with COMPRESSED_SUFFIX added. They are still named after the hash
+// of their uncompressed content, which is what reading them returns. compress_level applies to the
+// built-in list of compressible types, and "compress-type" rules in the store settings set the level
+// for other types, or a dictionary trained for a type, kept in the root as DICTIONARY_PREFIX<id>.
+// Objects of COMPRESS_THREADED_SIZE and up are compressed on several threads.
+#define COMPRESSED_SUFFIX ".vortex-zst"
+#define DICTIONARY_PREFIX ".vortex-dictionary-"
+#define DICTIONARY_MAX_SIZE (112 * 1024)
+#define DICTIONARY_SAMPLE_SIZE (64 * 1024)
+#define DICTIONARY_SAMPLES_MAX (16 << 20)
+#define COMPRESS_THREADED_SIZE (8 << 20)
 
-// Hash table entry structure
-struct file_hash
+struct compression_rule
 {
-    char hash[2 * SHA256_DIGEST_LENGTH + 1]; // key
-    UT_hash_handle hh;                        // makes this structure hashable
+    char *pattern;       // MIME type such as "text/csv", "text/*" for a whole class, or "*"
+    int level;           // 0 to leave the type uncompressed
+    unsigned dictionary; // id of the type's dictionary, 0 for none
+#ifdef VORTEX_WITH_ZSTD
+    ZSTD_CDict *cdict;
+#endif
 };
 
-struct file_hash *file_hashes = NULL; // hash table
+struct compression_rule *compression_rules = NULL;
+int compression_rule_count = 0;
+int compress_level = 0;
+int compressed_store = 0; // compression has been turned on for the store at some point
+int compress_threads = 1;
+
+// Number of files the directory walker may queue ahead of the workers
+#define WORK_QUEUE_CAPACITY 1024
+
+// Size of the batches of directory entries read at once while walking a tree
+#define DIRENT_BUF_SIZE (64 * 1024)
+
+// Directories further than this above the one being walked give up their descriptors until the
+// walk comes back up to them
+#define WALK_OPEN_DEPTH 128
+
+// Open directories beyond which the walker waits for the workers to finish with some. Each file
+// queued may hold its directory open, so this leaves room for a full queue.
+#define WALK_MAX_OPEN_DIRS (WORK_QUEUE_CAPACITY + 2 * WALK_OPEN_DEPTH)
 
-// Function to add a hash to the hash table
-void add_hash(char *file_hash)
+// Per-thread buffer used for hashing and for copies that go through user space. Aligned so it
+// can also be used for O_DIRECT reads.
+#define IO_BUF_SIZE (4 * 1024 * 1024)
+#define IO_BUF_ALIGN 4096
+
+// Files at least this large are hashed through mmap when the strategy is left to us
+#define MMAP_THRESHOLD (64 * 1024 * 1024)
+
+// Objects are named by a 256-bit digest of their content. Every engine produces one, so only the
+// choice of engine, recorded in the store, has to stay fixed for a store.
+#define DIGEST_LENGTH 32
+
+enum hash_algorithm
 {
-    struct file_hash *s = malloc(sizeof(struct file_hash));
-    strcpy(s->hash, file_hash);
-    HASH_ADD_STR(file_hashes, hash, s);
-}
+    HASH_SHA256,
+    HASH_BLAKE2S,
+    HASH_BLAKE3,  // only with VORTEX_WITH_BLAKE3
+    HASH_ALGORITHM_COUNT
+};
+
+const char *hash_algorithm_names[HASH_ALGORITHM_COUNT] = {"sha256", "blake2s256", "blake3"};
+
+enum hash_algorithm hash_algorithm = HASH_SHA256;
+
+// Store settings, such as the hash engine
+#define STORE_FILE_NAME ".vortex-store"
 
-// Function to find a hash in the hash table
-struct file_hash *find_hash(char *file_hash)
+// How objects are spread over directories below their MIME directory. Each level is a directory
+// named after the next few hex digits of the hash, so "2/2" stores objects as <mime>/ab/cd/<hash>.
+// With no levels, the original flat layout, every object of a type shares one directory.
+#define LAYOUT_MAX_LEVELS 4
+
+struct layout
 {
-    struct file_hash *s;
-    HASH_FIND_STR(file_hashes, file_hash, s);
-    return s;
-}
+    int levels;
+    int widths[LAYOUT_MAX_LEVELS];
+};
 
-void build_hash_table(const char *target_directory) {
-    DIR *dir;
-    struct dirent *entry;
-    char path[PATH_MAX];
+struct layout store_layout = {0};
 
-    dir = opendir(target_directory);
-    if (dir == NULL) {
-        perror("Error opening directory");
-        return;
-    }
+// The layout an unfinished migrate command is moving the store away from
+struct layout migrating_from;
+int migrating = 0;
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue; // skip "." and ".."
+// How the duplicate check tells files of the same size apart before the full hash
+enum prefilter
+{
+    PREFILTER_SAMPLED, // hash of the head, middle and tail blocks
+    PREFILTER_XXH3     // XXH3 of the whole file; only with VORTEX_WITH_XXHASH
+};
 
-        snprintf(path, sizeof(path), "%s/%s", target_directory, entry->d_name);
-        
-        struct stat path_stat;
-        stat(path, &path_stat);
-        
-        if (S_ISREG(path_stat.st_mode)) { // Check if we're dealing with regular files
-            char *hash = sha256_hash_file(path);
-            if (hash != NULL) {
-                // Add each hash to the file_hashes
-                add_hash(hash);
-                free(hash); // Remember to free the hash if it's dynamically allocated in sha256_hash_file
-            }
-        } else if (S_ISDIR(path_stat.st_mode)) {
-            // Recursively call this function if we're dealing with directories
-            build_hash_table(path);
-        }
-    }
+enum prefilter prefilter = PREFILTER_SAMPLED;
 
-    closedir(dir);
-}
+// How content_hash_file reads files
+enum hash_io
+{
+    HASH_IO_AUTO,   // read() for small files, mmap for large ones
+    HASH_IO_READ,   // large sequential read() calls
+    HASH_IO_MMAP,   // mmap the whole file
+    HASH_IO_DIRECT  // O_DIRECT reads that bypass the page cache
+};
 
-void replace_forward_slashes(char *str) {
-    if (str == NULL) {
-        return;
-    }
-  
-    for (size_t i = 0; i < strlen(str); i++) {
-        if (str[i] == '/') {
-            str[i] = '\\';
-        }
-    }
-}
+enum hash_io hash_io_strategy = HASH_IO_AUTO;
 
-// Function to create directories
-int create_directory(const char *dir)
+// How file data is moved while hashing and copying
+enum io_backend
 {
-    struct stat st = {0};
+    IO_BACKEND_SYNC,  // one blocking read or write at a time
+    IO_BACKEND_URING  // many reads and writes in flight per worker through io_uring
+};
 
-    // Use forward slash as the directory separator for Windows paths
-    char converted_dir[256];
-    for (int i = 0; i < strlen(dir); i++)
-    {
-        if (dir[i] == '\\')
-            converted_dir[i] = '/';
-        else
-            converted_dir[i] = dir[i];
-    }
-    converted_dir[strlen(dir)] = '\0';
+enum io_backend io_backend = IO_BACKEND_SYNC;
 
-    if (stat(converted_dir, &st) == -1)
-    {
-#ifdef _WIN32
-        int result = mkdir(converted_dir);
-#else
-        int result = mkdir(converted_dir, 0777);
-#endif
+// Reads and writes each worker keeps in flight with io_uring, and the size of each
+#define URING_DEFAULT_QUEUE_DEPTH 32
+#define URING_CHUNK_SIZE (256 * 1024)
 
-        if (result == -1)
-        {
-            char parent_dir[256];
-            strncpy(parent_dir, converted_dir, sizeof(parent_dir));
-            char *last_slash = strrchr(parent_dir, '/');
-            if (last_slash != NULL)
-            {
-                *last_slash = '\0';
-                if (!create_directory(parent_dir))
-                {
-                    return 0; // Failed to create parent directory
-                }
-#ifdef _WIN32
-                result = mkdir(converted_dir);
-#else
-                result = mkdir(converted_dir, 0777);
-#endif
-                if (result == -1)
-                {
-                    fprintf(stderr, "Error creating directory: %s (%s)\n", converted_dir, strerror(errno));
-                    return 0; // Directory creation failed
-                }
-            }
-            else
-            {
-                fprintf(stderr, "Error creating directory: %s (%s)\n", converted_dir, strerror(errno));
-                return 0; // Directory creation failed
-            }
-        }
-    }
+unsigned uring_queue_depth = URING_DEFAULT_QUEUE_DEPTH;
 
-    return 1; // Directory created successfully or already exists
-}
+// Directory in the sorted root where objects are assembled before being renamed into place
+#define TEMP_DIR_NAME ".vortex-tmp"
+
+// With --link, ingested files stay where they are and are stored by reflink or hard link, and
+// duplicates are replaced by links to the stored object. Replacements are assembled under this prefix
+// next to the file they replace.
+#define LINK_TEMP_PREFIX ".vortex-link-"
+
+int link_mode = 0;
+
+// Journal of placements, and how often it is committed: after this many files or seconds
+#define JOURNAL_FILE_NAME ".vortex-journal"
+#define JOURNAL_BATCH 4096
+#define JOURNAL_INTERVAL 1
+
+// Run metrics. Every thread counts into its own block, so the hot path never touches a shared cache
+// line; reports sum the blocks. Only the owning thread writes a block, while a reporter may read it
+// concurrently, hence the relaxed atomic loads and stores.
+enum counter
+{
+    COUNTER_FILES,
+    COUNTER_BYTES,
+    COUNTER_STORED_FILES,
+    COUNTER_STORED_BYTES,
+    COUNTER_DUPLICATES,
+    COUNTER_DUPLICATE_BYTES,
+    COUNTER_COUNT
+};
+
+const char *counter_names[COUNTER_COUNT] = {
+    "files", "bytes", "stored_files", "stored_bytes", "duplicates", "duplicate_bytes"
+};
 
+enum error_kind
+{
+    ERROR_OPEN,
+    ERROR_READ,
+    ERROR_HASH,
+    ERROR_MEMORY,
+    ERROR_DIRECTORY,
+    ERROR_PLACEMENT,
+    ERROR_SYNC,
+    ERROR_DELETE,
+    ERROR_COUNT
+};
+
+const char *error_names[ERROR_COUNT] = {
+    "open", "read", "hash", "memory", "directory", "placement", "sync", "delete"
+};
 
+enum stage
+{
+    STAGE_TRAVERSAL,
+    STAGE_MIME,
+    STAGE_DUPLICATE_CHECK,
+    STAGE_HASHING,
+    STAGE_DIRECTORIES,
+    STAGE_PLACEMENT,
+    STAGE_COMMIT,
+    STAGE_COUNT
+};
 
+const char *stage_names[STAGE_COUNT] = {
+    "traversal", "mime", "duplicate_check", "hashing", "directories", "placement", "commit"
+};
 
+// Stage latencies are kept in power of two buckets: bucket i counts calls of under 2^i ns
+#define LATENCY_BUCKETS 40
 
-void escape_file_path(char *path)
+struct metrics
 {
-    char escape_chars[] = "\\\'\"$`!*?{}[]()<>#%&|;:= ";
-    char *p;
-    size_t len;
+    uint64_t counters[COUNTER_COUNT];
+    uint64_t errors[ERROR_COUNT];
+    uint64_t stage_ns[STAGE_COUNT];
+    uint64_t latency[STAGE_COUNT][LATENCY_BUCKETS];
+    struct metrics *next;
+};
 
-    while ((p = strpbrk(path, escape_chars)) != NULL)
+// Blocks outlive their threads, so totals include finished workers
+struct metrics *all_metrics = NULL;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct metrics *thread_metrics = NULL;
+
+// Shared by threads that couldn't allocate a block of their own. Counts may then be lost to races.
+struct metrics fallback_metrics;
+
+struct metrics *get_thread_metrics(void)
+{
+    if (thread_metrics == NULL)
     {
-        len = strlen(p);
-        memmove(p + 1, p, len + 1);
-        *p = '\\';
+        thread_metrics = calloc(1, sizeof(struct metrics));
+        if (thread_metrics == NULL)
+            return thread_metrics = &fallback_metrics;
 
-        // Move to the next character
-        path = p + 2;
+        pthread_mutex_lock(&metrics_lock);
+        thread_metrics->next = all_metrics;
+        all_metrics = thread_metrics;
+        pthread_mutex_unlock(&metrics_lock);
     }
+    return thread_metrics;
 }
 
+static inline void metrics_add(uint64_t *value, uint64_t n)
+{
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
 
-// Function to copy a file
-int copy_file(const char *src, const char *dest)
+static inline void count(enum counter counter, uint64_t n)
 {
-    printf("Copying file: %s\n", src);
-    printf("Destination: %s\n", dest);
+    metrics_add(&get_thread_metrics()->counters[counter], n);
+}
 
-    FILE *src_file = fopen(src, "rb");
-    if (!src_file)
-    {
-        printf("Error opening source file: %s (%s)\n", src, strerror(errno));
-        return -1;
-    }
+static inline void count_error(enum error_kind kind)
+{
+    metrics_add(&get_thread_metrics()->errors[kind], 1);
+}
 
-    FILE *dest_file = fopen(dest, "wb");
-    if (!dest_file)
-    {
-        printf("Error creating destination file: %s (%s)\n", dest, strerror(errno));
-        fclose(src_file);
-        return -1;
-    }
+static inline uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Charge the time since start to a stage
+static inline void stage_end(enum stage stage, uint64_t start)
+{
+    uint64_t elapsed = now_ns() - start;
+    int bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+
+    struct metrics *m = get_thread_metrics();
+    metrics_add(&m->stage_ns[stage], elapsed);
+    metrics_add(&m->latency[stage][bucket], 1);
+}
 
-    char buffer[MAX_BUF_SIZE];
-    size_t bytesRead;
-    while ((bytesRead = fread(buffer, 1, sizeof(buffer), src_file)) > 0)
+// Sum every thread's metrics into total
+void collect_metrics(struct metrics *total)
+{
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&metrics_lock);
+    for (struct metrics *m = all_metrics; ; m = m->next)
     {
-        if (fwrite(buffer, 1, bytesRead, dest_file) != bytesRead)
+        if (m == NULL)
+            m = &fallback_metrics;
+
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            total->counters[i] += __atomic_load_n(&m->counters[i], __ATOMIC_RELAXED);
+        for (int i = 0; i < ERROR_COUNT; i++)
+            total->errors[i] += __atomic_load_n(&m->errors[i], __ATOMIC_RELAXED);
+        for (int i = 0; i < STAGE_COUNT; i++)
         {
-            printf("Error writing to destination file: %s\n", dest);
-            fclose(src_file);
-            fclose(dest_file);
-            return -1;
+            total->stage_ns[i] += __atomic_load_n(&m->stage_ns[i], __ATOMIC_RELAXED);
+            for (int j = 0; j < LATENCY_BUCKETS; j++)
+                total->latency[i][j] += __atomic_load_n(&m->latency[i][j], __ATOMIC_RELAXED);
         }
+
+        if (m == &fallback_metrics)
+            break;
     }
+    pthread_mutex_unlock(&metrics_lock);
+}
 
-    fclose(src_file);
-    fclose(dest_file);
+// Upper bound of the bucket holding the given fraction of a stage's calls
+uint64_t latency_percentile(const uint64_t *latency, double fraction)
+{
+    uint64_t calls = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        calls += latency[i];
 
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += latency[i];
+        if (calls > 0 && seen >= fraction * calls)
+            return 1ULL << i;
+    }
     return 0;
 }
 
-void process_files_recursive(const char *directory, const char *sorted_root_directory) {
-    DIR *dir = opendir(directory);
-    if (!dir) {
-        printf("Error opening directory: %s (%s)\n", directory, strerror(errno));
-        return;
-    }
-
-    struct dirent *ent;
-    char path[256];
-
-    while ((ent = readdir(dir)) != NULL) {
-        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
-            continue;
-
-        snprintf(path, sizeof(path), "%s/%s", directory, ent->d_name);
+// Stats reports are JSON objects, one per line: periodic snapshots, then a final one
+FILE *stats_file = NULL;
+double stats_interval = 0;
+uint64_t stats_start;
 
-        struct stat st;
-        if (stat(path, &st) == -1) {
-            printf("Error getting file/directory information: %s (%s)\n", path, strerror(errno));
-            continue;
-        }
+struct
+{
+    int stopping;
+    pthread_t reporter;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+} stats_reporter = {0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
 
-        if (S_ISDIR(st.st_mode)) {
-            process_files_recursive(path, sorted_root_directory);
-        } else if (S_ISREG(st.st_mode)) {
-            // Replace forward slashes with backslashes in file paths
-            for (int i = 0; i < strlen(path); i++) {
-                if (path[i] == '/') {
-                    path[i] = '\\';
-                }
-            }
+void write_stats(int final)
+{
+    struct metrics total;
+    collect_metrics(&total);
 
-            // Determine the MIME type based on file extension
-            const char *mime_type = get_mime_type(path);
-            if (mime_type == NULL)
-            {
-                if (strcmp(path, "desktop.ini") == 0)
-                {
-                    printf("Deleting file: %s\n", path);
-                    remove(path);
-                    return;
-                }
-                printf("Unknown MIME type for file: %s\n", path);
-                continue;
-            }
+    FILE *f = stats_file;
+    fprintf(f, "{\"elapsed\":%.3f,\"final\":%s", (now_ns() - stats_start) / 1e9, final ? "true" : "false");
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        fprintf(f, ",\"%s\":%llu", counter_names[i], (unsigned long long)total.counters[i]);
 
-            process_file(path, sorted_root_directory, mime_type);
-        }
-    }
+    fprintf(f, ",\"errors\":{");
+    for (int i = 0; i < ERROR_COUNT; i++)
+        fprintf(f, "%s\"%s\":%llu", i ? "," : "", error_names[i], (unsigned long long)total.errors[i]);
 
-    closedir(dir);
-    // Check if the directory is empty
-    if (is_directory_empty(directory) && strcmp(directory, sorted_root_directory) != 0)
+    fprintf(f, "},\"stages\":{");
+    for (int i = 0; i < STAGE_COUNT; i++)
     {
-        // Delete the directory if it's empty
-        int result = remove_directory(directory);
-        if (result == 0)
-        {
-            printf("Deleted empty directory: %s\n", directory);
-        }
-        else
+        const uint64_t *latency = total.latency[i];
+        uint64_t calls = 0;
+        int used = 0;
+        for (int j = 0; j < LATENCY_BUCKETS; j++)
         {
-            printf("Error deleting directory: %s\n", directory);
+            calls += latency[j];
+            if (latency[j])
+                used = j + 1;
         }
+
+        fprintf(f, "%s\"%s\":{\"calls\":%llu,\"seconds\":%.6f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"latency_log2_ns\":[",
+                i ? "," : "", stage_names[i], (unsigned long long)calls, total.stage_ns[i] / 1e9,
+                (unsigned long long)latency_percentile(latency, 0.5), (unsigned long long)latency_percentile(latency, 0.99));
+        for (int j = 0; j < used; j++)
+            fprintf(f, "%s%llu", j ? "," : "", (unsigned long long)latency[j]);
+        fprintf(f, "]}");
     }
+    fprintf(f, "}}\n");
+    fflush(f);
 }
 
-
-void process_file(const char *filename, const char *sorted_root_directory, const char *mime_type)
+void *stats_thread(void *arg)
 {
-    // Skip "desktop.ini" files
-    if (strcmp(filename, "desktop.ini") == 0)
+    (void)arg;
+    pthread_mutex_lock(&stats_reporter.lock);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    while (!stats_reporter.stopping)
     {
-        printf("Deleting file: %s\n", filename);
-        remove(filename);
-        return;
-    }
+        uint64_t next = deadline.tv_nsec + (uint64_t)(stats_interval * 1e9);
+        deadline.tv_sec += next / 1000000000;
+        deadline.tv_nsec = next % 1000000000;
+        while (!stats_reporter.stopping &&
+               pthread_cond_timedwait(&stats_reporter.wake, &stats_reporter.lock, &deadline) != ETIMEDOUT)
+            ;
 
-    // Hash the file
-    char *hash = sha256_hash_file(filename);
-    if (hash == NULL)
-    {
-        printf("Error hashing file: %s\n", filename);
-        return;
+        if (!stats_reporter.stopping)
+            write_stats(0);
     }
+    pthread_mutex_unlock(&stats_reporter.lock);
+    return NULL;
+}
 
-    // Check if the file's hash is already in the hash table
-    struct file_hash *s = find_hash(hash);
-    if (s != NULL)
-    {
-        printf("Duplicate file found: %s\n", filename);
-        remove(filename);
-        free(hash);
-        return;
-    }
+// Start timing the run, and reporting on it if asked to
+void stats_start_run(void)
+{
+    stats_start = now_ns();
+    if (stats_file != NULL && stats_interval > 0)
+        pthread_create(&stats_reporter.reporter, NULL, stats_thread, NULL);
+}
 
-    // Add the hash to the hash table
-    add_hash(hash);
+void stats_end_run(void)
+{
+    if (stats_file == NULL)
+        return;
 
-    // Prepare the destination directory
-    char newdir[256];
-    snprintf(newdir, sizeof(newdir), "%s\\%s", sorted_root_directory, mime_type);
-    if (!create_directory(newdir))
+    if (stats_interval > 0)
     {
-        printf("Error creating destination directory: %s\n", newdir);
-        free(hash);
-        return;
+        pthread_mutex_lock(&stats_reporter.lock);
+        stats_reporter.stopping = 1;
+        pthread_cond_signal(&stats_reporter.wake);
+        pthread_mutex_unlock(&stats_reporter.lock);
+        pthread_join(stats_reporter.reporter, NULL);
     }
 
-    // Generate the new file path in the sorted directory
-    char newname[256];
-    const char *file_extension = strrchr(filename, '.');
-    snprintf(newname, sizeof(newname), "%s\\%s%s", newdir, hash, file_extension);
+    write_stats(1);
+    if (stats_file != stderr)
+        fclose(stats_file);
+    stats_file = NULL;
+}
 
-    // Generate the new source file path with the hashed name
-    char new_filepath[256];
-    strcpy(new_filepath, filename);  // Copy the current file path
-    char *last_slash = strrchr(new_filepath, '\\');  // Find the last occurrence of backslash
-    if (last_slash != NULL) {
-        strcpy(last_slash + 1, hash);  // Replace the portion after the last backslash with the hash value
-        strcat(new_filepath, file_extension);  // Append the file extension
-    } else {
-        // Handle the case when there's no backslash in the current file path
-        printf("Invalid file path: %s\n", filename);
-        free(hash);
-        return;
-    }
+// Logging. Messages are formatted by the calling thread and pushed onto a lock-free ring that a
+// logger thread drains to stdout, so workers never wait for a terminal or a pipe. Should the ring
+// fill up, messages are dropped and counted rather than stalling ingest. The per-file event log
+// goes through a ring of its own, which is never dropped from, and is written in large batches.
+enum log_level
+{
+    LOG_ERROR,
+    LOG_INFO,
+    LOG_DEBUG
+};
 
+enum log_level log_verbosity = LOG_INFO;
 
-    // Generate escaped paths for source and destination files
-    char escaped_filename[2 * MAX_BUF_SIZE + 1];
-    char escaped_newname[2 * MAX_BUF_SIZE + 1];
+#define LOG_RING_SIZE 16384 // power of two
+#define EVENT_LOG_BUFFER (1 << 20)
+#define EVENT_LOG_INTERVAL 1
+
+// Bounded multi-producer queue of strings; each slot's sequence number says whether it is free to
+// fill (== position) or ready to drain (== position + 1)
+struct log_slot
+{
+    uint64_t seq;
+    char *text;
+};
 
-    snprintf(escaped_filename, sizeof(escaped_filename), "%s", filename);
-    snprintf(escaped_newname, sizeof(escaped_newname), "%s", newname);
-    escape_file_path(escaped_filename);
-    escape_file_path(escaped_newname);
+struct log_ring
+{
+    struct log_slot *slots;
+    uint64_t head; // next to drain; only the logger thread touches it
+    uint64_t tail; // next to fill
+    uint64_t dropped;
+};
 
-    replace_forward_slashes(newname);
+struct
+{
+    int running;
+    int stopping;
+    pthread_t thread;
+    struct log_ring messages;
+    struct log_ring events;
+    FILE *event_file;
+} logger;
 
-    // Declare a flag variable
-    int copied = 0;
+int log_ring_init(struct log_ring *ring)
+{
+    ring->slots = malloc(LOG_RING_SIZE * sizeof(struct log_slot));
+    if (ring->slots == NULL)
+        return -1;
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++)
+        ring->slots[i].seq = i;
+    ring->head = ring->tail = ring->dropped = 0;
+    return 0;
+}
 
-    // Rename the file to its hash
-    if (rename(filename, new_filepath) != 0)
+// Returns -1 if the ring is full
+int log_ring_push(struct log_ring *ring, char *text)
+{
+    uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+    for (;;)
     {
-        printf("Error renaming file: %s\n", new_filepath);
-        free(hash);
-        return;
+        slot = &ring->slots[pos & (LOG_RING_SIZE - 1)];
+        int64_t diff = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return -1;
+        else
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
     }
 
-    // Create the copy command with escaped file paths
-    char cmd[1024];
-    #ifdef _WIN32
-    snprintf(cmd, sizeof(cmd), "cp \"%s\" \"%s\"", new_filepath, newname);
-    #else
-    snprintf(cmd, sizeof(cmd), "cp \"%s\" \"%s\"", escaped_filename, escaped_newname);
-    #endif
+    slot->text = text;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
 
-    if(!copied) {
-        // Execute the copy command
-        int resultCode = system(cmd);
-        if (resultCode != 0)
-        {
-            printf("Error copying file: %s\n", new_filepath);
-            printf("Error code: %d\n", resultCode);
-            free(hash);
-            return;
-        } else{
-            if(remove(new_filepath) != 0)
-            {
-                printf("Error Deleting File: %s", new_filepath);
-            }
-        }
-        // Set the flag to indicate that the file has been copied
-        copied = 1;
+char *log_ring_pop(struct log_ring *ring)
+{
+    struct log_slot *slot = &ring->slots[ring->head & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->head + 1)
+        return NULL;
+
+    char *text = slot->text;
+    __atomic_store_n(&slot->seq, ring->head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    ring->head++;
+    return text;
+}
+
+// Write out everything queued on a ring. Returns the number of entries written.
+size_t drain_log_ring(struct log_ring *ring, FILE *out)
+{
+    size_t n = 0;
+    char *text;
+    while ((text = log_ring_pop(ring)) != NULL)
+    {
+        fputs(text, out);
+        free(text);
+        n++;
     }
-    free(hash);
+    return n;
 }
 
-int remove_directory(const char *path) {
-    // Check if the directory is a symbolic link
-    #ifdef _WIN32
-        DWORD attributes = GetFileAttributes(path);
-        if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
-            // Use Windows API to remove symbolic link directory
-            if (RemoveDirectory(path)) {
-                return 0;  // Removal succeeded
-            } else {
-                return -1;  // Removal failed
-            }
+void *logger_thread(void *arg)
+{
+    (void)arg;
+    uint64_t reported_drops = 0;
+    time_t last_event_flush = time(NULL);
+    int unflushed = 0;
+    for (;;)
+    {
+        int stopping = __atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE);
+        size_t n = drain_log_ring(&logger.messages, stdout);
+        uint64_t dropped = __atomic_load_n(&logger.messages.dropped, __ATOMIC_RELAXED);
+        if (dropped != reported_drops)
+        {
+            fprintf(stdout, "Log output fell behind, %llu messages dropped\n", (unsigned long long)(dropped - reported_drops));
+            reported_drops = dropped;
         }
-    #else
-        struct stat st;
-        if (lstat(path, &st) == 0 && S_ISLNK(st.st_mode)) {
-            // Use system command to remove symbolic link directory on Unix-like systems
-            char command[256];
-            snprintf(command, sizeof(command), "rmdir \"%s\"", path);
-            if (system(command) == 0) {
-                return 0;  // Removal succeeded
-            } else {
-                return -1;  // Removal failed
+        if (logger.event_file != NULL)
+        {
+            n += drain_log_ring(&logger.events, logger.event_file);
+            if (time(NULL) - last_event_flush >= EVENT_LOG_INTERVAL)
+            {
+                fflush(logger.event_file);
+                last_event_flush = time(NULL);
             }
         }
-    #endif
-
-    DIR *dir = opendir(path);
-    if (!dir) {
-        printf("Error opening directory: %s\n", path);
-        return -1;
-    }
 
-    int r = 0;
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-            continue;
-
-        char file_path[MAX_BUF_SIZE];
-        snprintf(file_path, sizeof(file_path), "%s/%s", path, entry->d_name);
-
-        struct stat st;
-        if (stat(file_path, &st) == -1) {
-            printf("Error getting file/directory information: %s\n", file_path);
+        if (n > 0)
+        {
+            unflushed = 1;
             continue;
         }
-
-        if (S_ISDIR(st.st_mode)) {
-            r = remove_directory(file_path);
-            if (r != 0) {
-                closedir(dir);
-                return r;
-            }
-        } else if (S_ISREG(st.st_mode)) {
-            if (strcmp(entry->d_name, "desktop.ini") != 0) {
-                printf("Deleting invalid file: %s\n", file_path);
-                r = remove(file_path);
-                if (r != 0) {
-                    printf("Error deleting file: %s\n", file_path);
-                    closedir(dir);
-                    return r;
-                }
-            }
+        if (unflushed)
+        {
+            fflush(stdout);
+            unflushed = 0;
         }
-    }
+        if (stopping)
+            break;
 
-    closedir(dir);
-
-    // Check if the directory is empty or contains only "desktop.ini"
-    if (is_directory_empty(path)) {
-        #ifdef _WIN32
-            // Convert path to wide-character string
-            wchar_t wide_path[MAX_BUF_SIZE];
-            MultiByteToWideChar(CP_UTF8, 0, path, -1, wide_path, sizeof(wide_path) / sizeof(wide_path[0]));
-
-            // Remove the directory using Windows API
-            if (!RemoveDirectoryW(wide_path)) {
-                //printf("Error deleting directory: %s\n", path);
-                r = -1;
-            }
-        #else
-            r = rmdir(path);
-            if (r != 0) {
-                printf("Error deleting directory: %s\n", path);
-            }
-        #endif
+        // Idle: poll again shortly, as producers don't signal
+        struct timespec pause = {0, 2000000};
+        nanosleep(&pause, NULL);
     }
-
-    return r;
+    return NULL;
 }
 
+void log_stop(void);
 
-int is_directory_empty(const char *path) {
-    DIR *dir = opendir(path);
-    if (!dir) {
-        printf("Error opening directory: %s (%s)\n", path, strerror(errno));
-        return 0;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || strcmp(entry->d_name, "desktop.ini") == 0) {
-            continue;
+// Start the logger thread, and the event log if event_log_path is set. Until then, and after
+// log_stop, messages are printed directly.
+int log_start(const char *event_log_path)
+{
+    if (event_log_path != NULL)
+    {
+        logger.event_file = fopen(event_log_path, "a");
+        if (logger.event_file == NULL)
+        {
+            printf("Error opening event log: %s (%s)\n", event_log_path, strerror(errno));
+            return -1;
         }
-        closedir(dir);
-        return 0;  // Directory is not empty
+        setvbuf(logger.event_file, NULL, _IOFBF, EVENT_LOG_BUFFER);
+        if (log_ring_init(&logger.events) != 0)
+            return -1;
     }
 
-    closedir(dir);
-    return 1;  // Directory is empty
+    if (log_ring_init(&logger.messages) != 0)
+        return -1;
+    fflush(stdout);
+    logger.stopping = 0;
+    if (pthread_create(&logger.thread, NULL, logger_thread, NULL) != 0)
+        return -1;
+    __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+
+    // Don't lose queued messages when main returns early
+    atexit(log_stop);
+    return 0;
 }
 
-void strlower(char* str) {
-    for (int i = 0; str[i]; i++) {
-        str[i] = tolower((unsigned char) str[i]);
+// Write out everything still queued and go back to printing directly
+void log_stop(void)
+{
+    if (!logger.running)
+        return;
+
+    __atomic_store_n(&logger.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(logger.thread, NULL);
+    logger.running = 0;
+    free(logger.messages.slots);
+    if (logger.event_file != NULL)
+    {
+        fclose(logger.event_file);
+        logger.event_file = NULL;
+        free(logger.events.slots);
     }
+    fflush(stdout);
 }
 
-const char *get_mime_type(const char *filename) {
-    if (strcmp(filename, "desktop.ini") == 0)
-        return NULL;  // Ignore "desktop.ini" files
+__attribute__((format(printf, 2, 0)))
+void log_message(enum log_level level, const char *format, va_list args)
+{
+    if (level > log_verbosity)
+        return;
 
+    if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE))
+    {
+        vprintf(format, args);
+        return;
+    }
+
+    char *text;
+    if (vasprintf(&text, format, args) == -1)
+        return;
+    if (log_ring_push(&logger.messages, text) != 0)
+    {
+        __atomic_fetch_add(&logger.messages.dropped, 1, __ATOMIC_RELAXED);
+        free(text);
+    }
+}
+
+__attribute__((format(printf, 1, 2)))
+void log_error(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_message(LOG_ERROR, format, args);
+    va_end(args);
+}
+
+__attribute__((format(printf, 1, 2)))
+void log_info(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_message(LOG_INFO, format, args);
+    va_end(args);
+}
+
+__attribute__((format(printf, 1, 2)))
+void log_debug(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    log_message(LOG_DEBUG, format, args);
+    va_end(args);
+}
+
+// Format a path into a buffer of size bytes. Returns -1 with errno set to ENAMETOOLONG, and the buffer
+// emptied, rather than leave a truncated path behind that could name some other file.
+__attribute__((format(printf, 3, 4)))
+int format_path(char *path, size_t size, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(path, size, format, args);
+    va_end(args);
+    if (length < 0 || (size_t)length >= size)
+    {
+        path[0] = '\0';
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// Append text, escaped for a JSON string, at *p without passing end
+static void json_escape(char **p, char *end, const char *text)
+{
+    for (const unsigned char *c = (const unsigned char *)text; *c && *p < end - 7; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            *p += sprintf(*p, "\\%c", *c);
+        else if (*c < 0x20)
+            *p += sprintf(*p, "\\u%04x", *c);
+        else
+            *(*p)++ = *c;
+    }
+    **p = '\0';
+}
+
+void digest_to_hex(const unsigned char *digest, char *hex);
+
+// Record what happened to an ingested file in the event log: event is "stored", "duplicate",
+// "deleted", or the kind of error. object and digest may be NULL.
+void log_event(const char *event, const char *source, const char *object, off_t size, const unsigned char *digest)
+{
+    if (logger.event_file == NULL)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char line[3 * PATH_MAX + 256];
+    char *p = line;
+    char *end = line + sizeof(line) - 128;
+    p += sprintf(p, "{\"time\":%lld.%03ld,\"event\":\"%s\",\"source\":\"", (long long)now.tv_sec, now.tv_nsec / 1000000, event);
+    json_escape(&p, end, source);
+    if (object != NULL)
+    {
+        p += sprintf(p, "\",\"object\":\"");
+        json_escape(&p, end, object);
+    }
+    p += sprintf(p, "\",\"size\":%lld", (long long)size);
+    if (digest != NULL)
+    {
+        p += sprintf(p, ",\"digest\":\"");
+        digest_to_hex(digest, p);
+        p += 2 * DIGEST_LENGTH;
+        *p++ = '"';
+    }
+    strcpy(p, "}\n");
+
+    // Events are an audit trail, so wait for room rather than drop them
+    char *text = strdup(line);
+    while (text != NULL && log_ring_push(&logger.events, text) != 0)
+        sched_yield();
+}
+
+// Count a file that couldn't be ingested, and note it in the event log
+void file_error(enum error_kind kind, const char *source, off_t size)
+{
+    count_error(kind);
+    char event[32];
+    snprintf(event, sizeof(event), "%s_error", error_names[kind]);
+    log_event(event, source, NULL, size, NULL);
+}
+
+struct walk_dir;
+
+void process_files_recursive(const char *directory, int prune);
+void process_file(struct walk_dir *dir, const char *name, const char *filename, const char *sorted_root_directory, const char *destination);
+void store_file(struct walk_dir *dir, const char *name, int src_fd, const struct stat *st, const char *filename,
+                const char *sorted_root_directory, const char *destination, const unsigned char *digest,
+                const char *temp_path, int candidate);
+void destination_path(const char *destination, char *path, size_t size);
+const char *get_destination(const char *filename);
+const char *get_mime_type(const char *filename);
+const char *detect_mime_type(const unsigned char *head, size_t head_len, char *buffer, size_t size);
+void free_worker_magic(void);
+#ifdef VORTEX_WITH_ZSTD
+void free_worker_cctx(void);
+#endif
+
+// Format a digest as hex into hex, which must hold 2 * DIGEST_LENGTH + 1 characters
+void digest_to_hex(const unsigned char *digest, char *hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < DIGEST_LENGTH; i++)
+    {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[2 * DIGEST_LENGTH] = '\0';
+}
+
+// Value of each hex digit, -1 for anything else. A table rather than comparisons, as queries parse
+// digests by the million and whether the next character is a digit or a letter can't be predicted.
+static const signed char hex_values[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+// Parse a hex digest. Returns -1 if hex isn't exactly one digest long.
+int hex_to_digest(const char *hex, unsigned char *digest)
+{
+    for (int i = 0; i < DIGEST_LENGTH; i++)
+    {
+        int high = hex_values[(unsigned char)hex[2 * i]];
+        int low = high < 0 ? -1 : hex_values[(unsigned char)hex[2 * i + 1]];
+        if ((high | low) < 0)
+            return -1;
+        digest[i] = high << 4 | low;
+    }
+    return hex[2 * DIGEST_LENGTH] == '\0' ? 0 : -1;
+}
+
+__thread char *io_buffer = NULL;
+
+// The calling thread's I/O buffer, allocated on first use
+char *get_io_buffer(void)
+{
+    if (io_buffer == NULL && posix_memalign((void **)&io_buffer, IO_BUF_ALIGN, IO_BUF_SIZE) != 0)
+        io_buffer = NULL;
+    return io_buffer;
+}
+
+void free_io_buffer(void)
+{
+    free(io_buffer);
+    io_buffer = NULL;
+}
+
+// An in-progress content digest using the store's hash engine
+struct hasher
+{
+    EVP_MD_CTX *evp;
+#ifdef VORTEX_WITH_BLAKE3
+    blake3_hasher blake3;
+#endif
+};
+
+int hash_algorithm_available(enum hash_algorithm algorithm)
+{
+#ifdef VORTEX_WITH_BLAKE3
+    return 1;
+#else
+    return algorithm != HASH_BLAKE3;
+#endif
+}
+
+// Start, or start over, a digest. A hasher starts out zeroed, and must be finished with hasher_final.
+void hasher_init(struct hasher *hasher)
+{
+#ifdef VORTEX_WITH_BLAKE3
+    if (hash_algorithm == HASH_BLAKE3)
+    {
+        blake3_hasher_init(&hasher->blake3);
+        return;
+    }
+#endif
+    if (hasher->evp == NULL)
+        hasher->evp = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(hasher->evp, hash_algorithm == HASH_BLAKE2S ? EVP_blake2s256() : EVP_sha256(), NULL);
+}
+
+static inline void hasher_update(struct hasher *hasher, const void *data, size_t len)
+{
+#ifdef VORTEX_WITH_BLAKE3
+    if (hash_algorithm == HASH_BLAKE3)
+    {
+        blake3_hasher_update(&hasher->blake3, data, len);
+        return;
+    }
+#endif
+    EVP_DigestUpdate(hasher->evp, data, len);
+}
+
+// Feed a large block in one go. BLAKE3 built with TBB spreads it over several cores.
+static inline void hasher_update_large(struct hasher *hasher, const void *data, size_t len)
+{
+#if defined(VORTEX_WITH_BLAKE3) && defined(VORTEX_WITH_BLAKE3_TBB)
+    if (hash_algorithm == HASH_BLAKE3)
+    {
+        blake3_hasher_update_tbb(&hasher->blake3, data, len);
+        return;
+    }
+#endif
+    hasher_update(hasher, data, len);
+}
+
+void hasher_final(struct hasher *hasher, unsigned char *digest)
+{
+#ifdef VORTEX_WITH_BLAKE3
+    if (hash_algorithm == HASH_BLAKE3)
+    {
+        blake3_hasher_finalize(&hasher->blake3, digest, DIGEST_LENGTH);
+        return;
+    }
+#endif
+    EVP_DigestFinal_ex(hasher->evp, digest, NULL);
+    EVP_MD_CTX_free(hasher->evp);
+    hasher->evp = NULL;
+}
+
+#ifndef _WIN32
+// Files being hashed through a mapping. Reading a page past the end of a file that has shrunk since
+// it was mapped raises SIGBUS, in whichever thread touched it; the handler maps zeroes over the rest
+// of the mapping so the digest can run to the end, and marks it truncated.
+struct hashed_mapping
+{
+    char *start; // NULL if the slot is free
+    size_t size;
+    int truncated;
+};
+
+#define MAX_HASHED_MAPPINGS 256
+struct hashed_mapping hashed_mappings[MAX_HASHED_MAPPINGS];
+pthread_once_t hashed_mapping_handler_once = PTHREAD_ONCE_INIT;
+uintptr_t hashed_mapping_page_size;
+
+void hashed_mapping_fault(int sig, siginfo_t *info, void *context)
+{
+    (void)context;
+    char *address = info->si_addr;
+    for (int i = 0; i < MAX_HASHED_MAPPINGS; i++)
+    {
+        char *start = __atomic_load_n(&hashed_mappings[i].start, __ATOMIC_ACQUIRE);
+        if (start == NULL || address < start || address >= start + hashed_mappings[i].size)
+            continue;
+
+        char *page = (char *)((uintptr_t)address & ~(hashed_mapping_page_size - 1));
+        if (mmap(page, start + hashed_mappings[i].size - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                 -1, 0) == MAP_FAILED)
+            break;
+        __atomic_store_n(&hashed_mappings[i].truncated, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    // Not one of ours; let the fault happen again with the default action
+    signal(sig, SIG_DFL);
+}
+
+void install_hashed_mapping_handler(void)
+{
+    hashed_mapping_page_size = sysconf(_SC_PAGESIZE);
+    struct sigaction action = {0};
+    action.sa_sigaction = hashed_mapping_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, NULL);
+}
+#endif
+
+// Feed a whole file to a digest through one mapping of it. Returns -1 without having fed it anything
+// if the file couldn't be mapped, or shrank while it was being hashed.
+int hash_fd_mmap(int fd, off_t size, struct hasher *hasher)
+{
+#ifdef _WIN32
+    return -1;
+#else
+    if (size == 0)
+        return 0;
+
+    pthread_once(&hashed_mapping_handler_once, install_hashed_mapping_handler);
+    struct hashed_mapping *mapping = NULL;
+    for (int i = 0; mapping == NULL && i < MAX_HASHED_MAPPINGS; i++)
+    {
+        char *expected = NULL;
+        // Claimed with a placeholder until the mapping exists
+        if (__atomic_compare_exchange_n(&hashed_mappings[i].start, &expected, (char *)-1, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED))
+            mapping = &hashed_mappings[i];
+    }
+    if (mapping == NULL)
+        return -1;
+
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        __atomic_store_n(&mapping->start, NULL, __ATOMIC_RELEASE);
+        return -1;
+    }
+    mapping->size = size;
+    mapping->truncated = 0;
+    __atomic_store_n(&mapping->start, (char *)data, __ATOMIC_RELEASE);
+
+    madvise(data, size, MADV_SEQUENTIAL);
+    madvise(data, size, MADV_WILLNEED);
+    hasher_update_large(hasher, data, size);
+
+    int truncated = __atomic_load_n(&mapping->truncated, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&mapping->start, NULL, __ATOMIC_RELEASE);
+    munmap(data, size);
+    if (truncated)
+    {
+        log_debug("File shrank while it was being hashed, reading it instead\n");
+        hasher_init(hasher);
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+// Feed a file to a digest with large reads into the thread's aligned buffer
+int hash_fd_read(int fd, struct hasher *hasher)
+{
+    char *buffer = get_io_buffer();
+    if (buffer == NULL)
+        return -1;
+
+    ssize_t n;
+    while ((n = read(fd, buffer, IO_BUF_SIZE)) != 0)
+    {
+        if (n < 0)
+        {
+#ifdef O_DIRECT
+            // Not every filesystem accepts O_DIRECT reads; carry on through the page cache
+            if (errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT))
+            {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+#endif
+            return -1;
+        }
+        hasher_update(hasher, buffer, n);
+    }
+
+    return 0;
+}
+
+#ifdef VORTEX_HAVE_IO_URING
+// A minimal io_uring, driven through the raw system calls
+struct uring
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+    char *buffers;           // queue depth chunks of URING_CHUNK_SIZE, aligned for O_DIRECT
+};
+
+__thread struct uring *worker_ring = NULL;
+
+int uring_setup(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+        goto fail;
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    if (posix_memalign((void **)&ring->buffers, IO_BUF_ALIGN, (size_t)entries * URING_CHUNK_SIZE) != 0)
+        goto fail;
+
+    return 0;
+
+fail:
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return -1;
+}
+
+void uring_teardown(struct uring *ring)
+{
+    free(ring->buffers);
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// The calling thread's ring, set up on first use. If io_uring turns out to be unavailable
+// (old kernel, seccomp, io_uring_disabled) everyone falls back to synchronous I/O.
+struct uring *get_worker_ring(void)
+{
+    if (io_backend != IO_BACKEND_URING)
+        return NULL;
+
+    if (worker_ring == NULL)
+    {
+        struct uring *ring = malloc(sizeof(struct uring));
+        if (ring == NULL || uring_setup(ring, uring_queue_depth) != 0)
+        {
+            if (__atomic_exchange_n(&io_backend, IO_BACKEND_SYNC, __ATOMIC_RELAXED) == IO_BACKEND_URING)
+                log_info("io_uring unavailable (%s), using synchronous I/O\n", strerror(errno));
+            free(ring);
+            return NULL;
+        }
+        worker_ring = ring;
+    }
+
+    return worker_ring;
+}
+
+void free_worker_ring(void)
+{
+    if (worker_ring != NULL)
+    {
+        uring_teardown(worker_ring);
+        free(worker_ring);
+        worker_ring = NULL;
+    }
+}
+
+void uring_prep_rw(struct uring *ring, int opcode, int fd, void *buffer, unsigned len, off_t offset, unsigned long user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+}
+
+// Submit everything prepared and wait until at least one completion is available
+int uring_submit_and_wait(struct uring *ring)
+{
+    for (;;)
+    {
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0)
+        {
+            ring->to_submit -= n;
+            return 0;
+        }
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+// Stream src_fd from start up to size through a digest with the worker's ring, keeping the whole
+// queue depth of reads in flight. Chunks are hashed strictly in file order whatever order they complete
+// in. With a dest_fd each chunk is also written out at the same offset once it has been hashed,
+// and its buffer is only reused after that write completes. Returns -1 on any I/O error, or if the
+// file shrank and then returned data past its new end, as the chunks would no longer make up one version.
+int uring_stream(struct uring *ring, int src_fd, int dest_fd, off_t start, off_t size, struct hasher *hasher)
+{
+    enum { SLOT_FREE, SLOT_READING, SLOT_READY, SLOT_WRITING };
+    struct slot
+    {
+        int state;
+        off_t offset;
+        unsigned len;
+        unsigned done;  // bytes read or written so far
+    } slots[uring_queue_depth];
+    memset(slots, 0, sizeof(slots));
+
+    unsigned depth = uring_queue_depth;
+    off_t next_read = start;  // offset of the next chunk to read
+    off_t next_hash = start;  // offset of the next chunk to feed to the digest
+    unsigned in_flight = 0;
+    int eof = 0;  // size has been cut down to where a read found the end of the file
+    int result = 0;
+
+    while (result == 0 && (next_hash < size || in_flight > 0))
+    {
+        // Fill every free slot, in chunk order, with a read
+        while (next_read < size)
+        {
+            unsigned index = ((next_read - start) / URING_CHUNK_SIZE) % depth;
+            struct slot *slot = &slots[index];
+            if (slot->state != SLOT_FREE)
+                break;
+            slot->state = SLOT_READING;
+            slot->offset = next_read;
+            slot->len = size - next_read < URING_CHUNK_SIZE ? size - next_read : URING_CHUNK_SIZE;
+            slot->done = 0;
+            uring_prep_rw(ring, IORING_OP_READ, src_fd, ring->buffers + (size_t)index * URING_CHUNK_SIZE,
+                          slot->len, slot->offset, index);
+            next_read += slot->len;
+            in_flight++;
+        }
+
+        if (in_flight == 0)
+            break;
+        if (uring_submit_and_wait(ring) != 0)
+        {
+            result = -1;
+            break;
+        }
+
+        // Reap completions; short transfers are resubmitted for the remainder
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            unsigned index = cqe->user_data;
+            struct slot *slot = &slots[index];
+            char *buffer = ring->buffers + (size_t)index * URING_CHUNK_SIZE;
+            in_flight--;
+
+            if (cqe->res < 0)
+            {
+                errno = -cqe->res;
+                result = -1;
+                continue;
+            }
+
+            if (slot->state == SLOT_READING)
+            {
+                off_t position = slot->offset + slot->done;
+                if (eof && (cqe->res > 0 ? position + cqe->res > size : position < size))
+                {
+                    log_debug("File changed while it was being read\n");
+                    result = -1;
+                    continue;
+                }
+                if (cqe->res == 0 && !eof)
+                {
+                    // The file shrank since it was stat'ed; stop at the new end, unless later
+                    // chunks were already read from past it
+                    eof = 1;
+                    size = position;
+                    for (unsigned i = 0; i < depth; i++)
+                    {
+                        if (slots[i].state == SLOT_READY && slots[i].offset >= size && slots[i].len > 0)
+                            result = -1;
+                    }
+                    if (result != 0)
+                    {
+                        log_debug("File changed while it was being read\n");
+                        continue;
+                    }
+                }
+                if (cqe->res == 0)
+                {
+                    // The end of the file, where nothing more is read
+                    slot->len = slot->done;
+                }
+            }
+
+            slot->done += cqe->res;
+
+            if (slot->done < slot->len)
+            {
+                int opcode = slot->state == SLOT_READING ? IORING_OP_READ : IORING_OP_WRITE;
+                int fd = slot->state == SLOT_READING ? src_fd : dest_fd;
+                uring_prep_rw(ring, opcode, fd, buffer + slot->done, slot->len - slot->done,
+                              slot->offset + slot->done, index);
+                in_flight++;
+            }
+            else
+            {
+                slot->state = slot->state == SLOT_READING ? SLOT_READY : SLOT_FREE;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        // Hash whatever is now contiguous from next_hash, then write it out
+        while (result == 0 && next_hash < size)
+        {
+            unsigned index = ((next_hash - start) / URING_CHUNK_SIZE) % depth;
+            struct slot *slot = &slots[index];
+            if (slot->state != SLOT_READY || slot->offset != next_hash)
+                break;
+
+            char *buffer = ring->buffers + (size_t)index * URING_CHUNK_SIZE;
+            hasher_update(hasher, buffer, slot->len);
+            next_hash += slot->len;
+
+            if (dest_fd >= 0 && slot->len > 0)
+            {
+                slot->state = SLOT_WRITING;
+                slot->done = 0;
+                uring_prep_rw(ring, IORING_OP_WRITE, dest_fd, buffer, slot->len, slot->offset, index);
+                in_flight++;
+            }
+            else
+            {
+                slot->state = SLOT_FREE;
+            }
+        }
+    }
+
+    // Don't leave requests pointing at our buffers behind on error
+    while (in_flight > 0 && uring_submit_and_wait(ring) == 0)
+    {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        in_flight -= tail - head;
+        __atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+    }
+
+    if (result == 0)
+    {
+        // Pick up anything appended since the stat with ordinary reads
+        lseek(src_fd, size, SEEK_SET);
+        if (dest_fd >= 0)
+            lseek(dest_fd, size, SEEK_SET);
+    }
+
+    return result;
+}
+#endif
+
+// Feed the rest of an open file to a digest, after the first head_len bytes that the caller has
+// already read into head
+int hash_fd_from(int fd, off_t size, const unsigned char *head, size_t head_len, struct hasher *hasher)
+{
+    int flags = fcntl(fd, F_GETFL);
+#ifdef O_DIRECT
+    if (hash_io_strategy == HASH_IO_DIRECT)
+        fcntl(fd, F_SETFL, flags | O_DIRECT);
+#endif
+
+    hasher_update(hasher, head, head_len);
+
+    int result;
+#ifdef VORTEX_HAVE_IO_URING
+    struct uring *ring = get_worker_ring();
+    if (ring != NULL && uring_stream(ring, fd, -1, head_len, size, hasher) == 0)
+    {
+        result = hash_fd_read(fd, hasher);
+    }
+    else
+#endif
+    {
+#ifdef VORTEX_HAVE_IO_URING
+        if (ring != NULL)
+        {
+            // Start again synchronously, which also copes with filesystems that refuse O_DIRECT
+            hasher_init(hasher);
+            hasher_update(hasher, head, head_len);
+        }
+#endif
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        if (lseek(fd, head_len, SEEK_SET) == -1)
+            result = -1;
+        else
+            result = hash_fd_read(fd, hasher);
+    }
+
+    fcntl(fd, F_SETFL, flags);
+    return result;
+}
+
+// Hash an open file into digest. The caller may already have read its first head_len bytes into head.
+int content_hash_fd(int fd, off_t size, const unsigned char *head, size_t head_len, unsigned char *digest)
+{
+    struct hasher hasher = {0};
+    hasher_init(&hasher);
+
+    int use_mmap = hash_io_strategy == HASH_IO_MMAP ||
+                   (hash_io_strategy == HASH_IO_AUTO && io_backend == IO_BACKEND_SYNC && size >= MMAP_THRESHOLD);
+    int result;
+    if (use_mmap && hash_fd_mmap(fd, size, &hasher) == 0)
+        result = 0;
+    else
+        result = hash_fd_from(fd, size, head, head_len, &hasher);
+
+    hasher_final(&hasher, digest);
+
+    return result;
+}
+
+// Hashing function, for a path relative to an open directory
+int content_hash_fileat(int dirfd, const char *path, unsigned char *digest)
+{
+    int fd = openat(dirfd, path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    int result = -1;
+    uint64_t start = now_ns();
+    if (fstat(fd, &st) == 0)
+        result = content_hash_fd(fd, st.st_size, NULL, 0, digest);
+    stage_end(STAGE_HASHING, start);
+
+    close(fd);
+    return result;
+}
+
+int content_hash_file(const char *path, unsigned char *digest)
+{
+    return content_hash_fileat(AT_FDCWD, path, digest);
+}
+
+// Stored object, keyed on its raw digest
+struct file_hash
+{
+    unsigned char digest[DIGEST_LENGTH]; // key
+    off_t size;                               // stat of the stored object, used to validate the index
+    time_t mtime;
+    ino_t ino;
+    char *path;                               // location relative to the sorted root, NULL until stored
+    uint64_t partial;                         // leading bytes of the hash of the head, middle and tail samples
+    int has_partial;                          // set once partial has been computed
+};
+
+// The set of stored objects. Entries are handed out from an arena of fixed-size blocks, so they never
+// move and cost no per-entry allocation. The set itself is an open-addressing table of one-byte tags
+// and 32-bit entry numbers; lookups compare a group of 16 tags at a time, and only entries whose tag
+// matches are compared in full. Digests are uniformly distributed already, so their leading bytes
+// serve as the hash.
+#define ENTRY_BLOCK_SHIFT 16
+#define ENTRY_BLOCK_SIZE (1u << ENTRY_BLOCK_SHIFT)
+#define PATH_BLOCK_SIZE (1 << 20)
+#define TAG_GROUP 16
+#define TAG_EMPTY 0x80
+#define TAG_DELETED 0xfe
+
+struct digest_set
+{
+    struct file_hash **blocks; // entry arena
+    size_t block_count;
+    uint32_t entry_count;      // entries handed out from the arena
+    unsigned char *tags;       // capacity tags, then the first TAG_GROUP - 1 again so groups can wrap
+    uint32_t *slots;           // entry number for each tag
+    size_t capacity;           // power of two, at least TAG_GROUP
+    size_t used;               // live entries plus deleted ones
+    size_t live;
+    char *path_blocks;         // arena for stored paths, each block starting with a link to the previous one
+    char *path_block;          // free space in the newest block
+    size_t path_left;
+    size_t path_bytes;         // total path arena allocated
+};
+
+struct digest_set file_hashes = {0};
+
+// Memory-bounded mode, enabled by --max-memory. The digest set then only buffers objects stored during
+// this run; everything older is looked up in the external digest index, and the buffer is merged into
+// it whenever batch_limit objects have piled up.
+size_t max_memory = 0;
+size_t batch_limit = 0;
+int pending_claims = 0;  // hashes claimed but not yet stored or released
+int flush_requested = 0; // set when the buffer is full; new claims wait until it has been merged
+
+// Returned by claim_hash for content that only the external digest index knows about
+struct file_hash external_duplicate;
+
+int digest_index_contains(const unsigned char *digest);
+int digest_index_location(const unsigned char *digest, uint64_t *location);
+int read_index_entry(uint64_t location, const unsigned char *digest, char *relative_path, size_t path_size, ino_t *ino);
+int digest_index_may_contain_size(off_t size);
+void flush_digest_batch(void);
+
+// Guards file_hashes, size_buckets and index_file once the workers are running.
+// hash_table_cond is signalled whenever a pending hash is stored or dropped.
+pthread_mutex_t hash_table_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t hash_table_cond = PTHREAD_COND_INITIALIZER;
+
+// Stored objects grouped by size, the first tier of duplicate detection
+struct size_bucket
+{
+    off_t size; // key
+    struct file_hash **entries;
+    int count;
+    int capacity;
+    UT_hash_handle hh;
+};
+
+struct size_bucket *size_buckets = NULL;
+
+FILE *index_file = NULL; // index opened for appending while ingesting
+
+dev_t sorted_root_device; // files on this device are moved into the store with rename()
+
+static inline uint64_t digest_key(const unsigned char *digest)
+{
+    uint64_t key;
+    memcpy(&key, digest, sizeof(key));
+    return key;
+}
+
+static inline struct file_hash *digest_entry(uint32_t n)
+{
+    return &file_hashes.blocks[n >> ENTRY_BLOCK_SHIFT][n & (ENTRY_BLOCK_SIZE - 1)];
+}
+
+// Bit mask of the tags in a group equal to tag
+static inline unsigned int match_tags(const unsigned char *group, unsigned char tag)
+{
+#ifdef __SSE2__
+    __m128i tags = _mm_loadu_si128((const __m128i *)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8((char)tag)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < TAG_GROUP; i++)
+        mask |= (unsigned int)(group[i] == tag) << i;
+    return mask;
+#endif
+}
+
+// Bit mask of the empty or deleted slots in a group; live tags never have their top bit set
+static inline unsigned int match_free(const unsigned char *group)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < TAG_GROUP; i++)
+        mask |= (unsigned int)(group[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+static inline void set_tag(size_t slot, unsigned char tag)
+{
+    file_hashes.tags[slot] = tag;
+    if (slot < TAG_GROUP - 1)
+        file_hashes.tags[file_hashes.capacity + slot] = tag;
+}
+
+// Slot holding digest, or -1
+static long find_slot(const unsigned char *digest)
+{
+    if (file_hashes.capacity == 0)
+        return -1;
+
+    uint64_t key = digest_key(digest);
+    unsigned char tag = key >> 57;
+    size_t mask = file_hashes.capacity - 1;
+    size_t pos = key & mask;
+    for (size_t probed = 0; probed < file_hashes.capacity; probed += TAG_GROUP)
+    {
+        const unsigned char *group = file_hashes.tags + pos;
+        for (unsigned int m = match_tags(group, tag); m != 0; m &= m - 1)
+        {
+            size_t slot = (pos + __builtin_ctz(m)) & mask;
+            if (memcmp(digest_entry(file_hashes.slots[slot])->digest, digest, DIGEST_LENGTH) == 0)
+                return slot;
+        }
+        if (match_tags(group, TAG_EMPTY) != 0)
+            return -1;
+        pos = (pos + TAG_GROUP) & mask;
+    }
+    return -1;
+}
+
+// Put entry n in the first free slot for its digest. The table must have room.
+static void insert_slot(uint32_t n)
+{
+    uint64_t key = digest_key(digest_entry(n)->digest);
+    size_t mask = file_hashes.capacity - 1;
+    size_t pos = key & mask;
+    unsigned int m;
+    while ((m = match_free(file_hashes.tags + pos)) == 0)
+        pos = (pos + TAG_GROUP) & mask;
+
+    size_t slot = (pos + __builtin_ctz(m)) & mask;
+    if (file_hashes.tags[slot] == TAG_EMPTY)
+        file_hashes.used++;
+    set_tag(slot, key >> 57);
+    file_hashes.slots[slot] = n;
+    file_hashes.live++;
+}
+
+// Resize the table to capacity slots, dropping deleted ones
+static int rehash_digest_set(size_t capacity)
+{
+    unsigned char *old_tags = file_hashes.tags;
+    uint32_t *old_slots = file_hashes.slots;
+    size_t old_capacity = file_hashes.capacity;
+
+    unsigned char *tags = malloc(capacity + TAG_GROUP - 1);
+    uint32_t *slots = malloc(capacity * sizeof(uint32_t));
+    if (tags == NULL || slots == NULL)
+    {
+        free(tags);
+        free(slots);
+        return -1;
+    }
+    memset(tags, TAG_EMPTY, capacity + TAG_GROUP - 1);
+
+    file_hashes.tags = tags;
+    file_hashes.slots = slots;
+    file_hashes.capacity = capacity;
+    file_hashes.used = 0;
+    file_hashes.live = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_tags[i] < TAG_EMPTY)
+            insert_slot(old_slots[i]);
+    }
+
+    free(old_tags);
+    free(old_slots);
+    return 0;
+}
+
+// Copy a stored path into the path arena
+static char *store_path(const char *path)
+{
+    size_t length = strlen(path) + 1;
+    if (length > file_hashes.path_left)
+    {
+        size_t size = sizeof(char *) + (length > PATH_BLOCK_SIZE ? length : PATH_BLOCK_SIZE);
+        char *block = malloc(size);
+        if (block == NULL)
+        {
+            file_hashes.path_left = 0;
+            return NULL;
+        }
+        memcpy(block, &file_hashes.path_blocks, sizeof(char *));
+        file_hashes.path_blocks = block;
+        file_hashes.path_block = block + sizeof(char *);
+        file_hashes.path_left = size - sizeof(char *);
+        file_hashes.path_bytes += size;
+    }
+
+    char *copy = file_hashes.path_block;
+    memcpy(copy, path, length);
+    file_hashes.path_block += length;
+    file_hashes.path_left -= length;
+    return copy;
+}
+
+// Function to add a digest to the set
+struct file_hash *add_hash(const unsigned char *digest)
+{
+    // Keep the table at most 7/8 full, counting deleted slots
+    if ((file_hashes.used + 1) * 8 > file_hashes.capacity * 7)
+    {
+        size_t capacity = file_hashes.capacity ? file_hashes.capacity : 1024;
+        while ((file_hashes.live + 1) * 8 > capacity * 7 / 2)
+            capacity *= 2;
+        if (rehash_digest_set(capacity) != 0)
+            return NULL;
+    }
+
+    uint32_t n = file_hashes.entry_count;
+    if ((n >> ENTRY_BLOCK_SHIFT) == file_hashes.block_count)
+    {
+        struct file_hash **blocks = realloc(file_hashes.blocks, (file_hashes.block_count + 1) * sizeof(*blocks));
+        if (blocks == NULL)
+            return NULL;
+        file_hashes.blocks = blocks;
+        blocks[file_hashes.block_count] = malloc(ENTRY_BLOCK_SIZE * sizeof(struct file_hash));
+        if (blocks[file_hashes.block_count] == NULL)
+            return NULL;
+        file_hashes.block_count++;
+    }
+    file_hashes.entry_count++;
+
+    struct file_hash *s = digest_entry(n);
+    memset(s, 0, sizeof(*s));
+    memcpy(s->digest, digest, DIGEST_LENGTH);
+    insert_slot(n);
+    return s;
+}
+
+// Function to find a digest in the set
+struct file_hash *find_hash(const unsigned char *digest)
+{
+    long slot = find_slot(digest);
+    return slot == -1 ? NULL : digest_entry(file_hashes.slots[slot]);
+}
+
+// Function to drop a hash whose object never made it into the store. Its arena entry is not reused;
+// this only happens when placing a file fails.
+void remove_hash(struct file_hash *s)
+{
+    long slot = find_slot(s->digest);
+    if (slot != -1)
+    {
+        set_tag(slot, TAG_DELETED);
+        file_hashes.live--;
+    }
+}
+
+// Empty the set and give its memory back. No entry may be in use.
+void reset_digest_set(void)
+{
+    for (size_t i = 0; i < file_hashes.block_count; i++)
+        free(file_hashes.blocks[i]);
+    free(file_hashes.blocks);
+    free(file_hashes.tags);
+    free(file_hashes.slots);
+
+    while (file_hashes.path_blocks != NULL)
+    {
+        char *block = file_hashes.path_blocks;
+        memcpy(&file_hashes.path_blocks, block, sizeof(char *));
+        free(block);
+    }
+
+    memset(&file_hashes, 0, sizeof(file_hashes));
+}
+
+// Print how much memory the set of stored objects takes
+void report_hash_table_memory(void)
+{
+    size_t table = file_hashes.capacity ? file_hashes.capacity + TAG_GROUP - 1 + file_hashes.capacity * sizeof(uint32_t) : 0;
+    size_t entries = file_hashes.block_count * (ENTRY_BLOCK_SIZE * sizeof(struct file_hash) + sizeof(struct file_hash *));
+    size_t buckets = 0;
+    for (struct size_bucket *b = size_buckets; b != NULL; b = b->hh.next)
+        buckets += sizeof(*b) + b->capacity * sizeof(struct file_hash *);
+
+    log_info("Stored objects: %zu, using %.1f MiB (table %.1f, entries %.1f, paths %.1f, size buckets %.1f)\n",
+             file_hashes.live, (table + entries + file_hashes.path_bytes + buckets) / 1048576.0, table / 1048576.0,
+             entries / 1048576.0, file_hashes.path_bytes / 1048576.0, buckets / 1048576.0);
+}
+
+// Atomically look up a digest and add it if it is missing. A hash added here is pending until
+// record_stored_object or release_hash; other workers with the same content wait for that outcome,
+// so identical files racing through different workers still leave exactly one copy.
+// Sets *duplicate when the content is already stored, and copies where the stored object is and its
+// inode into stored_path and *stored_ino, as in memory-bounded mode its entry may be gone as soon as
+// the lock is dropped. stored_path is left empty if its location can't be read. Returns NULL if the
+// set can't grow.
+struct file_hash *claim_hash(const unsigned char *digest, int *duplicate, char *stored_path, size_t path_size,
+                             ino_t *stored_ino)
+{
+    struct file_hash *s;
+    uint64_t location = 0;
+    stored_path[0] = '\0';
+    *stored_ino = 0;
+
+    pthread_mutex_lock(&hash_table_lock);
+    for (;;)
+    {
+        s = find_hash(digest);
+        if (s == NULL && max_memory != 0 && digest_index_location(digest, &location))
+        {
+            s = &external_duplicate;
+            *duplicate = 1;
+            break;
+        }
+        if (s == NULL && !flush_requested)
+        {
+            s = add_hash(digest);
+            if (s != NULL)
+                pending_claims++;
+            *duplicate = 0;
+            break;
+        }
+        if (s != NULL && s->path != NULL)
+        {
+            snprintf(stored_path, path_size, "%s", s->path);
+            *stored_ino = s->ino;
+            *duplicate = 1;
+            break;
+        }
+        pthread_cond_wait(&hash_table_cond, &hash_table_lock);
+    }
+    pthread_mutex_unlock(&hash_table_lock);
+
+    // Objects only the digest index knows about are found through their entry in the text index
+    if (s == &external_duplicate && read_index_entry(location, digest, stored_path, path_size, stored_ino) != 0)
+        stored_path[0] = '\0';
+    return s;
+}
+
+// Called with hash_table_lock held whenever a claim is stored or released. In memory-bounded mode
+// this merges the buffer into the external index once it is full and the last open claim is done.
+void claim_resolved(void)
+{
+    pending_claims--;
+    if (max_memory == 0)
+        return;
+
+    if (file_hashes.live >= batch_limit)
+        flush_requested = 1;
+    if (flush_requested && pending_claims == 0)
+    {
+        flush_digest_batch();
+        flush_requested = 0;
+    }
+}
+
+// Drop a claimed hash whose object never made it into the store
+void release_hash(struct file_hash *s)
+{
+    pthread_mutex_lock(&hash_table_lock);
+    remove_hash(s);
+    claim_resolved();
+    pthread_cond_broadcast(&hash_table_cond);
+    pthread_mutex_unlock(&hash_table_lock);
+}
+
+struct size_bucket *find_size_bucket(off_t size)
+{
+    struct size_bucket *b;
+    HASH_FIND(hh, size_buckets, &size, sizeof(off_t), b);
+    return b;
+}
+
+// Returns -1 if the bucket can't grow
+int add_to_size_bucket(struct file_hash *s)
+{
+    struct size_bucket *b = find_size_bucket(s->size);
+    if (b == NULL)
+    {
+        b = calloc(1, sizeof(struct size_bucket));
+        if (b == NULL)
+            return -1;
+        b->size = s->size;
+        HASH_ADD(hh, size_buckets, size, sizeof(off_t), b);
+    }
+
+    if (b->count == b->capacity)
+    {
+        int capacity = b->capacity ? b->capacity * 2 : 1;
+        struct file_hash **entries = realloc(b->entries, capacity * sizeof(struct file_hash *));
+        if (entries == NULL)
+            return -1;
+        b->entries = entries;
+        b->capacity = capacity;
+    }
+    b->entries[b->count++] = s;
+    return 0;
+}
+
+// Remember where a hashed object lives in the store and what it looked like on disk.
+// Called once per entry, when the object is known to be in the store.
+void set_hash_location(struct file_hash *s, const char *relative_path, const struct stat *st)
+{
+    s->path = store_path(relative_path);
+    s->size = st->st_size;
+    s->mtime = st->st_mtime;
+    s->ino = st->st_ino;
+    if (add_to_size_bucket(s) != 0)
+    {
+        // The digest still finds duplicates of it; only the cheap check by size and samples misses them
+        log_error("Out of memory adding to size bucket: %s\n", relative_path);
+        count_error(ERROR_MEMORY);
+    }
+}
+
+// Reads content the way pread reads a file: up to len bytes at offset, returning how many, 0 at the
+// end or -1 on errors
+typedef ssize_t (*content_reader)(void *ctx, void *buffer, size_t len, off_t offset);
+
+ssize_t read_fd_content(void *ctx, void *buffer, size_t len, off_t offset)
+{
+    return pread(*(int *)ctx, buffer, len, offset);
+}
+
+#ifdef VORTEX_WITH_XXHASH
+// XXH3 of the first size bytes of some content, after the first head_len bytes that the caller has
+// already read into head
+int xxh3_hash_content(content_reader read, void *ctx, off_t size, const unsigned char *head, size_t head_len, uint64_t *hash)
+{
+    char *buffer = get_io_buffer();
+    XXH3_state_t *state = XXH3_createState();
+    if (buffer == NULL || state == NULL)
+    {
+        XXH3_freeState(state);
+        return -1;
+    }
+
+    XXH3_64bits_reset(state);
+    XXH3_64bits_update(state, head, head_len);
+    off_t offset = head_len;
+    ssize_t n = 0;
+    while (offset < size && (n = read(ctx, buffer, size - offset < IO_BUF_SIZE ? size - offset : IO_BUF_SIZE, offset)) > 0)
+    {
+        XXH3_64bits_update(state, buffer, n);
+        offset += n;
+    }
+
+    *hash = XXH3_64bits_digest(state);
+    XXH3_freeState(state);
+    return n < 0 ? -1 : 0;
+}
+#endif
+
+// Fingerprint an open file for the duplicate check. The sampled prefilter hashes its head, middle and
+// tail blocks, or all of it if it is too small to sample; the XXH3 prefilter hashes all of it, which
+// costs a fast extra read but means only actual duplicates pay for the full hash before they are
+// placed. The caller may already have read the first head_len bytes into head, or all of it.
+int partial_hash_content(content_reader read, void *ctx, off_t size, const unsigned char *head, size_t head_len,
+                         uint64_t *partial)
+{
+#ifdef VORTEX_WITH_XXHASH
+    if (prefilter == PREFILTER_XXH3)
+        return xxh3_hash_content(read, ctx, size, head, head_len, partial);
+#endif
+
+    struct hasher hasher = {0};
+    hasher_init(&hasher);
+
+    char buffer[PARTIAL_BLOCK_SIZE];
+    int result = 0;
+    if (size <= 3 * PARTIAL_BLOCK_SIZE)
+    {
+        hasher_update(&hasher, head, head_len);
+
+        off_t offset = head_len;
+        ssize_t bytesRead = 0;
+        while (offset < size && (bytesRead = read(ctx, buffer, size - offset < (off_t)sizeof(buffer) ? size - offset : (off_t)sizeof(buffer), offset)) > 0)
+        {
+            hasher_update(&hasher, buffer, bytesRead);
+            offset += bytesRead;
+        }
+        if (bytesRead < 0)
+            result = -1;
+    }
+    else
+    {
+        off_t offsets[3] = {0, size / 2 - PARTIAL_BLOCK_SIZE / 2, size - PARTIAL_BLOCK_SIZE};
+        for (int i = 0; i < 3 && result == 0; i++)
+        {
+            if (offsets[i] + PARTIAL_BLOCK_SIZE <= (off_t)head_len)
+                hasher_update(&hasher, head + offsets[i], PARTIAL_BLOCK_SIZE);
+            else if (read(ctx, buffer, sizeof(buffer), offsets[i]) != sizeof(buffer))
+                result = -1;
+            else
+                hasher_update(&hasher, buffer, sizeof(buffer));
+        }
+    }
+
+    unsigned char digest[DIGEST_LENGTH];
+    hasher_final(&hasher, digest);
+    memcpy(partial, digest, sizeof(*partial));
+
+    return result;
+}
+
+int partial_hash_fd(int fd, off_t size, const unsigned char *head, size_t head_len, uint64_t *partial)
+{
+    return partial_hash_content(read_fd_content, &fd, size, head, head_len, partial);
+}
+
+// Each object in a pack file is a header followed by the extension its file had, then its content.
+// A packed object's location is "<mime>/.vortex-packs/pack-<n>#<offset of its header>".
+#define PACK_MAGIC "VXPK"
+
+struct pack_record
+{
+    char magic[4];
+    uint32_t extension_length;
+    uint64_t size;
+    unsigned char digest[DIGEST_LENGTH];
+};
+
+// A chunked object's manifest: a header line with the object's size and hash, then a line with the
+// hash and length of each chunk in order
+struct manifest_chunk
+{
+    unsigned char digest[DIGEST_LENGTH];
+    off_t offset;
+    uint32_t length;
+};
+
+struct manifest
+{
+    const char *sorted_root_directory;
+    off_t size;
+    unsigned char digest[DIGEST_LENGTH];
+    long count;
+    struct manifest_chunk *chunks;
+    long open_chunk; // chunk that chunk_fd has open, -1 if none
+    int chunk_fd;
+};
+
+int is_manifest(const char *relative_path)
+{
+    size_t length = strlen(relative_path);
+    return length > strlen(MANIFEST_SUFFIX) &&
+           strcmp(relative_path + length - strlen(MANIFEST_SUFFIX), MANIFEST_SUFFIX) == 0;
+}
+
+// Chunks are spread over directories named after the first two hex digits of their hash
+void chunk_path(const char *sorted_root_directory, const unsigned char *digest, char *path, size_t size)
+{
+    char hex[2 * DIGEST_LENGTH + 1];
+    digest_to_hex(digest, hex);
+    snprintf(path, size, "%s/%s/%.2s/%s", sorted_root_directory, CHUNK_DIR_NAME, hex, hex);
+}
+
+// Read the header of a manifest. Returns the open file, positioned at the first chunk, or NULL.
+FILE *open_manifest(const char *sorted_root_directory, const char *relative_path, off_t *size, unsigned char *digest)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", sorted_root_directory, relative_path);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+
+    char line[256];
+    char hex[2 * DIGEST_LENGTH + 1];
+    int version;
+    long long object_size;
+    if (fgets(line, sizeof(line), file) == NULL ||
+        sscanf(line, "vortex-manifest %d %lld %64s", &version, &object_size, hex) != 3 ||
+        version != MANIFEST_VERSION || hex_to_digest(hex, digest) != 0)
+    {
+        fclose(file);
+        errno = EINVAL;
+        return NULL;
+    }
+    *size = object_size;
+    return file;
+}
+
+// Load a manifest to read the object's content with read_manifest_content. Returns -1 if it is
+// missing or damaged.
+int load_manifest(const char *sorted_root_directory, const char *relative_path, struct manifest *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->sorted_root_directory = sorted_root_directory;
+    m->open_chunk = -1;
+    m->chunk_fd = -1;
+    FILE *file = open_manifest(sorted_root_directory, relative_path, &m->size, m->digest);
+    if (file == NULL)
+        return -1;
+
+    char line[256];
+    char hex[2 * DIGEST_LENGTH + 1];
+    unsigned length;
+    long capacity = 0;
+    off_t offset = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "%64s %u", hex, &length) != 2)
+            continue;
+        if (m->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            struct manifest_chunk *chunks = realloc(m->chunks, capacity * sizeof(*chunks));
+            if (chunks == NULL)
+                break;
+            m->chunks = chunks;
+        }
+        struct manifest_chunk *chunk = &m->chunks[m->count];
+        if (hex_to_digest(hex, chunk->digest) != 0)
+            break;
+        chunk->offset = offset;
+        chunk->length = length;
+        offset += length;
+        m->count++;
+    }
+    fclose(file);
+
+    if (offset != m->size)
+    {
+        free(m->chunks);
+        m->chunks = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void free_manifest(struct manifest *m)
+{
+    if (m->chunk_fd != -1)
+        close(m->chunk_fd);
+    free(m->chunks);
+}
+
+// content_reader for a manifest, which reads across chunks until len bytes or the end
+ssize_t read_manifest_content(void *ctx, void *buffer, size_t len, off_t offset)
+{
+    struct manifest *m = ctx;
+    size_t done = 0;
+    while (done < len && offset < m->size)
+    {
+        // Find the chunk holding offset
+        long low = 0, high = m->count - 1;
+        while (low < high)
+        {
+            long mid = (low + high + 1) / 2;
+            if (m->chunks[mid].offset <= offset)
+                low = mid;
+            else
+                high = mid - 1;
+        }
+        struct manifest_chunk *chunk = &m->chunks[low];
+
+        if (m->open_chunk != low)
+        {
+            if (m->chunk_fd != -1)
+                close(m->chunk_fd);
+            char path[PATH_MAX];
+            chunk_path(m->sorted_root_directory, chunk->digest, path, sizeof(path));
+            m->chunk_fd = open(path, O_RDONLY | O_CLOEXEC);
+            m->open_chunk = m->chunk_fd == -1 ? -1 : low;
+            if (m->chunk_fd == -1)
+                return -1;
+        }
+
+        off_t within = offset - chunk->offset;
+        if (within >= chunk->length)
+            return -1; // the chunks don't cover offset
+        size_t left = (size_t)(chunk->length - within);
+        size_t wanted = len - done < left ? len - done : left;
+        ssize_t n = pread(m->chunk_fd, (char *)buffer + done, wanted, within);
+        if (n <= 0)
+            return -1; // a chunk is shorter than its manifest says
+        done += n;
+        offset += n;
+    }
+    return done;
+}
+
+int is_compressed(const char *relative_path)
+{
+    size_t length = strlen(relative_path);
+    return length > strlen(COMPRESSED_SUFFIX) &&
+           strcmp(relative_path + length - strlen(COMPRESSED_SUFFIX), COMPRESSED_SUFFIX) == 0;
+}
+
+#ifdef VORTEX_WITH_ZSTD
+// A compressed object being read. Its zstd frame can only be decompressed from the start, so reads
+// must mostly move forwards: a read behind the last one starts again from the beginning.
+struct compressed_object
+{
+    int fd;
+    off_t size;          // of the uncompressed content
+    off_t position;      // uncompressed bytes produced so far
+    off_t input_offset;  // compressed bytes read so far
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer input;
+    unsigned char *input_buffer;
+    unsigned char *skip_buffer; // for content before the offset that was asked for
+};
+
+// Read the uncompressed size and dictionary id from the frame header of an open compressed object.
+// Objects are always compressed with their size recorded. Returns -1 if the header isn't valid.
+int read_compressed_header(int fd, off_t *size, unsigned *dictionary)
+{
+    unsigned char header[18]; // the largest a frame header can be
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    unsigned long long content_size = n > 0 ? ZSTD_getFrameContentSize(header, n) : ZSTD_CONTENTSIZE_ERROR;
+    if (content_size == ZSTD_CONTENTSIZE_ERROR || content_size == ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *size = content_size;
+    if (dictionary != NULL)
+        *dictionary = ZSTD_getDictID_fromFrame(header, n);
+    return 0;
+}
+
+// Read a dictionary from the sorted root into a new buffer, which the caller frees
+void *read_dictionary(const char *sorted_root_directory, unsigned id, size_t *size)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s%u", sorted_root_directory, DICTIONARY_PREFIX, id);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    void *data = NULL;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= DICTIONARY_MAX_SIZE &&
+        (data = malloc(st.st_size)) != NULL && pread(fd, data, st.st_size, 0) != st.st_size)
+    {
+        free(data);
+        data = NULL;
+    }
+    if (fd != -1)
+        close(fd);
+    if (data == NULL)
+        log_error("Error reading dictionary: %s (%s)\n", path, strerror(errno));
+    *size = data ? st.st_size : 0;
+    return data;
+}
+
+void close_compressed(struct compressed_object *c)
+{
+    if (c->fd != -1)
+        close(c->fd);
+    ZSTD_freeDCtx(c->dctx);
+    free(c->input_buffer);
+    free(c->skip_buffer);
+}
+
+// Open a compressed object to read its content with read_compressed_content. Returns -1 on errors.
+int open_compressed(const char *sorted_root_directory, const char *relative_path, struct compressed_object *c)
+{
+    memset(c, 0, sizeof(*c));
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", sorted_root_directory, relative_path);
+    unsigned dictionary = 0;
+    c->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (c->fd == -1 || read_compressed_header(c->fd, &c->size, &dictionary) != 0 ||
+        (c->dctx = ZSTD_createDCtx()) == NULL || (c->input_buffer = malloc(ZSTD_DStreamInSize())) == NULL ||
+        (c->skip_buffer = malloc(ZSTD_DStreamOutSize())) == NULL)
+    {
+        close_compressed(c);
+        return -1;
+    }
+    c->input.src = c->input_buffer;
+
+    if (dictionary != 0)
+    {
+        size_t size;
+        void *data = read_dictionary(sorted_root_directory, dictionary, &size);
+        size_t loaded = data ? ZSTD_DCtx_loadDictionary(c->dctx, data, size) : 0;
+        free(data);
+        if (data == NULL || ZSTD_isError(loaded))
+        {
+            close_compressed(c);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// content_reader for a compressed object
+ssize_t read_compressed_content(void *ctx, void *buffer, size_t len, off_t offset)
+{
+    struct compressed_object *c = ctx;
+    if (offset < c->position)
+    {
+        ZSTD_DCtx_reset(c->dctx, ZSTD_reset_session_only);
+        c->position = 0;
+        c->input_offset = 0;
+        c->input.size = c->input.pos = 0;
+    }
+
+    size_t done = 0;
+    while (done < len && c->position < c->size)
+    {
+        int skipping = c->position < offset;
+        ZSTD_outBuffer output = {(char *)buffer + done, len - done, 0};
+        if (skipping)
+        {
+            output.dst = c->skip_buffer;
+            output.size = offset - c->position < (off_t)ZSTD_DStreamOutSize() ? offset - c->position : ZSTD_DStreamOutSize();
+        }
+        if (c->input.pos == c->input.size)
+        {
+            ssize_t n = pread(c->fd, c->input_buffer, ZSTD_DStreamInSize(), c->input_offset);
+            if (n < 0)
+                return -1;
+            c->input_offset += n;
+            c->input.size = n;
+            c->input.pos = 0;
+        }
+
+        size_t result = ZSTD_decompressStream(c->dctx, &output, &c->input);
+        if (ZSTD_isError(result) || (output.pos == 0 && c->input.size == 0))
+        {
+            // Damaged, or shorter than its header says
+            errno = EINVAL;
+            return -1;
+        }
+        c->position += output.pos;
+        if (!skipping)
+            done += output.pos;
+    }
+    return done;
+}
+#endif
+
+// Split the location of a packed object into the path of its pack, relative like the location, and
+// the offset of its record. Returns 0 for objects stored as files of their own.
+int packed_location(const char *relative_path, char *pack_path, size_t size, off_t *record)
+{
+    const char *mark = strrchr(relative_path, '#');
+    const char *dir = strstr(relative_path, "/" PACK_DIR_NAME "/");
+    if (mark == NULL || dir == NULL || dir > mark)
+        return 0;
+
+    char *end;
+    long long offset = strtoll(mark + 1, &end, 10);
+    if (*end != '\0' || offset < 0)
+        return 0;
+    snprintf(pack_path, size, "%.*s", (int)(mark - relative_path), relative_path);
+    *record = offset;
+    return 1;
+}
+
+// Read the header of the record at offset in an open pack of pack_size bytes. Returns the offset of
+// the next record, or -1 if there is no complete record there.
+off_t read_pack_record(int fd, off_t offset, off_t pack_size, struct pack_record *header)
+{
+    if (pread(fd, header, sizeof(*header), offset) != sizeof(*header) ||
+        memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) != 0 || header->extension_length > NAME_MAX)
+        return -1;
+
+    off_t end = offset + sizeof(*header) + header->extension_length + header->size;
+    return header->size <= PACK_THRESHOLD_LIMIT && end <= pack_size ? end : -1;
+}
+
+// Open a stored object for reading. *offset and *size give where its content is in the file, which is
+// all of it unless it is packed. Returns the descriptor, or -1 on errors.
+int open_object(const char *sorted_root_directory, const char *relative_path, off_t *offset, off_t *size, struct stat *st)
+{
+    char pack_path[PATH_MAX];
+    char path[PATH_MAX];
+    off_t record = 0;
+    int packed = packed_location(relative_path, pack_path, sizeof(pack_path), &record);
+    if (format_path(path, sizeof(path), "%s/%s", sorted_root_directory, packed ? pack_path : relative_path) != 0)
+        return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode))
+    {
+        close(fd);
+        return -1;
+    }
+    *offset = 0;
+    *size = st->st_size;
+    if (!packed)
+        return fd;
+
+    struct pack_record header;
+    if (read_pack_record(fd, record, st->st_size, &header) == -1)
+    {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    *offset = record + sizeof(header) + header.extension_length;
+    *size = header.size;
+    return fd;
+}
+
+// stat a stored object. For a packed object, this is the stat of its pack with the object's size; the
+// pack's time changes as it grows, so it is left out.
+int stat_object(const char *sorted_root_directory, const char *relative_path, struct stat *st)
+{
+    char path[PATH_MAX];
+    off_t record;
+    if (is_manifest(relative_path))
+    {
+        // The manifest's own times and inode, which never change, and the object's size
+        off_t size;
+        unsigned char digest[DIGEST_LENGTH];
+        snprintf(path, sizeof(path), "%s/%s", sorted_root_directory, relative_path);
+        FILE *file = stat(path, st) == 0 ? open_manifest(sorted_root_directory, relative_path, &size, digest) : NULL;
+        if (file == NULL)
+            return -1;
+        fclose(file);
+        st->st_size = size;
+        return 0;
+    }
+#ifdef VORTEX_WITH_ZSTD
+    if (is_compressed(relative_path))
+    {
+        // The compressed file's own times and inode, and the object's size from its frame header
+        snprintf(path, sizeof(path), "%s/%s", sorted_root_directory, relative_path);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        off_t size;
+        int result = fd != -1 && fstat(fd, st) == 0 && read_compressed_header(fd, &size, NULL) == 0 ? 0 : -1;
+        if (fd != -1)
+            close(fd);
+        if (result == 0)
+            st->st_size = size;
+        return result;
+    }
+#endif
+    if (!packed_location(relative_path, path, sizeof(path), &record))
+    {
+        snprintf(path, sizeof(path), "%s/%s", sorted_root_directory, relative_path);
+        return stat(path, st);
+    }
+
+    off_t offset, size;
+    int fd = open_object(sorted_root_directory, relative_path, &offset, &size, st);
+    if (fd == -1)
+        return -1;
+    close(fd);
+    st->st_size = size;
+    st->st_mtime = 0;
+    return 0;
+}
+
+// Read all of a packed object into a new buffer, which the caller frees
+unsigned char *read_packed_content(int fd, off_t offset, off_t size)
+{
+    unsigned char *data = malloc(size ? size : 1);
+    if (data != NULL && pread(fd, data, size, offset) != size)
+    {
+        free(data);
+        data = NULL;
+    }
+    return data;
+}
+
+// Hash size bytes of content read through a content_reader into digest
+int content_hash_reader(content_reader read, void *ctx, off_t size, unsigned char *digest)
+{
+    char *buffer = get_io_buffer();
+    struct hasher hasher = {0};
+    hasher_init(&hasher);
+    off_t offset = 0;
+    ssize_t n = 0;
+    while (buffer != NULL && offset < size && (n = read(ctx, buffer, IO_BUF_SIZE, offset)) > 0)
+    {
+        hasher_update(&hasher, buffer, n);
+        offset += n;
+    }
+    hasher_final(&hasher, digest);
+    return offset == size ? 0 : -1;
+}
+
+// Hash a stored object's content into digest, however it is stored
+int content_hash_object(const char *sorted_root_directory, const char *relative_path, unsigned char *digest)
+{
+    if (is_manifest(relative_path))
+    {
+        struct manifest m;
+        if (load_manifest(sorted_root_directory, relative_path, &m) != 0)
+            return -1;
+        int result = content_hash_reader(read_manifest_content, &m, m.size, digest);
+        free_manifest(&m);
+        return result;
+    }
+#ifdef VORTEX_WITH_ZSTD
+    if (is_compressed(relative_path))
+    {
+        struct compressed_object c;
+        if (open_compressed(sorted_root_directory, relative_path, &c) != 0)
+            return -1;
+        int result = content_hash_reader(read_compressed_content, &c, c.size, digest);
+        close_compressed(&c);
+        return result;
+    }
+#endif
+
+    off_t offset, size;
+    struct stat st;
+    int fd = open_object(sorted_root_directory, relative_path, &offset, &size, &st);
+    if (fd == -1)
+        return -1;
+
+    int result = -1;
+    if (offset == 0)
+    {
+        result = content_hash_fd(fd, size, NULL, 0, digest);
+    }
+    else
+    {
+        unsigned char *data = read_packed_content(fd, offset, size);
+        if (data != NULL)
+        {
+            struct hasher hasher = {0};
+            hasher_init(&hasher);
+            hasher_update(&hasher, data, size);
+            hasher_final(&hasher, digest);
+            free(data);
+            result = 0;
+        }
+    }
+    close(fd);
+    return result;
+}
+
+int partial_hash_object(const char *sorted_root_directory, const char *relative_path, off_t size, uint64_t *partial)
+{
+    if (is_manifest(relative_path))
+    {
+        struct manifest m;
+        if (load_manifest(sorted_root_directory, relative_path, &m) != 0)
+            return -1;
+        int result = partial_hash_content(read_manifest_content, &m, m.size, NULL, 0, partial);
+        free_manifest(&m);
+        return result;
+    }
+#ifdef VORTEX_WITH_ZSTD
+    if (is_compressed(relative_path))
+    {
+        struct compressed_object c;
+        if (open_compressed(sorted_root_directory, relative_path, &c) != 0)
+            return -1;
+        int result = partial_hash_content(read_compressed_content, &c, c.size, NULL, 0, partial);
+        close_compressed(&c);
+        return result;
+    }
+#endif
+
+    off_t offset, object_size;
+    struct stat st;
+    int fd = open_object(sorted_root_directory, relative_path, &offset, &object_size, &st);
+    if (fd == -1)
+        return -1;
+
+    int result = -1;
+    if (offset == 0)
+    {
+        result = partial_hash_fd(fd, size, NULL, 0, partial);
+    }
+    else
+    {
+        unsigned char *data = read_packed_content(fd, offset, object_size);
+        if (data != NULL)
+            result = partial_hash_fd(-1, object_size, data, object_size, partial);
+        free(data);
+    }
+    close(fd);
+    return result;
+}
+
+// The hash an object claims to have: the one a packed object's record or a manifest holds, or else the
+// one it is named after. Returns -1 if there is none.
+int object_digest(const char *sorted_root_directory, const char *relative_path, unsigned char *digest)
+{
+    char pack_path[PATH_MAX];
+    off_t record;
+    if (is_manifest(relative_path))
+    {
+        off_t size;
+        FILE *file = open_manifest(sorted_root_directory, relative_path, &size, digest);
+        if (file == NULL)
+            return -1;
+        fclose(file);
+        return 0;
+    }
+    if (packed_location(relative_path, pack_path, sizeof(pack_path), &record))
+    {
+        char path[PATH_MAX];
+        if (format_path(path, sizeof(path), "%s/%s", sorted_root_directory, pack_path) != 0)
+            return -1;
+        struct pack_record header;
+        struct stat st;
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        int result = fd != -1 && fstat(fd, &st) == 0 && read_pack_record(fd, record, st.st_size, &header) != -1 ? 0 : -1;
+        if (result == 0)
+            memcpy(digest, header.digest, DIGEST_LENGTH);
+        if (fd != -1)
+            close(fd);
+        return result;
+    }
+
+    const char *base = strrchr(relative_path, '/');
+    base = base ? base + 1 : relative_path;
+    char hex[2 * DIGEST_LENGTH + 1];
+    snprintf(hex, sizeof(hex), "%s", base);
+    return hex_to_digest(hex, digest);
+}
+
+// Decide whether a file could duplicate a stored object without reading all of it.
+// Returns 0 when it is certainly unique, 1 when only the full hash can tell.
+int may_be_duplicate(int fd, const unsigned char *head, size_t head_len, off_t size, const char *sorted_root_directory)
+{
+    if (max_memory != 0)
+    {
+        // Only the sizes of objects in the external index are known, so there is nothing to sample
+        pthread_mutex_lock(&hash_table_lock);
+        int known = find_size_bucket(size) != NULL || digest_index_may_contain_size(size);
+        pthread_mutex_unlock(&hash_table_lock);
+        return known;
+    }
+
+    // No stored object has this size
+    pthread_mutex_lock(&hash_table_lock);
+    struct size_bucket *b = find_size_bucket(size);
+    if (b == NULL)
+    {
+        pthread_mutex_unlock(&hash_table_lock);
+        return 0;
+    }
+
+    // Stored entries are never freed, so a snapshot of the bucket stays valid without the lock
+    int count = b->count;
+    struct file_hash **entries = malloc(count * sizeof(struct file_hash *));
+    if (entries == NULL)
+    {
+        // Leave it to the full hash
+        pthread_mutex_unlock(&hash_table_lock);
+        log_error("Out of memory checking for duplicates of size %lld\n", (long long)size);
+        count_error(ERROR_MEMORY);
+        return 1;
+    }
+    memcpy(entries, b->entries, count * sizeof(struct file_hash *));
+    pthread_mutex_unlock(&hash_table_lock);
+
+    uint64_t partial = 0;
+    int result = 0;
+    if (partial_hash_fd(fd, size, head, head_len, &partial) != 0)
+        result = 1;
+
+    for (int i = 0; i < count && result == 0; i++)
+    {
+        struct file_hash *s = entries[i];
+        uint64_t sample = 0;
+
+        pthread_mutex_lock(&hash_table_lock);
+        int has_partial = s->has_partial;
+        if (has_partial)
+            sample = s->partial;
+        pthread_mutex_unlock(&hash_table_lock);
+
+        if (!has_partial)
+        {
+            // Sample stored objects lazily, the first time something of the same size turns up
+            if (partial_hash_object(sorted_root_directory, s->path, size, &sample) != 0)
+            {
+                result = 1;
+                break;
+            }
+
+            pthread_mutex_lock(&hash_table_lock);
+            s->partial = sample;
+            s->has_partial = 1;
+            pthread_mutex_unlock(&hash_table_lock);
+        }
+
+        if (partial == sample)
+            result = 1;
+    }
+
+    free(entries);
+    return result;
+}
+
+void write_index_entry(FILE *file, const struct file_hash *s)
+{
+    char hex[2 * DIGEST_LENGTH + 1];
+    digest_to_hex(s->digest, hex);
+    fprintf(file, "%s %lld %lld %llu %s\n", hex, (long long)s->size, (long long)s->mtime,
+            (unsigned long long)s->ino, s->path);
+}
+
+// Split an index line into its fields. relative_path points into line. Returns -1 if it is malformed.
+int parse_index_line(char *line, unsigned char *digest, struct stat *st, const char **relative_path)
+{
+    line[strcspn(line, "\n")] = '\0';
+
+    char hash[2 * DIGEST_LENGTH + 1];
+    long long size, mtime;
+    unsigned long long ino;
+    int offset = 0;
+    if (sscanf(line, "%64s %lld %lld %llu %n", hash, &size, &mtime, &ino, &offset) != 4 || offset == 0 ||
+        hex_to_digest(hash, digest) != 0)
+        return -1;
+
+    memset(st, 0, sizeof(*st));
+    st->st_size = size;
+    st->st_mtime = mtime;
+    st->st_ino = ino;
+    *relative_path = line + offset;
+    return 0;
+}
+
+// Whether the sorted root holds anything besides Vortex's own files
+int store_has_objects(const char *sorted_root_directory)
+{
+    DIR *d = opendir(sorted_root_directory);
+    if (d == NULL)
+        return 0;
+
+    struct dirent *entry;
+    int found = 0;
+    while (!found && (entry = readdir(d)) != NULL)
+        found = strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0 && strncmp(entry->d_name, ".vortex", 7) != 0;
+    closedir(d);
+    return found;
+}
+
+// Parse a layout: "flat", or the number of hex digits for each directory level, such as "2/2".
+// Returns -1 if it is malformed.
+int parse_layout(const char *text, struct layout *layout)
+{
+    memset(layout, 0, sizeof(*layout));
+    if (strcmp(text, "flat") == 0)
+        return 0;
+
+    for (;;)
+    {
+        char *end;
+        long width = strtol(text, &end, 10);
+        if (end == text || width < 1 || width > 4 || layout->levels == LAYOUT_MAX_LEVELS)
+            return -1;
+        layout->widths[layout->levels++] = width;
+        if (*end == '\0')
+            return 0;
+        if (*end != '/')
+            return -1;
+        text = end + 1;
+    }
+}
+
+void format_layout(const struct layout *layout, char *buffer, size_t size)
+{
+    if (layout->levels == 0)
+    {
+        snprintf(buffer, size, "flat");
+        return;
+    }
+    size_t used = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < layout->levels && used < size; i++)
+        used += snprintf(buffer + used, size - used, "%s%d", i ? "/" : "", layout->widths[i]);
+}
+
+int same_layout(const struct layout *a, const struct layout *b)
+{
+    if (a->levels != b->levels)
+        return 0;
+    for (int i = 0; i < a->levels; i++)
+    {
+        if (a->widths[i] != b->widths[i])
+            return 0;
+    }
+    return 1;
+}
+
+// The directories an object named hash goes in below its MIME directory, such as "ab/cd", or ""
+void shard_directory(const struct layout *layout, const char *hash, char *buffer, size_t size)
+{
+    size_t used = 0;
+    int offset = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < layout->levels && used < size; i++)
+    {
+        used += snprintf(buffer + used, size - used, "%s%.*s", i ? "/" : "", layout->widths[i], hash + offset);
+        offset += layout->widths[i];
+    }
+}
+
+// Types worth compressing at compress_level, and types whose content is compressed already, which are
+// never compressed again whatever the rules say
+static const char *compressible_types[] = {
+    "text/*", "application/json", "application/xml", "application/javascript", "application/x-httpd-php",
+    "application/x-sh", "application/sql", "application/x-tar", "application/msword", "application/x-executable",
+    "application/x-sharedlib", "image/svg+xml", "image/bmp", "image/x-ms-bmp", "image/tiff",
+    "image/vnd.adobe.photoshop", NULL};
+
+static const char *precompressed_types[] = {
+    "image/jpeg", "image/png", "image/gif", "image/webp", "image/avif", "image/heic", "image/heif", "video/*",
+    "audio/mpeg", "audio/aac", "audio/ogg", "audio/opus", "audio/flac", "audio/mp4", "audio/x-m4a",
+    "application/zip", "application/gzip", "application/x-gzip", "application/x-bzip2", "application/x-xz",
+    "application/zstd", "application/x-7z-compressed", "application/x-rar", "application/vnd.rar",
+    "application/java-archive", "application/epub+zip", "application/pdf",
+    "application/vnd.openxmlformats-officedocument.*", NULL};
+
+// Whether a MIME type, in either separated form, matches a pattern: a type, or a prefix ending in "*"
+// such as "text/*"
+int type_matches(const char *pattern, const char *type)
+{
+    size_t length = strlen(pattern);
+    int prefix = length > 0 && pattern[length - 1] == '*';
+    if (prefix)
+        length--;
+    for (size_t i = 0; i < length; i++)
+    {
+        char c = type[i] == '\\' ? '/' : type[i];
+        if (c != pattern[i])
+            return 0;
+    }
+    return prefix || type[length] == '\0';
+}
+
+// The level to compress a type at, 0 for none, and the rule that decided it if one did
+int compression_level(const char *type, const struct compression_rule **rule)
+{
+    *rule = NULL;
+    for (int i = 0; precompressed_types[i] != NULL; i++)
+    {
+        if (type_matches(precompressed_types[i], type))
+            return 0;
+    }
+    // Rules for single types come before rules for several
+    for (int wildcards = 0; wildcards < 2; wildcards++)
+    {
+        for (int i = 0; i < compression_rule_count; i++)
+        {
+            if ((strchr(compression_rules[i].pattern, '*') != NULL) == wildcards &&
+                type_matches(compression_rules[i].pattern, type))
+            {
+                *rule = &compression_rules[i];
+                return compression_rules[i].level;
+            }
+        }
+    }
+    for (int i = 0; compressible_types[i] != NULL; i++)
+    {
+        if (type_matches(compressible_types[i], type))
+            return compress_level;
+    }
+    return 0;
+}
+
+// Add or change the rule for a type. Returns -1 if out of memory.
+int set_compression_rule(const char *pattern, int level, unsigned dictionary)
+{
+    for (int i = 0; i < compression_rule_count; i++)
+    {
+        if (strcmp(compression_rules[i].pattern, pattern) == 0)
+        {
+            compression_rules[i].level = level;
+            compression_rules[i].dictionary = dictionary;
+            return 0;
+        }
+    }
+
+    struct compression_rule *rules = realloc(compression_rules, (compression_rule_count + 1) * sizeof(*rules));
+    char *copy = strdup(pattern);
+    if (rules == NULL || copy == NULL)
+    {
+        free(copy);
+        if (rules != NULL)
+            compression_rules = rules;
+        return -1;
+    }
+    compression_rules = rules;
+    compression_rules[compression_rule_count++] = (struct compression_rule){.pattern = copy, .level = level,
+                                                                              .dictionary = dictionary};
+    return 0;
+}
+
+// Write the compression settings: the level for the built-in types, then the rules
+int write_compression_settings(FILE *file)
+{
+    if (fprintf(file, "compress %d\n", compress_level) < 0)
+        return -1;
+    for (int i = 0; i < compression_rule_count; i++)
+    {
+        const struct compression_rule *rule = &compression_rules[i];
+        if ((rule->dictionary ? fprintf(file, "compress-type %s %d %u\n", rule->pattern, rule->level, rule->dictionary) :
+                                fprintf(file, "compress-type %s %d\n", rule->pattern, rule->level)) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Record the store's settings
+int write_store_settings(const char *sorted_root_directory)
+{
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (format_path(path, sizeof(path), "%s/%s", sorted_root_directory, STORE_FILE_NAME) != 0 ||
+        format_path(tmp_path, sizeof(tmp_path), "%s.tmp", path) != 0)
+    {
+        log_error("Error writing store settings: %s (%s)\n", sorted_root_directory, strerror(errno));
+        return -1;
+    }
+
+    char layout[64];
+    char previous[64];
+    format_layout(&store_layout, layout, sizeof(layout));
+    format_layout(&migrating_from, previous, sizeof(previous));
+
+    FILE *file = fopen(tmp_path, "w");
+    int written = file != NULL && fprintf(file, "hash %s\nlayout %s\n", hash_algorithm_names[hash_algorithm], layout) >= 0 &&
+                  (!migrating || fprintf(file, "migrating %s\n", previous) >= 0) &&
+                  (pack_threshold == 0 || fprintf(file, "pack %lld\n", (long long)pack_threshold) >= 0) &&
+                  (chunk_threshold == 0 || fprintf(file, "chunk %lld\n", (long long)chunk_threshold) >= 0) &&
+                  (!compressed_store || write_compression_settings(file) == 0);
+    if (file != NULL && fclose(file) != 0)
+        written = 0;
+    if (!written || rename(tmp_path, path) != 0)
+    {
+        log_error("Error writing store settings: %s (%s)\n", path, strerror(errno));
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Read the store's settings, or record them for a new store unless read_only is set. Stores that
+// predate the settings file were all hashed with SHA-256 and laid out flat. chosen_hash and
+// chosen_layout are what was asked for on the command line, if anything; a store keeps the engine it
+// was created with, so asking for another one is an error rather than a way to mix two naming schemes
+// in one store. Its layout can only be changed by the migrate command. Returns -1 on errors.
+int open_store_settings(const char *sorted_root_directory, int chosen_hash, const struct layout *chosen_layout,
+                        int read_only)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", sorted_root_directory, STORE_FILE_NAME);
+
+    int stored_hash = -1;
+    int stored_layout = 0;
+    FILE *file = fopen(path, "r");
+    if (file != NULL)
+    {
+        char line[256];
+        char key[64], value[128];
+        while (fgets(line, sizeof(line), file) != NULL)
+        {
+            if (sscanf(line, "%63s %127s", key, value) != 2)
+                continue;
+            if (strcmp(key, "layout") == 0 || strcmp(key, "migrating") == 0)
+            {
+                int previous = strcmp(key, "migrating") == 0;
+                if (parse_layout(value, previous ? &migrating_from : &store_layout) != 0)
+                {
+                    log_error("Unknown layout in %s: %s\n", path, value);
+                    fclose(file);
+                    return -1;
+                }
+                migrating |= previous;
+                stored_layout |= !previous;
+                continue;
+            }
+            if (strcmp(key, "chunk") == 0)
+            {
+                chunk_threshold = strtoll(value, NULL, 10);
+                if (chunk_threshold < 0)
+                    chunk_threshold = 0;
+                continue;
+            }
+            if (strcmp(key, "compress") == 0 || strcmp(key, "compress-type") == 0)
+            {
+                // The level for the built-in types, or a rule for other types
+                char pattern[128];
+                int level;
+                unsigned dictionary = 0;
+                compressed_store = 1;
+                if (strcmp(key, "compress") == 0)
+                    compress_level = atoi(value);
+                else if (sscanf(line, "%*s %127s %d %u", pattern, &level, &dictionary) < 2 ||
+                         set_compression_rule(pattern, level, dictionary) != 0)
+                {
+                    log_error("Invalid compression rule in %s: %s", path, line);
+                    fclose(file);
+                    return -1;
+                }
+                continue;
+            }
+            if (strcmp(key, "pack") == 0)
+            {
+                pack_threshold = strtoll(value, NULL, 10);
+                if (pack_threshold < 0 || pack_threshold > PACK_THRESHOLD_LIMIT)
+                    pack_threshold = 0;
+                continue;
+            }
+            if (strcmp(key, "hash") != 0)
+                continue;
+            for (int i = 0; i < HASH_ALGORITHM_COUNT; i++)
+            {
+                if (strcmp(value, hash_algorithm_names[i]) == 0)
+                    stored_hash = i;
+            }
+            if (stored_hash == -1)
+            {
+                log_error("Unknown hash engine in %s: %s\n", path, value);
+                fclose(file);
+                return -1;
+            }
+        }
+        fclose(file);
+    }
+    else if (store_has_objects(sorted_root_directory))
+    {
+        stored_hash = HASH_SHA256;
+    }
+
+    if (stored_hash != -1 && chosen_hash != -1 && stored_hash != chosen_hash)
+    {
+        log_error("The sorted directory is hashed with %s, not %s: %s\n", hash_algorithm_names[stored_hash],
+                  hash_algorithm_names[chosen_hash], sorted_root_directory);
+        return -1;
+    }
+    if (stored_hash != -1)
+        hash_algorithm = stored_hash;
+    if (!hash_algorithm_available(hash_algorithm))
+    {
+        log_error("The sorted directory is hashed with %s, which this build doesn't support\n", hash_algorithm_names[hash_algorithm]);
+        return -1;
+    }
+#ifndef VORTEX_WITH_ZSTD
+    if (compressed_store)
+    {
+        log_error("The sorted directory has compressed objects, which this build doesn't support\n");
+        return -1;
+    }
+#endif
+
+    // A store that already has objects keeps its layout; a new one takes the one asked for
+    int existing = stored_hash != -1;
+    if (chosen_layout != NULL && (existing || stored_layout) && !same_layout(&store_layout, chosen_layout))
+    {
+        char stored_name[64], chosen_name[64];
+        format_layout(&store_layout, stored_name, sizeof(stored_name));
+        format_layout(chosen_layout, chosen_name, sizeof(chosen_name));
+        log_error("The sorted directory uses the %s layout, not %s; use migrate to change it: %s\n", stored_name,
+                  chosen_name, sorted_root_directory);
+        return -1;
+    }
+    if (chosen_layout != NULL && !existing && !stored_layout)
+        store_layout = *chosen_layout;
+
+    if (file == NULL && !read_only)
+        return write_store_settings(sorted_root_directory);
+    return 0;
+}
+
+// Load the index from the sorted root, checking every entry against a stat of the object.
+// Returns -1 if there is no usable index, 1 if entries had to be dropped or rehashed, 0 otherwise.
+int load_index(const char *sorted_root_directory)
+{
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME);
+
+    FILE *file = fopen(index_path, "r");
+    if (!file)
+        return -1;
+
+    char line[PATH_MAX + 128];
+    int version = 0;
+    if (!fgets(line, sizeof(line), file) || sscanf(line, "vortex-index %d", &version) != 1 || version != INDEX_VERSION)
+    {
+        log_info("Ignoring unrecognised index: %s\n", index_path);
+        fclose(file);
+        return -1;
+    }
+
+    int stale = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned char digest[DIGEST_LENGTH];
+        struct stat recorded;
+        const char *relative_path;
+        if (parse_index_line(line, digest, &recorded, &relative_path) != 0)
+        {
+            stale = 1;
+            continue;
+        }
+
+        struct stat st;
+        if (stat_object(sorted_root_directory, relative_path, &st) == -1 || !S_ISREG(st.st_mode))
+        {
+            // Object has gone from the store
+            stale = 1;
+            continue;
+        }
+
+        if (st.st_size != recorded.st_size || st.st_mtime != recorded.st_mtime || st.st_ino != recorded.st_ino)
+        {
+            // Object was changed behind our back, so the recorded hash can't be trusted
+            stale = 1;
+            if (content_hash_object(sorted_root_directory, relative_path, digest) != 0)
+                continue;
+        }
+
+        if (find_hash(digest) != NULL)
+        {
+            stale = 1;
+            continue;
+        }
+
+        struct file_hash *s = add_hash(digest);
+        if (s == NULL)
+        {
+            log_error("Out of memory loading index: %s\n", index_path);
+            fclose(file);
+            return -1;
+        }
+        set_hash_location(s, relative_path, &st);
+    }
+
+    fclose(file);
+    return stale;
+}
+
+// Rewrite the whole index from the hash table
+int save_index(const char *sorted_root_directory)
+{
+    char index_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (format_path(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME) != 0 ||
+        format_path(tmp_path, sizeof(tmp_path), "%s.tmp", index_path) != 0)
+    {
+        log_error("Error writing index: %s (%s)\n", sorted_root_directory, strerror(errno));
+        return -1;
+    }
+
+    FILE *file = fopen(tmp_path, "w");
+    if (!file)
+    {
+        log_error("Error writing index: %s (%s)\n", tmp_path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(file, "vortex-index %d\n", INDEX_VERSION);
+
+    for (size_t i = 0; i < file_hashes.capacity; i++)
+    {
+        if (file_hashes.tags[i] >= TAG_EMPTY)
+            continue;
+        struct file_hash *s = digest_entry(file_hashes.slots[i]);
+        if (s->path != NULL)
+            write_index_entry(file, s);
+    }
+
+    if (fclose(file) != 0 || rename(tmp_path, index_path) != 0)
+    {
+        log_error("Error writing index: %s (%s)\n", index_path, strerror(errno));
+        remove(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+FILE *open_index(const char *sorted_root_directory)
+{
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME);
+
+    FILE *file = fopen(index_path, "a");
+    if (!file)
+        log_error("Error opening index: %s (%s)\n", index_path, strerror(errno));
+    return file;
+}
+
+// Record a freshly stored object in the hash table and append it to the index
+void record_stored_object(struct file_hash *s, const char *sorted_root_directory, const char *relative_path)
+{
+    struct stat st;
+    if (stat_object(sorted_root_directory, relative_path, &st) == -1)
+    {
+        log_error("Error getting file/directory information: %s/%s (%s)\n", sorted_root_directory, relative_path, strerror(errno));
+        release_hash(s);
+        return;
+    }
+
+    pthread_mutex_lock(&hash_table_lock);
+    set_hash_location(s, relative_path, &st);
+
+    if (index_file != NULL)
+    {
+        write_index_entry(index_file, s);
+        fflush(index_file);
+    }
+    claim_resolved();
+    pthread_cond_broadcast(&hash_table_cond);
+    pthread_mutex_unlock(&hash_table_lock);
+}
+
+// The external digest index: every stored object's digest, size and entry in the text index, sorted
+// by digest, behind a fan-out table and two Bloom filters, one over digests and one over sizes. It is
+// mapped read-only, so only the pages lookups touch are resident. Most new content is ruled out by
+// the Bloom filter without touching the records at all.
+struct digest_record
+{
+    unsigned char digest[DIGEST_LENGTH];
+    int64_t size;
+    uint64_t location; // offset of the object's line in the text index
+};
+
+struct digest_index_header
+{
+    char magic[8];            // "VXDIGEST"
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;           // records, sorted by digest
+    uint64_t bloom_bits;      // size of each Bloom filter, a power of two
+    uint64_t size_bloom_bits;
+    uint64_t index_ino;       // the .vortex-index the records were built from
+    uint64_t index_length;    // and how many bytes of it they cover
+    uint64_t fanout[256];     // number of records whose digest starts with a byte <= i
+};
+
+struct digest_run
+{
+    FILE *file;
+    uint64_t left;
+    struct digest_record current;
+};
+
+struct digest_index
+{
+    char root[PATH_MAX];      // the sorted root, whose text index the digest index is built from
+    char dir[PATH_MAX];       // where new digest indexes are written: the sorted root, or a private
+    char temp[PATH_MAX];      // directory for read-only commands, and where their runs are sorted
+    char path[PATH_MAX];      // the digest index mapped
+    void *map;
+    size_t map_size;
+    const struct digest_index_header *header;
+    const struct digest_record *records;
+    const unsigned char *bloom;
+    const unsigned char *size_bloom;
+};
+
+struct digest_index external_index = {.map = NULL};
+
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Bloom filter probes by double hashing. Digests are uniformly distributed, so two of their words
+// serve as the hashes; sizes are mixed first.
+static inline void digest_bloom_hashes(const unsigned char *digest, uint64_t *h1, uint64_t *h2)
+{
+    memcpy(h1, digest + 8, sizeof(*h1));
+    memcpy(h2, digest + 16, sizeof(*h2));
+    *h2 |= 1;
+}
+
+static inline void size_bloom_hashes(int64_t size, uint64_t *h1, uint64_t *h2)
+{
+    *h1 = mix64((uint64_t)size);
+    *h2 = mix64(*h1) | 1;
+}
+
+static inline void bloom_add(unsigned char *bloom, uint64_t bits, uint64_t h1, uint64_t h2)
+{
+    for (int i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (h1 + i * h2) & (bits - 1);
+        bloom[bit >> 3] |= 1 << (bit & 7);
+    }
+}
+
+static inline int bloom_test(const unsigned char *bloom, uint64_t bits, uint64_t h1, uint64_t h2)
+{
+    for (int i = 0; i < BLOOM_HASHES; i++)
+    {
+        uint64_t bit = (h1 + i * h2) & (bits - 1);
+        if (!(bloom[bit >> 3] & (1 << (bit & 7))))
+            return 0;
+    }
+    return 1;
+}
+
+static uint64_t bloom_size(uint64_t count)
+{
+    uint64_t bits = 1024;
+    while (bits < count * BLOOM_BITS_PER_OBJECT)
+        bits *= 2;
+    return bits;
+}
+
+const struct digest_record *digest_index_find(const unsigned char *digest)
+{
+    const struct digest_index_header *header = external_index.header;
+    if (header == NULL || header->count == 0)
+        return NULL;
+
+    uint64_t h1, h2;
+    digest_bloom_hashes(digest, &h1, &h2);
+    if (!bloom_test(external_index.bloom, header->bloom_bits, h1, h2))
+        return NULL;
+
+    uint64_t lo = digest[0] ? header->fanout[digest[0] - 1] : 0;
+    uint64_t hi = header->fanout[digest[0]];
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(external_index.records[mid].digest, digest, DIGEST_LENGTH);
+        if (cmp == 0)
+            return &external_index.records[mid];
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+int digest_index_contains(const unsigned char *digest)
+{
+    return digest_index_find(digest) != NULL;
+}
+
+// Find a digest in the digest index, setting *location to the offset of its entry in the text index
+int digest_index_location(const unsigned char *digest, uint64_t *location)
+{
+    const struct digest_record *record = digest_index_find(digest);
+    if (record != NULL)
+        *location = record->location;
+    return record != NULL;
+}
+
+// Read the text index entry at location, which has to be digest's, copying its object's path and
+// inode. Returns -1 if it can't be read or belongs to something else.
+int read_index_entry(uint64_t location, const unsigned char *digest, char *relative_path, size_t path_size, ino_t *ino)
+{
+    char index_path[PATH_MAX];
+    int fd = format_path(index_path, sizeof(index_path), "%s/%s", external_index.root, INDEX_FILE_NAME) == 0
+                 ? open(index_path, O_RDONLY | O_CLOEXEC)
+                 : -1;
+    if (fd == -1)
+    {
+        log_error("Error opening index: %s (%s)\n", index_path, strerror(errno));
+        return -1;
+    }
+
+    char line[PATH_MAX + 128];
+    ssize_t n = pread(fd, line, sizeof(line) - 1, location);
+    close(fd);
+    line[n > 0 ? n : 0] = '\0';
+
+    unsigned char entry_digest[DIGEST_LENGTH];
+    struct stat st;
+    const char *path;
+    if (strchr(line, '\n') == NULL || parse_index_line(line, entry_digest, &st, &path) != 0 ||
+        memcmp(entry_digest, digest, DIGEST_LENGTH) != 0)
+    {
+        log_error("The digest index doesn't match the index, rebuild it with --reindex: %s\n", external_index.root);
+        return -1;
+    }
+    snprintf(relative_path, path_size, "%s", path);
+    *ino = st.st_ino;
+    return 0;
+}
+
+int digest_index_may_contain_size(off_t size)
+{
+    const struct digest_index_header *header = external_index.header;
+    if (header == NULL || header->count == 0)
+        return 0;
+
+    uint64_t h1, h2;
+    size_bloom_hashes(size, &h1, &h2);
+    return bloom_test(external_index.size_bloom, header->size_bloom_bits, h1, h2);
+}
+
+void unmap_digest_index(void)
+{
+    if (external_index.map != NULL)
+        munmap(external_index.map, external_index.map_size);
+    external_index.map = NULL;
+    external_index.header = NULL;
+}
+
+// Map the digest index in path. When index_st is given, the digest index must have been built from
+// that text index. Returns -1 if it is missing, damaged or stale.
+int map_digest_index(const char *path, const struct stat *index_st)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct digest_index_header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const struct digest_index_header *header = map;
+    uint64_t expected = sizeof(*header) + header->count * sizeof(struct digest_record) +
+                        header->bloom_bits / 8 + header->size_bloom_bits / 8;
+    if (memcmp(header->magic, "VXDIGEST", 8) != 0 || header->version != DIGEST_INDEX_VERSION ||
+        expected != (uint64_t)st.st_size || header->fanout[255] != header->count ||
+        (index_st != NULL && (header->index_ino != (uint64_t)index_st->st_ino ||
+                              header->index_length > (uint64_t)index_st->st_size)))
+    {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    unmap_digest_index();
+    snprintf(external_index.path, sizeof(external_index.path), "%s", path);
+    external_index.map = map;
+    external_index.map_size = st.st_size;
+    external_index.header = header;
+    external_index.records = (const struct digest_record *)(header + 1);
+    external_index.bloom = (const unsigned char *)(external_index.records + header->count);
+    external_index.size_bloom = external_index.bloom + header->bloom_bits / 8;
+
+    // The filters are consulted for every new file; the records only for likely duplicates
+    madvise(map, st.st_size, MADV_RANDOM);
+    madvise((void *)((uintptr_t)external_index.bloom & ~(uintptr_t)(IO_BUF_ALIGN - 1)),
+            (header->bloom_bits + header->size_bloom_bits) / 8 + IO_BUF_ALIGN, MADV_WILLNEED);
+    return 0;
+}
+
+static int compare_digest_records(const void *a, const void *b)
+{
+    return memcmp(((const struct digest_record *)a)->digest, ((const struct digest_record *)b)->digest,
+                  DIGEST_LENGTH);
+}
+
+// Sort records into an unlinked temporary file, ready to be merged
+int write_digest_run(struct digest_record *records, size_t count, struct digest_run *run)
+{
+    static unsigned long run_counter = 0;
+
+    char path[PATH_MAX];
+    int formatted = format_path(path, sizeof(path), "%s/digests-%ld-%lu", external_index.temp, (long)getpid(),
+                                run_counter++) == 0;
+
+    qsort(records, count, sizeof(*records), compare_digest_records);
+
+    run->file = formatted ? fopen(path, "w+") : NULL;
+    if (run->file == NULL)
+    {
+        log_error("Error creating temporary file: %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    remove(path);
+
+    if (fwrite(records, sizeof(*records), count, run->file) != count || fflush(run->file) != 0)
+    {
+        log_error("Error writing temporary file: %s (%s)\n", path, strerror(errno));
+        fclose(run->file);
+        return -1;
+    }
+    rewind(run->file);
+    run->left = count;
+    return 0;
+}
+
+// Advance a run. Returns 1 when run->current holds the next record, 0 at the end, -1 on errors.
+static int next_digest_record(struct digest_run *run)
+{
+    if (run->left == 0)
+        return 0;
+    run->left--;
+    return fread(&run->current, sizeof(run->current), 1, run->file) == 1 ? 1 : -1;
+}
+
+// Merge sorted runs into a new digest index covering index_length bytes of the text index, dropping
+// repeated digests, and map it in place of the old one
+int write_digest_index(struct digest_run *runs, int run_count, uint64_t index_ino, uint64_t index_length)
+{
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (format_path(path, sizeof(path), "%s/%s", external_index.dir, DIGEST_INDEX_FILE_NAME) != 0 ||
+        format_path(tmp_path, sizeof(tmp_path), "%s.tmp", path) != 0)
+    {
+        log_error("Error writing digest index: %s (%s)\n", external_index.dir, strerror(errno));
+        return -1;
+    }
+
+    uint64_t total = 0;
+    for (int i = 0; i < run_count; i++)
+        total += runs[i].left;
+
+    struct digest_index_header *header = calloc(1, sizeof(*header));
+    memcpy(header->magic, "VXDIGEST", 8);
+    header->version = DIGEST_INDEX_VERSION;
+    header->bloom_bits = bloom_size(total);
+    header->size_bloom_bits = bloom_size(total);
+    header->index_ino = index_ino;
+    header->index_length = index_length;
+
+    unsigned char *bloom = calloc(header->bloom_bits / 8, 1);
+    unsigned char *size_bloom = calloc(header->size_bloom_bits / 8, 1);
+    FILE *file = fopen(tmp_path, "w");
+    int result = (bloom && size_bloom && file) ? 0 : -1;
+    if (result == 0 && fwrite(header, sizeof(*header), 1, file) != 1)
+        result = -1;
+
+    int *active = calloc(run_count ? run_count : 1, sizeof(int));
+    for (int i = 0; i < run_count && result == 0; i++)
+    {
+        active[i] = next_digest_record(&runs[i]);
+        if (active[i] < 0)
+            result = -1;
+    }
+
+    struct digest_record last;
+    while (result == 0)
+    {
+        // Runs are few, so a linear scan for the smallest head is enough
+        int min = -1;
+        for (int i = 0; i < run_count; i++)
+        {
+            if (active[i] == 1 && (min == -1 || compare_digest_records(&runs[i].current, &runs[min].current) < 0))
+                min = i;
+        }
+        if (min == -1)
+            break;
+
+        struct digest_record record = runs[min].current;
+        active[min] = next_digest_record(&runs[min]);
+        if (active[min] < 0)
+            result = -1;
+
+        if (header->count > 0 && memcmp(last.digest, record.digest, DIGEST_LENGTH) == 0)
+            continue;
+
+        if (fwrite(&record, sizeof(record), 1, file) != 1)
+            result = -1;
+        header->count++;
+        header->fanout[record.digest[0]]++;
+
+        uint64_t h1, h2;
+        digest_bloom_hashes(record.digest, &h1, &h2);
+        bloom_add(bloom, header->bloom_bits, h1, h2);
+        size_bloom_hashes(record.size, &h1, &h2);
+        bloom_add(size_bloom, header->size_bloom_bits, h1, h2);
+        last = record;
+    }
+    free(active);
+
+    for (int i = 1; i < 256; i++)
+        header->fanout[i] += header->fanout[i - 1];
+
+    if (result == 0 &&
+        (fwrite(bloom, header->bloom_bits / 8, 1, file) != 1 ||
+         fwrite(size_bloom, header->size_bloom_bits / 8, 1, file) != 1 ||
+         fseek(file, 0, SEEK_SET) != 0 || fwrite(header, sizeof(*header), 1, file) != 1 ||
+         fflush(file) != 0 || fsync(fileno(file)) != 0))
+        result = -1;
+    if (file != NULL && fclose(file) != 0)
+        result = -1;
+    if (result == 0 && rename(tmp_path, path) != 0)
+        result = -1;
+
+    if (result != 0)
+    {
+        log_error("Error writing digest index: %s (%s)\n", path, strerror(errno));
+        remove(tmp_path);
+    }
+    else if (map_digest_index(path, NULL) != 0)
+    {
+        log_error("Error mapping digest index: %s\n", path);
+        result = -1;
+    }
+
+    free(bloom);
+    free(size_bloom);
+    free(header);
+    return result;
+}
+
+// Sort the text index's entries from file's position on into runs of batch_limit records, noting
+// where each entry's line starts. Only complete lines are read, so an entry still being appended is
+// left for next time; *length is set to the end of the last one. Returns the number of runs, or -1.
+int read_digest_runs(FILE *file, struct digest_run **runs, uint64_t *length)
+{
+    struct digest_record *records = malloc(batch_limit * sizeof(*records));
+    int run_count = 0;
+    size_t count = 0;
+    int result = records ? 0 : -1;
+    uint64_t offset = ftello(file);
+    char line[PATH_MAX + 128];
+    *runs = NULL;
+    while (result == 0)
+    {
+        size_t line_length = fgets(line, sizeof(line), file) != NULL ? strlen(line) : 0;
+        int more = line_length > 0 && line[line_length - 1] == '\n';
+
+        unsigned char digest[DIGEST_LENGTH];
+        struct stat st;
+        const char *relative_path;
+        if (more && parse_index_line(line, digest, &st, &relative_path) == 0)
+        {
+            memcpy(records[count].digest, digest, DIGEST_LENGTH);
+            records[count].size = st.st_size;
+            records[count].location = offset;
+            count++;
+        }
+        offset += more ? line_length : 0;
+
+        if ((count == batch_limit || !more) && count > 0)
+        {
+            struct digest_run *grown = realloc(*runs, (run_count + 1) * sizeof(**runs));
+            if (grown == NULL || write_digest_run(records, count, &grown[run_count]) != 0)
+                result = -1;
+            else
+                run_count++;
+            if (grown != NULL)
+                *runs = grown;
+            count = 0;
+        }
+        if (!more)
+            break;
+    }
+    free(records);
+
+    *length = offset;
+    if (result != 0)
+    {
+        for (int i = 0; i < run_count; i++)
+            fclose((*runs)[i].file);
+        free(*runs);
+        *runs = NULL;
+        return -1;
+    }
+    return run_count;
+}
+
+// Build the digest index from scratch by sorting the text index in runs of batch_limit records
+int rebuild_digest_index(const char *index_path, const struct stat *index_st)
+{
+    FILE *file = fopen(index_path, "r");
+    if (!file)
+    {
+        log_error("Error opening index: %s (%s)\n", index_path, strerror(errno));
+        return -1;
+    }
+
+    char line[PATH_MAX + 128];
+    int version = 0;
+    if (!fgets(line, sizeof(line), file) || sscanf(line, "vortex-index %d", &version) != 1 || version != INDEX_VERSION)
+    {
+        log_error("Unrecognised index, rebuild it with --reindex: %s\n", index_path);
+        fclose(file);
+        return -1;
+    }
+
+    struct digest_run *runs;
+    uint64_t length;
+    int run_count = read_digest_runs(file, &runs, &length);
+    fclose(file);
+    if (run_count < 0)
+        return -1;
+
+    int result = write_digest_index(runs, run_count, index_st->st_ino, length);
+    for (int i = 0; i < run_count; i++)
+        fclose(runs[i].file);
+    free(runs);
+    return result;
+}
+
+// Merge the entries the text index gained since the digest index was built into the digest index.
+// They are read back from the text index rather than taken from the digest set, so the records know
+// where their entries are. Returns -1 on errors.
+int merge_index_tail(void)
+{
+    char index_path[PATH_MAX];
+    int formatted = format_path(index_path, sizeof(index_path), "%s/%s", external_index.root, INDEX_FILE_NAME) == 0;
+    struct stat index_st = {0};
+    uint64_t start = external_index.header != NULL ? external_index.header->index_length : 0;
+    char line[PATH_MAX + 128];
+    FILE *file = formatted ? fopen(index_path, "r") : NULL;
+    if (index_file != NULL)
+        fflush(index_file);
+    if (file == NULL || fstat(fileno(file), &index_st) != 0 || fseeko(file, start, SEEK_SET) != 0 ||
+        (start == 0 && fgets(line, sizeof(line), file) == NULL))
+    {
+        log_error("Error reading index: %s (%s)\n", index_path, strerror(errno));
+        if (file != NULL)
+            fclose(file);
+        return -1;
+    }
+
+    struct digest_run *runs;
+    uint64_t index_length;
+    int tail_runs = read_digest_runs(file, &runs, &index_length);
+    fclose(file);
+    if (tail_runs < 0)
+        return -1;
+
+    // The digest index so far is one more sorted run
+    size_t count = 0;
+    for (int i = 0; i < tail_runs; i++)
+        count += runs[i].left;
+    int run_count = tail_runs;
+    struct digest_run *all = realloc(runs, (tail_runs + 1) * sizeof(*runs));
+    int result = all != NULL ? 0 : -1;
+    if (all != NULL)
+        runs = all;
+    if (result == 0 && external_index.header != NULL)
+    {
+        const char *path = external_index.path;
+        runs[run_count].file = fopen(path, "r");
+        runs[run_count].left = external_index.header->count;
+        if (runs[run_count].file == NULL || fseek(runs[run_count].file, sizeof(struct digest_index_header), SEEK_SET) != 0)
+        {
+            log_error("Error reading digest index: %s (%s)\n", path, strerror(errno));
+            if (runs[run_count].file != NULL)
+                fclose(runs[run_count].file);
+            result = -1;
+        }
+        else
+            run_count++;
+    }
+
+    if (result == 0)
+        result = write_digest_index(runs, run_count, index_st.st_ino, index_length);
+    for (int i = 0; i < run_count; i++)
+        fclose(runs[i].file);
+    free(runs);
+
+    if (result == 0)
+        log_info("Merged %zu objects into the digest index\n", count);
+    return result;
+}
+
+// Merge the objects buffered in the digest set into the digest index and empty the set, along with
+// the size buckets that point into it. Called with hash_table_lock held and no claims open.
+void flush_digest_batch(void)
+{
+    if (file_hashes.live == 0 || merge_index_tail() != 0)
+        return;
+
+    struct size_bucket *b, *tmp;
+    HASH_ITER(hh, size_buckets, b, tmp)
+    {
+        HASH_DEL(size_buckets, b);
+        free(b->entries);
+        free(b);
+    }
+    reset_digest_set();
+}
+
+void write_index_from_store(const char *sorted_root_directory);
+
+// Prepare memory-bounded mode: make sure there is a text index, map the digest index built from it,
+// rebuilding that if it is missing or belongs to another text index, and merge in any objects the
+// text index gained since, such as those of an interrupted run
+int open_external_index(const char *sorted_root_directory, int reindex)
+{
+    char index_path[PATH_MAX];
+    char digest_path[PATH_MAX];
+    if (format_path(external_index.root, sizeof(external_index.root), "%s", sorted_root_directory) != 0 ||
+        format_path(external_index.dir, sizeof(external_index.dir), "%s", sorted_root_directory) != 0 ||
+        format_path(external_index.temp, sizeof(external_index.temp), "%s/%s", sorted_root_directory,
+                    TEMP_DIR_NAME) != 0 ||
+        format_path(digest_path, sizeof(digest_path), "%s/%s", sorted_root_directory, DIGEST_INDEX_FILE_NAME) != 0 ||
+        format_path(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME) != 0)
+    {
+        log_error("Error opening index: %s (%s)\n", sorted_root_directory, strerror(errno));
+        return -1;
+    }
+
+    struct stat index_st;
+    if (reindex || stat(index_path, &index_st) == -1)
+    {
+        log_info("Building index: %s\n", sorted_root_directory);
+        write_index_from_store(sorted_root_directory);
+        if (stat(index_path, &index_st) == -1)
+            return -1;
+    }
+
+    if (map_digest_index(digest_path, &index_st) != 0)
+    {
+        log_info("Building digest index: %s\n", digest_path);
+        if (rebuild_digest_index(index_path, &index_st) != 0)
+            return -1;
+    }
+
+    if (external_index.header->index_length < (uint64_t)index_st.st_size && merge_index_tail() != 0)
+        return -1;
+    return 0;
+}
+
+// Map the digest index for a command that only reads the sorted directory. If the digest index is
+// missing or behind the text index, an up to date copy is built in a private temporary directory
+// and removed again once mapped, so nothing is written into the sorted directory.
+int open_external_index_read_only(const char *sorted_root_directory)
+{
+    char index_path[PATH_MAX];
+    char digest_path[PATH_MAX];
+    if (format_path(external_index.root, sizeof(external_index.root), "%s", sorted_root_directory) != 0 ||
+        format_path(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME) != 0 ||
+        format_path(digest_path, sizeof(digest_path), "%s/%s", sorted_root_directory, DIGEST_INDEX_FILE_NAME) != 0)
+    {
+        log_error("Error opening index: %s (%s)\n", sorted_root_directory, strerror(errno));
+        return -1;
+    }
+
+    struct stat index_st;
+    if (stat(index_path, &index_st) == -1)
+    {
+        log_error("The sorted directory has no index, sort into it to make one: %s\n", sorted_root_directory);
+        return -1;
+    }
+    int mapped = map_digest_index(digest_path, &index_st) == 0;
+    if (mapped && external_index.header->index_length == (uint64_t)index_st.st_size)
+        return 0;
+
+    const char *tmpdir = getenv("TMPDIR");
+    char private_dir[PATH_MAX];
+    if (format_path(private_dir, sizeof(private_dir), "%s/vortex-XXXXXX", tmpdir && tmpdir[0] ? tmpdir : "/tmp") != 0 ||
+        mkdtemp(private_dir) == NULL)
+    {
+        log_error("Error creating temporary directory: %s (%s)\n", private_dir, strerror(errno));
+        return -1;
+    }
+    snprintf(external_index.dir, sizeof(external_index.dir), "%s", private_dir);
+    snprintf(external_index.temp, sizeof(external_index.temp), "%s", private_dir);
+
+    int result;
+    if (mapped)
+        result = merge_index_tail();
+    else
+    {
+        log_info("Building digest index: %s/%s\n", private_dir, DIGEST_INDEX_FILE_NAME);
+        result = rebuild_digest_index(index_path, &index_st);
+    }
+
+    // The mapping outlives the file
+    char private_path[PATH_MAX];
+    if (format_path(private_path, sizeof(private_path), "%s/%s", private_dir, DIGEST_INDEX_FILE_NAME) == 0)
+        remove(private_path);
+    rmdir(private_dir);
+    return result;
+}
+
+// A directory open somewhere in a walked tree. Everything below it is reached through fd with
+// openat and friends, so paths are never rebuilt. Files queued for the workers hold a reference,
+// which keeps the directory open until they are done. Deep in a tree, ancestors nothing else needs
+// are closed (fd -1) and reopened on the way back up, so depth isn't limited by open descriptors.
+struct walk_dir
+{
+    int fd;
+    char *path;               // full path, for messages and to reopen the directory by
+    const char *name;         // last component of path, relative to parent
+    struct walk_dir *parent;
+    int refs;
+    int prune;                // remove the directory once the last reference goes, if it is empty
+    int depth;                // below the root of the walk
+    int deferred;             // waiting to be closed once nothing else needs it
+    unsigned reopened;        // times fd has been closed and opened again, losing its position
+    dev_t dev;                // to make sure a reopened directory is the same one
+    ino_t ino;
+};
+
+int walk_open_dirs = 0; // walk_dirs currently holding a descriptor
+int walk_max_open_dirs = WALK_MAX_OPEN_DIRS; // lowered to fit the process's descriptor limit
+
+// Join a directory's path and an entry name into a newly allocated string, or NULL if out of memory
+char *walk_path(struct walk_dir *dir, const char *name)
+{
+    size_t dir_len = strlen(dir->path);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path == NULL)
+        return NULL;
+    memcpy(path, dir->path, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+// Open a directory, either the root of a walk (parent NULL) or an entry of parent
+struct walk_dir *walk_dir_open(struct walk_dir *parent, const char *name)
+{
+    int fd;
+    if (parent == NULL)
+        fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    else
+        fd = openat(parent->fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    struct walk_dir *dir = calloc(1, sizeof(struct walk_dir));
+    if (dir != NULL)
+        dir->path = parent ? walk_path(parent, name) : strdup(name);
+    if (dir == NULL || dir->path == NULL || fstat(fd, &st) != 0)
+    {
+        int error = dir == NULL || dir->path == NULL ? ENOMEM : errno;
+        if (dir != NULL)
+            free(dir->path);
+        free(dir);
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    dir->fd = fd;
+    dir->name = parent ? dir->path + strlen(parent->path) + 1 : dir->path;
+    dir->parent = parent;
+    dir->refs = 1;
+    dir->depth = parent ? parent->depth + 1 : 0;
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    if (parent != NULL)
+        __atomic_add_fetch(&parent->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&walk_open_dirs, 1, __ATOMIC_RELAXED);
+
+    return dir;
+}
+
+// Close the descriptor of a directory high above the walk, unless anything but the walk still
+// needs it: the walk's own reference and the one of its open subdirectory are all it may have,
+// with no files waiting in it. Only the walker takes references, so none can be added meanwhile.
+void walk_dir_suspend(struct walk_dir *dir)
+{
+    if (dir->fd != -1 && __atomic_load_n(&dir->refs, __ATOMIC_ACQUIRE) == 2)
+    {
+        close(dir->fd);
+        dir->fd = -1;
+        __atomic_sub_fetch(&walk_open_dirs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Reopen a suspended directory through the ".." of child, or by its path if the tree was moved
+// meanwhile. Returns -1 if neither leads back to the same directory.
+int walk_dir_resume(struct walk_dir *dir, struct walk_dir *child)
+{
+    if (dir->fd != -1)
+        return 0;
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        int fd = attempt == 0 ? openat(child->fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                              : open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        struct stat st;
+        if (fd != -1 && fstat(fd, &st) == 0 && st.st_dev == dir->dev && st.st_ino == dir->ino)
+        {
+            dir->fd = fd;
+            dir->reopened++;
+            __atomic_add_fetch(&walk_open_dirs, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    errno = ESTALE;
+    return -1;
+}
+
+void walk_dir_ref(struct walk_dir *dir)
+{
+    __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+}
+
+typedef int (*dir_entry_fn)(struct walk_dir *dir, const char *name, unsigned char type, void *ctx);
+
+// Hand one directory entry to fn. d_type is trusted; only filesystems that don't report one
+// (DT_UNKNOWN) cost an fstatat.
+int visit_entry(struct walk_dir *dir, const char *name, unsigned char type, dir_entry_fn fn, void *ctx)
+{
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return 0;
+
+    if (type == DT_UNKNOWN)
+    {
+        struct stat st;
+        if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+
+    return fn(dir, name, type, ctx);
+}
+
+#ifdef __linux__
+struct linux_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Call fn for every entry of an open directory except "." and "..", until it returns nonzero.
+// Entries are read straight from the kernel in large getdents64 batches.
+int read_directory(struct walk_dir *dir, dir_entry_fn fn, void *ctx)
+{
+    if (lseek(dir->fd, 0, SEEK_SET) == -1)
+        return -1;
+
+    char *buffer = malloc(DIRENT_BUF_SIZE);
+    if (buffer == NULL)
+        return -1;
+
+    int stop = 0;
+    long n;
+    unsigned reopened = dir->reopened;
+    int64_t resume = 0; // where the entries after those read so far start
+    uint64_t start = now_ns();
+    while (!stop && (n = syscall(SYS_getdents64, dir->fd, buffer, DIRENT_BUF_SIZE)) > 0)
+    {
+        stage_end(STAGE_TRAVERSAL, start);
+        for (long offset = 0; offset < n && !stop;)
+        {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            resume = entry->d_off;
+            stop = visit_entry(dir, entry->d_name, entry->d_type, fn, ctx);
+        }
+
+        // The walk below closed and reopened the directory, which lost its place
+        if (!stop && dir->reopened != reopened)
+        {
+            reopened = dir->reopened;
+            if (lseek(dir->fd, resume, SEEK_SET) == -1)
+            {
+                n = -1;
+                break;
+            }
+        }
+        start = now_ns();
+    }
+
+    free(buffer);
+    if (!stop && n < 0)
+    {
+        log_error("Error reading directory: %s (%s)\n", dir->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+#else
+// Call fn for every entry of an open directory except "." and "..", until it returns nonzero
+int read_directory(struct walk_dir *dir, dir_entry_fn fn, void *ctx)
+{
+    int fd = dup(dir->fd);
+    DIR *d = fd == -1 ? NULL : fdopendir(fd);
+    if (d == NULL)
+        return -1;
+    rewinddir(d);
+
+    struct dirent *entry;
+    int stop = 0;
+    uint64_t start = now_ns();
+    while (!stop && (entry = readdir(d)) != NULL)
+    {
+        stage_end(STAGE_TRAVERSAL, start);
+        stop = visit_entry(dir, entry->d_name, entry->d_type, fn, ctx);
+        start = now_ns();
+    }
+
+    closedir(d);
+    return 0;
+}
+#endif
+
+int stop_at_first_entry(struct walk_dir *dir, const char *name, unsigned char type, void *ctx)
+{
+    (void)dir;
+    (void)name;
+    (void)type;
+    *(int *)ctx = 0;
+    return 1;
+}
+
+int walk_dir_is_empty(struct walk_dir *dir)
+{
+    int empty = 1;
+    if (read_directory(dir, stop_at_first_entry, &empty) != 0)
+        return 0;
+    return empty;
+}
+
+// Drop a reference to a directory. When the last one goes the directory is closed, removed first
+// if it was marked for pruning and has been emptied, and its own reference on its parent dropped.
+void walk_dir_release(struct walk_dir *dir)
+{
+    while (dir != NULL && __atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        struct walk_dir *parent = dir->parent;
+
+        if (dir->prune && parent != NULL && walk_dir_is_empty(dir))
+        {
+            // A suspended parent is reached through the full path instead
+            if ((parent->fd != -1 ? unlinkat(parent->fd, dir->name, AT_REMOVEDIR) : rmdir(dir->path)) == 0)
+                log_info("Deleted empty directory: %s\n", dir->path);
+            else
+                log_error("Error deleting directory: %s (%s)\n", dir->path, strerror(errno));
+        }
+
+        if (dir->fd != -1)
+        {
+            close(dir->fd);
+            __atomic_sub_fetch(&walk_open_dirs, 1, __ATOMIC_RELAXED);
+        }
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+typedef void (*walk_file_fn)(struct walk_dir *dir, const char *name, void *ctx);
+
+// What to do with the regular files of a tree, and whether to prune its emptied directories
+struct walk
+{
+    walk_file_fn on_file;
+    int prune;
+    void *ctx;
+    struct walk_dir **deferred; // ancestors to close that still had files waiting in them
+    size_t deferred_count;
+    size_t deferred_capacity;
+};
+
+// Close the ancestors put off earlier that nothing else needs any more
+void walk_suspend_deferred(struct walk *walk)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < walk->deferred_count; i++)
+    {
+        struct walk_dir *dir = walk->deferred[i];
+        walk_dir_suspend(dir);
+        if (dir->fd != -1)
+            walk->deferred[kept++] = dir;
+        else
+            dir->deferred = 0;
+    }
+    walk->deferred_count = kept;
+}
+
+// Close the ancestor WALK_OPEN_DEPTH levels above sub, and any that couldn't be closed before
+// because files were still waiting in them
+void walk_suspend_ancestors(struct walk *walk, struct walk_dir *sub)
+{
+    struct walk_dir *ancestor = sub;
+    for (int i = 0; i < WALK_OPEN_DEPTH; i++)
+        ancestor = ancestor->parent;
+    if (ancestor->fd != -1 && !ancestor->deferred)
+    {
+        if (walk->deferred_count == walk->deferred_capacity)
+        {
+            size_t capacity = walk->deferred_capacity ? walk->deferred_capacity * 2 : 64;
+            struct walk_dir **deferred = realloc(walk->deferred, capacity * sizeof(*deferred));
+            // Without the memory to remember it, the directory just stays open
+            if (deferred == NULL)
+                return;
+            walk->deferred = deferred;
+            walk->deferred_capacity = capacity;
+        }
+        ancestor->deferred = 1;
+        walk->deferred[walk->deferred_count++] = ancestor;
+    }
+    walk_suspend_deferred(walk);
+}
+
+// Hold the walk back while too many directories are open, until the workers and the journal are
+// done with some of them
+void walk_wait_for_descriptors(struct walk *walk)
+{
+    while (__atomic_load_n(&walk_open_dirs, __ATOMIC_RELAXED) >= walk_max_open_dirs)
+    {
+        walk_suspend_deferred(walk);
+        struct timespec pause = {0, 1000000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+int walk_entry(struct walk_dir *dir, const char *name, unsigned char type, void *ctx)
+{
+    struct walk *walk = ctx;
+
+    if (type == DT_DIR)
+    {
+        walk_wait_for_descriptors(walk);
+        struct walk_dir *sub = walk_dir_open(dir, name);
+        if (sub == NULL)
+        {
+            log_error("Error opening directory: %s/%s (%s)\n", dir->path, name, strerror(errno));
+            return 0;
+        }
+        sub->prune = walk->prune;
+
+        // However deep the tree goes, only so many directories are held open
+        if (sub->depth > WALK_OPEN_DEPTH)
+            walk_suspend_ancestors(walk, sub);
+
+        read_directory(sub, walk_entry, walk);
+
+        // Leaving sub, which can't be an ancestor of anything walked from now on
+        for (size_t i = 0; sub->deferred && i < walk->deferred_count; i++)
+        {
+            if (walk->deferred[i] == sub)
+            {
+                walk->deferred[i] = walk->deferred[--walk->deferred_count];
+                sub->deferred = 0;
+            }
+        }
+        if (dir->fd == -1)
+            walk_wait_for_descriptors(walk);
+        int resumed = walk_dir_resume(dir, sub) == 0;
+        if (!resumed)
+            log_error("Error reopening directory: %s (%s)\n", dir->path, strerror(errno));
+        walk_dir_release(sub);
+        // Without its descriptor the rest of the directory can't be read
+        return !resumed;
+    }
+    else if (type == DT_REG)
+    {
+        walk->on_file(dir, name, walk->ctx);
+    }
+
+    return 0;
+}
+
+// Visit every regular file below root. Symbolic links are not followed.
+int walk_tree(const char *root, struct walk *walk)
+{
+    struct walk_dir *dir = walk_dir_open(NULL, root);
+    if (dir == NULL)
+    {
+        log_error("Error opening directory: %s (%s)\n", root, strerror(errno));
+        return -1;
+    }
+
+    int result = read_directory(dir, walk_entry, walk);
+    walk_dir_release(dir);
+    free(walk->deferred);
+    walk->deferred = NULL;
+    walk->deferred_count = walk->deferred_capacity = 0;
+    return result;
+}
+
+void index_stored_object(const unsigned char *digest, const char *relative_path, const struct stat *st)
+{
+    if (max_memory != 0) {
+        // Memory-bounded mode writes the index straight out; the digest index drops duplicates
+        struct file_hash s = {.size = st->st_size, .mtime = st->st_mtime,
+                              .ino = st->st_ino, .path = (char *)relative_path};
+        memcpy(s.digest, digest, DIGEST_LENGTH);
+        write_index_entry(index_file, &s);
+        return;
+    }
+
+    // Add each hash to the file_hashes, keeping the first copy of any duplicates
+    struct file_hash *s;
+    if (find_hash(digest) == NULL && (s = add_hash(digest)) != NULL)
+        set_hash_location(s, relative_path, st);
+}
+
+// Hash every object in a pack, up to the first incomplete record
+void hash_pack_file(struct walk_dir *dir, const char *name, const char *relative_path)
+{
+    int fd = openat(dir->fd, name, O_RDONLY | O_CLOEXEC);
+    struct stat pack_st;
+    if (fd == -1 || fstat(fd, &pack_st) == -1)
+    {
+        log_error("Error opening pack: %s (%s)\n", relative_path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+
+    struct pack_record header;
+    off_t offset = 0, next;
+    while ((next = read_pack_record(fd, offset, pack_st.st_size, &header)) != -1)
+    {
+        off_t content = offset + sizeof(header) + header.extension_length;
+        unsigned char *data = read_packed_content(fd, content, header.size);
+        unsigned char digest[DIGEST_LENGTH];
+        if (data != NULL)
+        {
+            struct hasher hasher = {0};
+            hasher_init(&hasher);
+            hasher_update(&hasher, data, header.size);
+            hasher_final(&hasher, digest);
+            free(data);
+        }
+
+        if (data != NULL && memcmp(digest, header.digest, DIGEST_LENGTH) == 0)
+        {
+            char object_path[PATH_MAX];
+            snprintf(object_path, sizeof(object_path), "%s#%lld", relative_path, (long long)offset);
+            struct stat st = pack_st;
+            st.st_size = header.size;
+            st.st_mtime = 0;
+            index_stored_object(digest, object_path, &st);
+        }
+        else
+        {
+            log_error("Damaged object in pack: %s at %lld\n", relative_path, (long long)offset);
+        }
+        offset = next;
+    }
+    close(fd);
+}
+
+void hash_stored_file(struct walk_dir *dir, const char *name, void *ctx)
+{
+    const char *sorted_root_directory = ctx;
+
+    // Skip Vortex's own bookkeeping files in the root
+    if (dir->parent == NULL && strncmp(name, ".vortex", 7) == 0)
+        return;
+
+    char relative_path[PATH_MAX];
+    if (dir->parent == NULL)
+        snprintf(relative_path, sizeof(relative_path), "%s", name);
+    else
+        snprintf(relative_path, sizeof(relative_path), "%s/%s", dir->path + strlen(sorted_root_directory) + 1, name);
+
+    // Chunks are only reached through the manifests that list them
+    if (strncmp(relative_path, CHUNK_DIR_NAME "/", strlen(CHUNK_DIR_NAME) + 1) == 0)
+        return;
+
+    if (dir->parent != NULL && strcmp(dir->name, PACK_DIR_NAME) == 0)
+    {
+        hash_pack_file(dir, name, relative_path);
+        return;
+    }
+
+    struct stat path_stat;
+    unsigned char digest[DIGEST_LENGTH];
+    if (is_manifest(name) || is_compressed(name))
+    {
+        if (stat_object(sorted_root_directory, relative_path, &path_stat) == 0 &&
+            content_hash_object(sorted_root_directory, relative_path, digest) == 0)
+            index_stored_object(digest, relative_path, &path_stat);
+        else if (is_manifest(name))
+            log_error("Damaged manifest or missing chunks: %s\n", relative_path);
+        else
+            log_error("Damaged compressed object or missing dictionary: %s\n", relative_path);
+        return;
+    }
+
+    if (fstatat(dir->fd, name, &path_stat, 0) == -1)
+        return;
+
+    if (content_hash_fileat(dir->fd, name, digest) == 0)
+        index_stored_object(digest, relative_path, &path_stat);
+}
+
+// Hash every object in the sorted root from scratch
+void build_hash_table(const char *target_directory) {
+    struct walk walk = {.on_file = hash_stored_file, .prune = 0, .ctx = (void *)target_directory};
+    walk_tree(target_directory, &walk);
+}
+
+// Memory-bounded counterpart of build_hash_table and save_index: hash every object in the sorted root
+// and write the index as it goes
+void write_index_from_store(const char *sorted_root_directory)
+{
+    char index_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (format_path(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME) != 0 ||
+        format_path(tmp_path, sizeof(tmp_path), "%s.tmp", index_path) != 0)
+    {
+        log_error("Error writing index: %s (%s)\n", sorted_root_directory, strerror(errno));
+        return;
+    }
+
+    index_file = fopen(tmp_path, "w");
+    if (!index_file)
+    {
+        log_error("Error writing index: %s (%s)\n", tmp_path, strerror(errno));
+        return;
+    }
+    fprintf(index_file, "vortex-index %d\n", INDEX_VERSION);
+
+    build_hash_table(sorted_root_directory);
+
+    if (fclose(index_file) != 0 || rename(tmp_path, index_path) != 0)
+    {
+        log_error("Error writing index: %s (%s)\n", index_path, strerror(errno));
+        remove(tmp_path);
+    }
+    index_file = NULL;
+}
+
+// Function to create directories. mkdir is tried first, as the directory usually exists already or
+// only lacks its last component; parents are only created when it fails for want of them.
+int create_directory(const char *dir)
+{
+    // Use forward slash as the directory separator for Windows paths
+    char converted_dir[PATH_MAX];
+    snprintf(converted_dir, sizeof(converted_dir), "%s", dir);
+    for (char *c = converted_dir; *c; c++)
+    {
+        if (*c == '\\')
+            *c = '/';
+    }
+
+#ifdef _WIN32
+    int result = mkdir(converted_dir);
+#else
+    int result = mkdir(converted_dir, 0777);
+#endif
+
+    // Another worker may have created it in the meantime
+    if (result == 0 || errno == EEXIST)
+        return 1;
+
+    if (errno == ENOENT)
+    {
+        char parent_dir[PATH_MAX];
+        strncpy(parent_dir, converted_dir, sizeof(parent_dir));
+        char *last_slash = strrchr(parent_dir, '/');
+        if (last_slash != NULL && last_slash != parent_dir)
+        {
+            *last_slash = '\0';
+            if (!create_directory(parent_dir))
+            {
+                return 0; // Failed to create parent directory
+            }
+#ifdef _WIN32
+            result = mkdir(converted_dir);
+#else
+            result = mkdir(converted_dir, 0777);
+#endif
+            if (result == 0 || errno == EEXIST)
+                return 1;
+        }
+    }
+
+    log_error("Error creating directory: %s (%s)\n", converted_dir, strerror(errno));
+    return 0; // Directory creation failed
+}
+
+// Directories in the sorted root known to exist, so placing an object in one only costs a lookup
+struct known_directory
+{
+    UT_hash_handle hh;
+    char path[];
+};
+
+struct known_directory *known_directories = NULL;
+pthread_mutex_t known_directories_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// create_directory for directories in the sorted root, which are never removed while Vortex runs
+int ensure_directory(const char *dir)
+{
+    struct known_directory *known;
+    pthread_mutex_lock(&known_directories_lock);
+    HASH_FIND_STR(known_directories, dir, known);
+    pthread_mutex_unlock(&known_directories_lock);
+    if (known != NULL)
+        return 1;
+
+    if (!create_directory(dir))
+        return 0;
+
+    size_t length = strlen(dir);
+    known = malloc(sizeof(*known) + length + 1);
+    if (known == NULL)
+        return 1;
+    memcpy(known->path, dir, length + 1);
+
+    pthread_mutex_lock(&known_directories_lock);
+    struct known_directory *existing;
+    HASH_FIND_STR(known_directories, dir, existing);
+    if (existing == NULL)
+        HASH_ADD_STR(known_directories, path, known);
+    else
+        free(known);
+    pthread_mutex_unlock(&known_directories_lock);
+    return 1;
+}
+
+// Forget a directory, such as one removed behind our back, so the next placement creates it again
+void forget_directory(const char *dir)
+{
+    struct known_directory *known;
+    pthread_mutex_lock(&known_directories_lock);
+    HASH_FIND_STR(known_directories, dir, known);
+    if (known != NULL)
+        HASH_DEL(known_directories, known);
+    pthread_mutex_unlock(&known_directories_lock);
+    free(known);
+}
+
+
+
+
+
+// Write a whole buffer, however many calls it takes
+int write_all(int fd, const void *buffer, size_t len)
+{
+    for (size_t written = 0; written < len;)
+    {
+        ssize_t w = write(fd, (const char *)buffer + written, len - written);
+        if (w < 0)
+            return -1;
+        written += w;
+    }
+    return 0;
+}
+
+// Copy the contents of one open file to another using the cheapest mechanism the filesystems offer
+int copy_file_data(int src_fd, int dest_fd, off_t size)
+{
+#ifdef FICLONE
+    // Share the extents outright on filesystems with reflinks
+    if (ioctl(dest_fd, FICLONE, src_fd) == 0)
+        return 0;
+#endif
+
+    off_t copied = 0;
+    ssize_t n;
+
+#ifdef __linux__
+    // Let the kernel move the data without bouncing it through user space. Both calls advance the
+    // file offsets, so each fallback picks up where the previous one stopped.
+    while (copied < size && (n = copy_file_range(src_fd, NULL, dest_fd, NULL, size - copied, 0)) > 0)
+        copied += n;
+    while (copied < size && (n = sendfile(dest_fd, src_fd, NULL, size - copied)) > 0)
+        copied += n;
+#endif
+
+    // Plain read and write for whatever is left, including anything appended since the stat
+    char *buffer = get_io_buffer();
+    if (!buffer)
+        return -1;
+
+    int result = 0;
+    while (result == 0 && (n = read(src_fd, buffer, IO_BUF_SIZE)) > 0)
+        result = write_all(dest_fd, buffer, n);
+    if (n < 0)
+        result = -1;
+
+    return result;
+}
+
+// Function to copy an open file; src is its path for messages
+int copy_file(int src_fd, const char *src, const char *dest)
+{
+    log_debug("Copying file: %s\n", src);
+    log_debug("Destination: %s\n", dest);
+
+    struct stat st;
+    if (fstat(src_fd, &st) == -1 || lseek(src_fd, 0, SEEK_SET) == -1)
+    {
+        log_error("Error getting file/directory information: %s (%s)\n", src, strerror(errno));
+        return -1;
+    }
+
+    int dest_fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dest_fd == -1)
+    {
+        log_error("Error creating destination file: %s (%s)\n", dest, strerror(errno));
+        return -1;
+    }
+
+    int result = copy_file_data(src_fd, dest_fd, st.st_size);
+    if (close(dest_fd) != 0)
+        result = -1;
+
+    if (result != 0)
+    {
+        log_error("Error writing to destination file: %s (%s)\n", dest, strerror(errno));
+        remove(dest);
+    }
+
+    return result;
+}
+
+// Create a temporary file under the sorted root for an object being assembled, named after prefix,
+// the process and a counter, with the permissions any new file gets. Returns its descriptor, or -1.
+int create_temp_file(const char *sorted_root_directory, const char *prefix, char *temp_path, size_t temp_size)
+{
+    static unsigned long temp_counter = 0;
+    snprintf(temp_path, temp_size, "%s/%s/%s%ld-%lu", sorted_root_directory, TEMP_DIR_NAME, prefix, (long)getpid(),
+             __atomic_fetch_add(&temp_counter, 1, __ATOMIC_RELAXED));
+    return open(temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+}
+
+// Copy an open file into a new temporary file under the sorted root, hashing it on the way through
+// so every byte is read once. The first head_len bytes have already been read into head.
+// On success temp_path names the copy, digest holds its hash and 0 is returned.
+int copy_and_hash_file(int src_fd, const unsigned char *head, size_t head_len, const char *src,
+                       const char *sorted_root_directory, char *temp_path, size_t temp_size, unsigned char *digest)
+{
+    log_debug("Copying file: %s\n", src);
+
+    int dest_fd = create_temp_file(sorted_root_directory, "", temp_path, temp_size);
+    if (dest_fd == -1)
+    {
+        log_error("Error creating destination file: %s (%s)\n", temp_path, strerror(errno));
+        return -1;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    char *buffer = get_io_buffer();
+    struct hasher hasher = {0};
+    hasher_init(&hasher);
+    hasher_update(&hasher, head, head_len);
+
+    int result = buffer ? write_all(dest_fd, head, head_len) : -1;
+    if (result == 0 && lseek(src_fd, head_len, SEEK_SET) == -1)
+        result = -1;
+
+#ifdef VORTEX_HAVE_IO_URING
+    struct stat st;
+    struct uring *ring = get_worker_ring();
+    if (result == 0 && ring != NULL && fstat(src_fd, &st) == 0 &&
+        uring_stream(ring, src_fd, dest_fd, head_len, st.st_size, &hasher) != 0)
+    {
+        // Start again synchronously
+        hasher_init(&hasher);
+        hasher_update(&hasher, head, head_len);
+        if (lseek(src_fd, head_len, SEEK_SET) == -1 || lseek(dest_fd, head_len, SEEK_SET) == -1 ||
+            ftruncate(dest_fd, head_len) == -1)
+            result = -1;
+    }
+#endif
+
+    ssize_t n = 0;
+    while (result == 0 && (n = read(src_fd, buffer, IO_BUF_SIZE)) > 0)
+    {
+        hasher_update(&hasher, buffer, n);
+        result = write_all(dest_fd, buffer, n);
+    }
+    if (n < 0)
+        result = -1;
+    if (close(dest_fd) != 0)
+        result = -1;
+
+    hasher_final(&hasher, digest);
+
+    if (result != 0)
+    {
+        log_error("Error writing to destination file: %s (%s)\n", temp_path, strerror(errno));
+        remove(temp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Keep other runs from changing the sorted directory while this one does. Starting up clears out
+// temporary files and rolls the journal forward, which is only safe when no other run is using them,
+// so a second run is refused rather than kept waiting. The lock goes when the process exits.
+int lock_store(const char *sorted_root_directory)
+{
+#ifndef _WIN32
+    int fd = open(sorted_root_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        log_error("Error opening directory: %s (%s)\n", sorted_root_directory, strerror(errno));
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        if (errno == EWOULDBLOCK)
+            log_error("Another run is using the sorted directory: %s\n", sorted_root_directory);
+        else
+            log_error("Error locking directory: %s (%s)\n", sorted_root_directory, strerror(errno));
+        close(fd);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+// Clear out temporary files left behind by an interrupted run
+void clean_temp_directory(const char *sorted_root_directory)
+{
+    char temp_dir[PATH_MAX];
+    snprintf(temp_dir, sizeof(temp_dir), "%s/%s", sorted_root_directory, TEMP_DIR_NAME);
+    if (!create_directory(temp_dir))
+        return;
+
+    DIR *dir = opendir(temp_dir);
+    if (!dir)
+        return;
+
+    struct dirent *entry;
+    char path[PATH_MAX];
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (format_path(path, sizeof(path), "%s/%s", temp_dir, entry->d_name) == 0)
+            remove(path);
+    }
+
+    closedir(dir);
+}
+
+// Move a file into the store. Files already on the store's filesystem are renamed into place,
+// anything else is copied. Returns 0 if the file was moved, 1 if it was copied and the original still
+// has to be removed, -1 on errors.
+int place_file(int dirfd, const char *name, int src_fd, const char *src, const char *dest, const struct stat *src_st)
+{
+    if (src_st->st_dev == sorted_root_device)
+    {
+        if (renameat(dirfd, name, AT_FDCWD, dest) == 0)
+            return 0;
+        if (errno != EXDEV)
+        {
+            log_error("Error renaming file: %s (%s)\n", src, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (copy_file(src_fd, src, dest) != 0)
+        return -1;
+
+    return 1;
+}
+
+// Store a file for --link without taking it out of the ingest tree: as a reflink of it, or else a hard
+// link to it, neither of which copies any data. Only a file on another filesystem is copied. Returns
+// 0, or -1 on errors.
+int place_linked(int dirfd, const char *name, int src_fd, const char *src, const char *dest, const struct stat *src_st)
+{
+    if (src_st->st_dev == sorted_root_device)
+    {
+#ifdef FICLONE
+        int dest_fd = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (dest_fd != -1)
+        {
+            int cloned = ioctl(dest_fd, FICLONE, src_fd) == 0;
+            if (close(dest_fd) == 0 && cloned)
+                return 0;
+            unlink(dest);
+        }
+#endif
+        if (linkat(dirfd, name, AT_FDCWD, dest, 0) == 0)
+            return 0;
+    }
+
+    return copy_file(src_fd, src, dest);
+}
+
+// Replace a duplicate in the ingest tree with a reflink of the stored object at target, keeping the
+// duplicate's permissions and times, or else with a hard link to it. The replacement is renamed over
+// the duplicate, so its name always refers to a complete copy of the content. Returns -1 on errors.
+int link_to_object(const char *target, int dirfd, const char *name)
+{
+    static unsigned long link_counter = 0;
+    char temp_name[NAME_MAX + 1];
+    snprintf(temp_name, sizeof(temp_name), "%s%ld-%lu", LINK_TEMP_PREFIX, (long)getpid(),
+             __atomic_fetch_add(&link_counter, 1, __ATOMIC_RELAXED));
+
+    int linked = 0;
+#ifdef FICLONE
+    struct stat st;
+    int src_fd = open(target, O_RDONLY | O_CLOEXEC);
+    int dest_fd = src_fd == -1 || fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ? -1 :
+                  openat(dirfd, temp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (dest_fd != -1)
+    {
+        struct timespec times[2] = {st.st_atim, st.st_mtim};
+        linked = ioctl(dest_fd, FICLONE, src_fd) == 0 && fchmod(dest_fd, st.st_mode & 07777) == 0 &&
+                 futimens(dest_fd, times) == 0;
+        if (close(dest_fd) != 0)
+            linked = 0;
+        if (!linked)
+            unlinkat(dirfd, temp_name, 0);
+    }
+    if (src_fd != -1)
+        close(src_fd);
+#endif
+    if (!linked)
+        linked = linkat(AT_FDCWD, target, dirfd, temp_name, 0) == 0;
+
+    if (linked && renameat(dirfd, temp_name, dirfd, name) != 0)
+    {
+        unlinkat(dirfd, temp_name, 0);
+        linked = 0;
+    }
+    return linked ? 0 : -1;
+}
+
+// Crash safety. Objects only appear under their final name by rename, but neither their data nor
+// the renames are durable until the filesystem writes them back, so source files must not be deleted
+// before then. Every placement is written to a journal before it starts, and sources are deleted by a
+// committer thread after a group commit: one syncfs of the store for a whole batch of files. On
+// startup, placements that were begun but never committed are completed or rolled back.
+struct journal_entry
+{
+    uint64_t seq;          // journalled placement, or 0 for a duplicate source
+    struct walk_dir *dir;  // source to delete once committed, NULL if it was moved
+    char *name;
+    char *path;            // full source path, for messages
+    char *link;            // with --link, the stored object to replace the source with instead
+};
+
+struct journal
+{
+    FILE *file;
+    int root_fd;
+    uint64_t next_seq;
+    off_t kept;                  // length of the placements recovery couldn't settle, which stay
+    struct journal_entry *batch; // waiting for the next commit
+    size_t count;
+    size_t capacity;
+    int stopping;
+    pthread_t committer;
+};
+
+struct journal journal = {.file = NULL, .root_fd = -1};
+
+// Guards journal; journal_wake is signalled when a batch fills up or on shutdown, journal_drained
+// when a batch has been committed
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t journal_drained = PTHREAD_COND_INITIALIZER;
+
+// Make everything written to the store so far durable
+int sync_store(int root_fd)
+{
+#ifdef __linux__
+    return syncfs(root_fd);
+#else
+    sync();
+    return 0;
+#endif
+}
+
+// Note a placement before it starts. Returns its sequence number, or 0 without a journal.
+uint64_t journal_begin(const char *relative_path, const char *source)
+{
+    if (journal.file == NULL)
+        return 0;
+
+    pthread_mutex_lock(&journal_lock);
+    uint64_t seq = ++journal.next_seq;
+    fprintf(journal.file, "%s %llu %s\t%s\n", link_mode ? "link" : "begin", (unsigned long long)seq, relative_path, source);
+    fflush(journal.file);
+    pthread_mutex_unlock(&journal_lock);
+    return seq;
+}
+
+// Delete a source once it has been stored, or replace it with a link to the stored object
+void dispose_of_source(struct walk_dir *dir, const char *name, const char *path, const char *link)
+{
+    if (link != NULL)
+    {
+        if (link_to_object(link, dir->fd, name) == 0)
+            log_debug("Linked file: %s\n", path);
+        else
+        {
+            log_error("Error linking file: %s (%s)\n", path, strerror(errno));
+            count_error(ERROR_PLACEMENT);
+        }
+    }
+    else if (unlinkat(dir->fd, name, 0) != 0 && errno != ENOENT)
+    {
+        log_error("Error Deleting File: %s (%s)\n", path, strerror(errno));
+        count_error(ERROR_DELETE);
+    }
+}
+
+// Finish a placement, or dispose of a duplicate, at the next commit. dir and name give the source to
+// delete then, if any, and link the stored object to replace it with instead. Without the memory to
+// remember it, the source is left in place, and an unfinished placement is finished by the next run.
+void journal_commit_later(uint64_t seq, struct walk_dir *dir, const char *name, const char *path, const char *link)
+{
+    if (journal.file == NULL)
+    {
+        if (dir != NULL)
+            dispose_of_source(dir, name, path, link);
+        return;
+    }
+
+    char *name_copy = NULL, *path_copy = NULL, *link_copy = NULL;
+    if (dir != NULL && ((name_copy = strdup(name)) == NULL || (path_copy = strdup(path)) == NULL ||
+                        (link != NULL && (link_copy = strdup(link)) == NULL)))
+    {
+        log_error("Out of memory, leaving the source in place: %s\n", path);
+        count_error(ERROR_MEMORY);
+        free(name_copy);
+        free(path_copy);
+        name_copy = path_copy = NULL;
+        dir = NULL;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+
+    // Don't let workers run arbitrarily far ahead of the disk
+    while (journal.count >= 4 * JOURNAL_BATCH)
+        pthread_cond_wait(&journal_drained, &journal_lock);
+
+    if (journal.count == journal.capacity)
+    {
+        size_t capacity = journal.capacity ? journal.capacity * 2 : 256;
+        struct journal_entry *batch = realloc(journal.batch, capacity * sizeof(struct journal_entry));
+        if (batch == NULL)
+        {
+            pthread_mutex_unlock(&journal_lock);
+            log_error("Out of memory, leaving the source in place: %s\n", path);
+            count_error(ERROR_MEMORY);
+            free(name_copy);
+            free(path_copy);
+            free(link_copy);
+            return;
+        }
+        journal.batch = batch;
+        journal.capacity = capacity;
+    }
+
+    struct journal_entry *entry = &journal.batch[journal.count++];
+    entry->seq = seq;
+    entry->dir = dir;
+    entry->name = name_copy;
+    entry->path = path_copy;
+    entry->link = link_copy;
+    if (dir != NULL)
+        walk_dir_ref(dir);
+
+    if (journal.count >= JOURNAL_BATCH)
+        pthread_cond_signal(&journal_wake);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+// Sync the store, then delete the batch's sources and mark its placements done
+void commit_batch(struct journal_entry *batch, size_t count)
+{
+    uint64_t start = now_ns();
+    int synced = sync_store(journal.root_fd) == 0;
+    if (!synced)
+    {
+        log_error("Error syncing the sorted directory, keeping source files (%s)\n", strerror(errno));
+        count_error(ERROR_SYNC);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct journal_entry *entry = &batch[i];
+        if (synced && entry->dir != NULL)
+            dispose_of_source(entry->dir, entry->name, entry->path, entry->link);
+    }
+
+    if (synced)
+    {
+        pthread_mutex_lock(&journal_lock);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (batch[i].seq != 0)
+                fprintf(journal.file, "done %llu\n", (unsigned long long)batch[i].seq);
+        }
+        fflush(journal.file);
+        pthread_mutex_unlock(&journal_lock);
+    }
+
+    // Dropping the references may prune directories the deletes emptied
+    for (size_t i = 0; i < count; i++)
+    {
+        if (batch[i].dir != NULL)
+            walk_dir_release(batch[i].dir);
+        free(batch[i].name);
+        free(batch[i].path);
+        free(batch[i].link);
+    }
+    stage_end(STAGE_COMMIT, start);
+}
+
+void *committer_thread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&journal_lock);
+    for (;;)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += JOURNAL_INTERVAL;
+        while (!journal.stopping && journal.count < JOURNAL_BATCH)
+        {
+            if (pthread_cond_timedwait(&journal_wake, &journal_lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+
+        if (journal.count == 0)
+        {
+            if (journal.stopping)
+                break;
+            continue;
+        }
+
+        struct journal_entry *batch = journal.batch;
+        size_t count = journal.count;
+        journal.batch = NULL;
+        journal.count = 0;
+        journal.capacity = 0;
+
+        pthread_mutex_unlock(&journal_lock);
+        commit_batch(batch, count);
+        free(batch);
+        pthread_mutex_lock(&journal_lock);
+        pthread_cond_broadcast(&journal_drained);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+// Open the journal and start committing. Without a journal sources are deleted straight away.
+void journal_start(const char *sorted_root_directory)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", sorted_root_directory, JOURNAL_FILE_NAME);
+
+    journal.root_fd = open(sorted_root_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    journal.file = journal.root_fd == -1 ? NULL : fopen(path, "a");
+    if (journal.file == NULL)
+    {
+        log_error("Error opening journal: %s (%s)\n", path, strerror(errno));
+        if (journal.root_fd != -1)
+            close(journal.root_fd);
+        journal.root_fd = -1;
+        return;
+    }
+
+    struct stat st;
+    journal.kept = fstat(fileno(journal.file), &st) == 0 ? st.st_size : 0;
+    journal.stopping = 0;
+    pthread_create(&journal.committer, NULL, committer_thread, NULL);
+}
+
+// Commit whatever is left and empty the journal of this run's placements, as none is pending any more
+void journal_stop(void)
+{
+    if (journal.file == NULL)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    journal.stopping = 1;
+    pthread_cond_signal(&journal_wake);
+    pthread_mutex_unlock(&journal_lock);
+    pthread_join(journal.committer, NULL);
+
+    if (sync_store(journal.root_fd) == 0)
+        ftruncate(fileno(journal.file), journal.kept);
+    fclose(journal.file);
+    close(journal.root_fd);
+    journal.file = NULL;
+    journal.root_fd = -1;
+}
+
+// A placement found in the journal without a matching "done"
+struct journal_record
+{
+    uint64_t seq; // key
+    char *relative_path;
+    char *source;
+    int keep_source; // placed by --link, so the source stays once the object is complete
+    UT_hash_handle hh;
+};
+
+void free_journal_records(struct journal_record **records)
+{
+    struct journal_record *r, *tmp;
+    HASH_ITER(hh, *records, r, tmp)
+    {
+        HASH_DEL(*records, r);
+        free(r->relative_path);
+        free(r->source);
+        free(r);
+    }
+}
+
+// Finish or undo the placements an interrupted run left in the journal. An object whose content
+// matches its name is complete: its source is deleted if it is still there, and it is added to the
+// index in case that write was lost. An object known to be incomplete is removed, leaving the source
+// to be ingested again. One that can't be checked is kept along with its journal record, unless its
+// source is still there to ingest again. Returns -1 if the journal couldn't be recovered.
+int recover_journal(const char *sorted_root_directory)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", sorted_root_directory, JOURNAL_FILE_NAME);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+
+    struct journal_record *records = NULL;
+    uint64_t last_seq = 0;
+    char line[2 * PATH_MAX + 64];
+    while (fgets(line, sizeof(line), file))
+    {
+        line[strcspn(line, "\n")] = '\0';
+
+        unsigned long long seq;
+        int offset = 0;
+        char verb[8];
+        if (sscanf(line, "%7s %llu %n", verb, &seq, &offset) == 2 && offset > 0 &&
+            (strcmp(verb, "begin") == 0 || strcmp(verb, "link") == 0))
+        {
+            char *tab = strchr(line + offset, '\t');
+            if (tab == NULL)
+                continue;
+            *tab = '\0';
+
+            struct journal_record *r = calloc(1, sizeof(struct journal_record));
+            if (r != NULL)
+            {
+                r->relative_path = strdup(line + offset);
+                r->source = strdup(tab + 1);
+            }
+            if (r == NULL || r->relative_path == NULL || r->source == NULL)
+            {
+                // Truncating the journal now would lose what it has yet to tell
+                log_error("Out of memory recovering the journal: %s\n", path);
+                if (r != NULL)
+                {
+                    free(r->relative_path);
+                    free(r->source);
+                    free(r);
+                }
+                free_journal_records(&records);
+                fclose(file);
+                return -1;
+            }
+            r->seq = seq;
+            r->keep_source = strcmp(verb, "link") == 0;
+            HASH_ADD(hh, records, seq, sizeof(uint64_t), r);
+            if (seq > last_seq)
+                last_seq = seq;
+        }
+        else if (sscanf(line, "done %llu", &seq) == 1)
+        {
+            uint64_t key = seq;
+            struct journal_record *r;
+            HASH_FIND(hh, records, &key, sizeof(uint64_t), r);
+            if (r != NULL)
+            {
+                HASH_DEL(records, r);
+                free(r->relative_path);
+                free(r->source);
+                free(r);
+            }
+        }
+    }
+    fclose(file);
+
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME);
+    FILE *index = access(index_path, F_OK) == 0 ? fopen(index_path, "a") : NULL;
+
+    int completed = 0;
+    int rolled_back = 0;
+    int kept = 0;
+    struct journal_record *r, *tmp;
+    HASH_ITER(hh, records, r, tmp)
+    {
+        char dest[PATH_MAX];
+        snprintf(dest, sizeof(dest), "%s/%s", sorted_root_directory, r->relative_path);
+
+        // An object is named after its hash, and a packed one has it in its record
+        char pack_path[PATH_MAX];
+        off_t record;
+        int packed = packed_location(r->relative_path, pack_path, sizeof(pack_path), &record);
+        unsigned char expected_digest[DIGEST_LENGTH];
+        char expected[2 * DIGEST_LENGTH + 1] = "";
+        if (object_digest(sorted_root_directory, r->relative_path, expected_digest) == 0)
+            digest_to_hex(expected_digest, expected);
+
+        struct stat st;
+        unsigned char digest[DIGEST_LENGTH];
+        char hash[2 * DIGEST_LENGTH + 1] = "";
+        int missing = 0;
+        if (stat_object(sorted_root_directory, r->relative_path, &st) != 0)
+            missing = errno == ENOENT;
+        else if (content_hash_object(sorted_root_directory, r->relative_path, digest) == 0)
+            digest_to_hex(digest, hash);
+
+        // Whether the object is known to be complete or incomplete, rather than unreadable
+        int checked = missing || (hash[0] != '\0' && expected[0] != '\0');
+        if (!checked && (r->keep_source || access(r->source, F_OK) != 0))
+        {
+            // Removing it could lose the only copy of the file
+            log_error("Error checking interrupted placement, keeping it: %s\n", dest);
+            kept++;
+            continue;
+        }
+
+        if (!missing && hash[0] != '\0' && strncmp(expected, hash, 2 * DIGEST_LENGTH) == 0)
+        {
+            // The object made it; finish the move
+            unsigned char source_digest[DIGEST_LENGTH];
+            if (!r->keep_source && content_hash_file(r->source, source_digest) == 0 &&
+                memcmp(source_digest, digest, DIGEST_LENGTH) == 0)
+            {
+                log_info("Deleting file: %s\n", r->source);
+                remove(r->source);
+            }
+
+            if (index != NULL)
+            {
+                struct file_hash s = {.size = st.st_size, .mtime = st.st_mtime, .ino = st.st_ino, .path = r->relative_path};
+                memcpy(s.digest, digest, DIGEST_LENGTH);
+                write_index_entry(index, &s);
+            }
+            completed++;
+        }
+        else
+        {
+            // Incomplete; the source is still where it was. A packed object is left for the next
+            // append to the pack to cut off.
+            if (!packed && remove(dest) == 0)
+                log_info("Removed incomplete file: %s\n", dest);
+            rolled_back++;
+        }
+
+        HASH_DEL(records, r);
+        free(r->relative_path);
+        free(r->source);
+        free(r);
+    }
+
+    if (index != NULL)
+        fclose(index);
+
+    if (completed + rolled_back + kept > 0)
+        log_info("Recovered interrupted ingest: %d completed, %d rolled back, %d kept\n", completed, rolled_back,
+                 kept);
+
+    // What's kept stays in the journal, and this run's placements are numbered after it
+    journal.next_seq = last_seq;
+    char tmp_path[PATH_MAX];
+    FILE *rest = records != NULL && format_path(tmp_path, sizeof(tmp_path), "%s.tmp", path) == 0 ? fopen(tmp_path, "w")
+                                                                                                : NULL;
+    int written = records == NULL || rest != NULL;
+    HASH_ITER(hh, records, r, tmp)
+    {
+        if (written && fprintf(rest, "%s %llu %s\t%s\n", r->keep_source ? "link" : "begin", (unsigned long long)r->seq,
+                               r->relative_path, r->source) < 0)
+            written = 0;
+    }
+    if (rest != NULL && fclose(rest) != 0)
+        written = 0;
+    free_journal_records(&records);
+
+    // Left as it was, the journal is only recovered again by the next run
+    int result = -1;
+    int root_fd = open(sorted_root_directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (written && root_fd != -1 && sync_store(root_fd) == 0)
+        result = rest != NULL ? rename(tmp_path, path) : truncate(path, 0);
+    if (root_fd != -1)
+        close(root_fd);
+    if (result != 0)
+    {
+        log_error("Error rewriting journal: %s (%s)\n", path, strerror(errno));
+        if (rest != NULL)
+            remove(tmp_path);
+    }
+    return 0;
+}
+
+// Bounded queue of work between the directory walker and the workers
+struct work_queue
+{
+    void **items;
+    int head;
+    int count;
+    int capacity;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+struct work_queue ingest_queue;
+
+// A file waiting to be ingested: an entry of a directory the walker has open
+struct ingest_item
+{
+    struct walk_dir *dir;
+    char *name;
+};
+
+// Returns -1 if there isn't the memory for the queue
+int work_queue_init(struct work_queue *queue, int capacity)
+{
+    queue->items = malloc(capacity * sizeof(void *));
+    if (queue->items == NULL)
+    {
+        log_error("Out of memory creating the work queue\n");
+        return -1;
+    }
+    queue->head = 0;
+    queue->count = 0;
+    queue->capacity = capacity;
+    queue->closed = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return 0;
+}
+
+void work_queue_destroy(struct work_queue *queue)
+{
+    free(queue->items);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+// Add an item to the queue, taking ownership of it. Blocks while the queue is full.
+void work_queue_push(struct work_queue *queue, void *item)
+{
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->capacity)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->items[(queue->head + queue->count) % queue->capacity] = item;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Take the next item from the queue. Returns NULL once the queue is closed and drained.
+void *work_queue_pop(struct work_queue *queue)
+{
+    void *item = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    if (queue->count > 0)
+    {
+        item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+// No more items are coming; wake every worker waiting for one
+void work_queue_close(struct work_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+void queue_ingest_file(struct walk_dir *dir, const char *name, void *ctx)
+{
+    (void)ctx;
+    // A replacement link being put in place by --link
+    if (strncmp(name, LINK_TEMP_PREFIX, strlen(LINK_TEMP_PREFIX)) == 0)
+        return;
+
+    struct ingest_item *item = malloc(sizeof(struct ingest_item));
+    char *name_copy = strdup(name);
+    if (item == NULL || name_copy == NULL)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+        log_error("Out of memory queueing file: %s\n", path);
+        file_error(ERROR_MEMORY, path, 0);
+        free(item);
+        free(name_copy);
+        return;
+    }
+    walk_dir_ref(dir);
+    item->dir = dir;
+    item->name = name_copy;
+    work_queue_push(&ingest_queue, item);
+}
+
+// Walk the ingest tree, queueing every regular file for the workers. With prune set, directories are
+// removed as soon as the last of their files has been handled, if that left them empty.
+void process_files_recursive(const char *directory, int prune) {
+    struct walk walk = {.on_file = queue_ingest_file, .prune = prune, .ctx = NULL};
+    walk_tree(directory, &walk);
+}
+
+// Classify a single ingested file and hand it to process_file
+void ingest_file(struct walk_dir *dir, const char *name, const char *sorted_root_directory)
+{
+    char *path = walk_path(dir, name);
+
+    // Determine where the file goes based on its extension. Anything the extension doesn't settle
+    // is classified by process_file from its content.
+    uint64_t start = now_ns();
+    const char *destination = get_destination(name);
+    stage_end(STAGE_MIME, start);
+
+    process_file(dir, name, path, sorted_root_directory, destination);
+    free(path);
+}
+
+typedef void (*ingest_file_fn)(struct walk_dir *dir, const char *name, const char *sorted_root_directory);
+
+struct ingest_job
+{
+    const char *ingest_directory;
+    const char *sorted_root_directory;
+    ingest_file_fn handle_file; // called by the workers for every file
+    int prune;                  // remove emptied directories
+};
+
+void *walker_thread(void *arg)
+{
+    struct ingest_job *job = arg;
+    process_files_recursive(job->ingest_directory, job->prune);
+    work_queue_close(&ingest_queue);
+    return NULL;
+}
+
+void *worker_thread(void *arg)
+{
+    struct ingest_job *job = arg;
+    struct ingest_item *item;
+    while ((item = work_queue_pop(&ingest_queue)) != NULL)
+    {
+        job->handle_file(item->dir, item->name, job->sorted_root_directory);
+        walk_dir_release(item->dir);
+        free(item->name);
+        free(item);
+    }
+    free_io_buffer();
+    free_worker_magic();
+#ifdef VORTEX_WITH_ZSTD
+    free_worker_cctx();
+#endif
+#ifdef VORTEX_HAVE_IO_URING
+    free_worker_ring();
+#endif
+    return NULL;
+}
+
+// Start up to jobs workers on the ingest queue. Returns how many started, which is fewer when
+// threads run out; the queue is drained by however many there are.
+int start_workers(pthread_t *workers, int jobs, struct ingest_job *job)
+{
+    int started = 0;
+    while (started < jobs)
+    {
+        int error = pthread_create(&workers[started], NULL, worker_thread, job);
+        if (error != 0)
+        {
+            log_error("Error starting worker %d of %d (%s)\n", started + 1, jobs, strerror(error));
+            break;
+        }
+        started++;
+    }
+    return started;
+}
+
+// Run the walker and a pool of workers over the ingest directory. Returns -1 if no worker could be started.
+int run_ingest(struct ingest_job *job, int jobs)
+{
+    pthread_t walker;
+    pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+    if (workers == NULL)
+    {
+        log_error("Out of memory starting workers\n");
+        return -1;
+    }
+
+    if (work_queue_init(&ingest_queue, WORK_QUEUE_CAPACITY) != 0)
+    {
+        free(workers);
+        return -1;
+    }
+
+    int started = start_workers(workers, jobs, job);
+    if (started > 0)
+    {
+        // Without a thread of its own, the walk runs here
+        if (pthread_create(&walker, NULL, walker_thread, job) == 0)
+            pthread_join(walker, NULL);
+        else
+            walker_thread(job);
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    work_queue_destroy(&ingest_queue);
+    free(workers);
+    return started > 0 ? 0 : -1;
+}
+
+// Two-phase ingest. "plan" hashes and classifies the ingest tree with the usual walker and workers,
+// but only writes down what would happen to each file. "apply" carries a plan out later, visiting the
+// sources in the order their data sits on disk, so a spinning disk mostly reads sequentially instead
+// of seeking back and forth as it does for an ingest in directory order.
+#define PLAN_HEADER "vortex-plan 2"
+
+enum plan_action
+{
+    PLAN_STORE,
+    PLAN_DUPLICATE,
+    PLAN_DELETE,
+    PLAN_SKIP,
+    PLAN_ACTION_COUNT
+};
+
+const char *plan_action_names[PLAN_ACTION_COUNT] = {"store", "duplicate", "delete", "skip"};
+
+struct planned_digest
+{
+    unsigned char digest[DIGEST_LENGTH]; // key
+    UT_hash_handle hh;
+};
+
+struct plan
+{
+    FILE *file;
+    size_t root_length;             // of the ingest directory path, to make sources relative
+    struct planned_digest *digests; // objects the plan stores
+    size_t actions[PLAN_ACTION_COUNT];
+    int failed;                     // set when a file couldn't be classified for want of memory
+    pthread_mutex_t lock;
+};
+
+struct plan plan = {NULL, 0, NULL, {0}, 0, PTHREAD_MUTEX_INITIALIZER};
+
+// One line of a plan
+struct plan_operation
+{
+    enum plan_action action;
+    unsigned char digest[DIGEST_LENGTH];
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime; // a file rewritten within the same second still changes one of them
+    ino_t ino;
+    uint64_t physical;  // disk offset of the first extent, or 0 if unknown
+    char *destination;  // in MIME form
+    char *source;       // relative to the ingest directory
+};
+
+// Where the data of an open file starts on disk, or 0 where the filesystem won't say or hasn't
+// allocated it yet
+uint64_t physical_offset(int fd)
+{
+#ifdef FS_IOC_FIEMAP
+    struct
+    {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 && request.map.fm_mapped_extents == 1)
+        return request.map.fm_extents[0].fe_physical;
+#endif
+    return 0;
+}
+
+// Whether digest is new to both the store and the plan so far, in which case the plan now stores it.
+// Returns -1 if there isn't the memory to remember that. Call with plan.lock held.
+int plan_claims(const unsigned char *digest)
+{
+    pthread_mutex_lock(&hash_table_lock);
+    int stored = find_hash(digest) != NULL || (max_memory != 0 && digest_index_contains(digest));
+    pthread_mutex_unlock(&hash_table_lock);
+
+    struct planned_digest *p;
+    HASH_FIND(hh, plan.digests, digest, DIGEST_LENGTH, p);
+    if (stored || p != NULL)
+        return 0;
+
+    p = malloc(sizeof(struct planned_digest));
+    if (p == NULL)
+        return -1;
+    memcpy(p->digest, digest, DIGEST_LENGTH);
+    HASH_ADD(hh, plan.digests, digest, DIGEST_LENGTH, p);
+    return 1;
+}
+
+// Hash and classify one file of the ingest tree, and add it to the plan
+void plan_file(struct walk_dir *dir, const char *name, const char *sorted_root_directory)
+{
+    (void)sorted_root_directory;
+    char *path = walk_path(dir, name);
+    enum plan_action action = PLAN_SKIP;
+    struct stat st = {0};
+    unsigned char digest[DIGEST_LENGTH];
+    char detected_type[256];
+    const char *destination = NULL;
+    uint64_t physical = 0;
+
+    int fd = -1;
+    if (strcmp(name, "desktop.ini") == 0)
+    {
+        action = PLAN_DELETE;
+    }
+    else if ((fd = openat(dir->fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1 || fstat(fd, &st) == -1)
+    {
+        log_error("Error opening source file: %s (%s)\n", path, strerror(errno));
+        file_error(ERROR_OPEN, path, 0);
+    }
+    else
+    {
+        count(COUNTER_FILES, 1);
+        count(COUNTER_BYTES, st.st_size);
+
+        unsigned char head[PARTIAL_BLOCK_SIZE];
+        ssize_t head_len = pread(fd, head, sizeof(head), 0);
+        uint64_t start = now_ns();
+        destination = get_destination(name);
+        if (destination == NULL && head_len >= 0)
+            destination = detect_mime_type(head, head_len, detected_type, sizeof(detected_type));
+        stage_end(STAGE_MIME, start);
+
+        start = now_ns();
+        int hashed = head_len >= 0 ? content_hash_fd(fd, st.st_size, head, head_len, digest) : -1;
+        stage_end(STAGE_HASHING, start);
+        if (hashed != 0)
+        {
+            log_error("Error hashing file: %s\n", path);
+            file_error(ERROR_HASH, path, st.st_size);
+        }
+        else
+        {
+            action = PLAN_DUPLICATE;
+            physical = physical_offset(fd);
+        }
+    }
+    if (fd != -1)
+        close(fd);
+
+    char hex[2 * DIGEST_LENGTH + 1] = "-";
+    if (action == PLAN_DUPLICATE)
+        digest_to_hex(digest, hex);
+
+    pthread_mutex_lock(&plan.lock);
+    int claimed = action == PLAN_DUPLICATE ? plan_claims(digest) : 0;
+    if (claimed < 0)
+    {
+        // Calling it a duplicate could lose the only copy, so it is skipped and the plan fails
+        log_error("Out of memory planning file: %s\n", path);
+        count_error(ERROR_MEMORY);
+        plan.failed = 1;
+        action = PLAN_SKIP;
+    }
+    else if (claimed)
+        action = PLAN_STORE;
+    plan.actions[action]++;
+    fprintf(plan.file, "%s\t%s\t%lld\t%lld.%09ld\t%lld.%09ld\t%llu\t%llu\t%s\t%s\n", plan_action_names[action], hex,
+            (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)st.st_ctim.tv_sec,
+            st.st_ctim.tv_nsec, (unsigned long long)st.st_ino, (unsigned long long)physical,
+            destination ? destination : "-", path + plan.root_length + 1);
+    pthread_mutex_unlock(&plan.lock);
+
+    log_debug("Planned %s: %s\n", plan_action_names[action], path);
+    free(path);
+}
+
+// Plan the ingest of a tree into plan_path without changing either
+int run_plan(const char *ingest_directory, const char *sorted_root_directory, const char *plan_path, int jobs)
+{
+    // The plan names both roots absolutely, so it can be applied from anywhere
+    char ingest_real[PATH_MAX];
+    char sorted_real[PATH_MAX];
+    if (realpath(ingest_directory, ingest_real) == NULL)
+    {
+        log_error("Error opening directory: %s (%s)\n", ingest_directory, strerror(errno));
+        return -1;
+    }
+    if (realpath(sorted_root_directory, sorted_real) == NULL)
+        snprintf(sorted_real, sizeof(sorted_real), "%s", sorted_root_directory);
+
+    plan.file = fopen(plan_path, "w");
+    if (plan.file == NULL)
+    {
+        log_error("Error creating plan: %s (%s)\n", plan_path, strerror(errno));
+        return -1;
+    }
+    fprintf(plan.file, "%s\t%s\t%s\t%s\n", PLAN_HEADER, ingest_real, sorted_real, hash_algorithm_names[hash_algorithm]);
+    plan.root_length = strlen(ingest_directory);
+
+    struct ingest_job job = {ingest_directory, sorted_root_directory, plan_file, 0};
+    int result = run_ingest(&job, jobs);
+    if (ferror(plan.file) | fclose(plan.file))
+    {
+        log_error("Error writing plan: %s (%s)\n", plan_path, strerror(errno));
+        result = -1;
+    }
+    plan.file = NULL;
+
+    struct planned_digest *p, *tmp;
+    HASH_ITER(hh, plan.digests, p, tmp)
+    {
+        HASH_DEL(plan.digests, p);
+        free(p);
+    }
+
+    log_info("Plan: %zu to store, %zu duplicates, %zu to delete, %zu skipped: %s\n", plan.actions[PLAN_STORE],
+             plan.actions[PLAN_DUPLICATE], plan.actions[PLAN_DELETE], plan.actions[PLAN_SKIP], plan_path);
+    if (plan.failed)
+    {
+        log_error("The plan is incomplete, as memory ran out: %s\n", plan_path);
+        result = -1;
+    }
+    return result;
+}
+
+// Parse a time written as seconds and nanoseconds, "1700000000.123456789"
+int parse_plan_time(const char *text, struct timespec *time)
+{
+    char *end;
+    time->tv_sec = strtoll(text, &end, 10);
+    if (*end != '.')
+        return -1;
+    time->tv_nsec = strtol(end + 1, &end, 10);
+    return *end == '\0' && time->tv_nsec >= 0 && time->tv_nsec < 1000000000L ? 0 : -1;
+}
+
+// Read a plan. ingest_directory, sorted_root_directory and the hash engine its digests were taken
+// with are set from its header. Returns the number of operations, or -1 on errors.
+long read_plan(const char *plan_path, struct plan_operation **operations, char **ingest_directory,
+               char **sorted_root_directory, int *hash)
+{
+    FILE *file = fopen(plan_path, "r");
+    if (file == NULL)
+    {
+        log_error("Error opening plan: %s (%s)\n", plan_path, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0;
+    long count = 0;
+    long capacity = 0;
+    long line_number = 0;
+    int out_of_memory = 0;
+    *operations = NULL;
+    *ingest_directory = NULL;
+    *sorted_root_directory = NULL;
+
+    while (getline(&line, &line_size, file) != -1)
+    {
+        line_number++;
+        line[strcspn(line, "\n")] = '\0';
+
+        char *fields[9];
+        char *rest = line;
+        int n = 0;
+        while (n < 8 && rest != NULL)
+            fields[n++] = strsep(&rest, "\t");
+        if (rest != NULL)
+            fields[n++] = rest; // the source, which may itself contain tabs
+
+        if (line_number == 1)
+        {
+            if (n != 4 || strcmp(fields[0], PLAN_HEADER) != 0)
+                break;
+            for (int i = 0; i < HASH_ALGORITHM_COUNT; i++)
+            {
+                if (strcmp(fields[3], hash_algorithm_names[i]) == 0)
+                    *hash = i;
+            }
+            if (*hash == -1)
+                break;
+            *ingest_directory = strdup(fields[1]);
+            *sorted_root_directory = strdup(fields[2]);
+            continue;
+        }
+
+        struct plan_operation op = {.action = PLAN_ACTION_COUNT};
+        for (int i = 0; n == 9 && i < PLAN_ACTION_COUNT; i++)
+        {
+            if (strcmp(fields[0], plan_action_names[i]) == 0)
+                op.action = i;
+        }
+        if (op.action == PLAN_ACTION_COUNT ||
+            ((op.action == PLAN_STORE || op.action == PLAN_DUPLICATE) && hex_to_digest(fields[1], op.digest) != 0) ||
+            parse_plan_time(fields[3], &op.mtime) != 0 || parse_plan_time(fields[4], &op.ctime) != 0)
+        {
+            log_error("Invalid line in plan: %s:%ld\n", plan_path, line_number);
+            continue;
+        }
+        op.size = strtoll(fields[2], NULL, 10);
+        op.ino = strtoull(fields[5], NULL, 10);
+        op.physical = strtoull(fields[6], NULL, 10);
+        op.destination = strdup(fields[7]);
+        op.source = strdup(fields[8]);
+
+        struct plan_operation *grown = *operations;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            grown = realloc(*operations, capacity * sizeof(struct plan_operation));
+        }
+        if (grown == NULL || op.destination == NULL || op.source == NULL)
+        {
+            log_error("Out of memory reading plan: %s\n", plan_path);
+            free(op.destination);
+            free(op.source);
+            out_of_memory = 1;
+            break;
+        }
+        *operations = grown;
+        (*operations)[count++] = op;
+    }
+
+    free(line);
+    fclose(file);
+    if (*ingest_directory == NULL || out_of_memory)
+    {
+        if (!out_of_memory)
+            log_error("Not a plan: %s\n", plan_path);
+        for (long i = 0; i < count; i++)
+        {
+            free((*operations)[i].destination);
+            free((*operations)[i].source);
+        }
+        free(*operations);
+        return -1;
+    }
+    return count;
+}
+
+// Disk order: by physical offset where it is known, then by inode, which most filesystems allocate
+// roughly in disk order too
+static int compare_plan_locality(const void *a, const void *b)
+{
+    const struct plan_operation *x = a;
+    const struct plan_operation *y = b;
+    if (x->physical != y->physical)
+        return x->physical < y->physical ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return strcmp(x->source, y->source);
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Source directories opened while applying a plan, by path relative to the ingest directory
+struct source_dir
+{
+    char *path; // key
+    struct walk_dir *dir;
+    UT_hash_handle hh;
+};
+
+struct walk_dir *open_source_dir(struct source_dir **dirs, struct walk_dir *root, const char *path)
+{
+    if (path[0] == '\0')
+        return root;
+
+    struct source_dir *d;
+    HASH_FIND_STR(*dirs, path, d);
+    if (d != NULL)
+        return d->dir;
+
+    struct walk_dir *parent = root;
+    const char *name = path;
+    const char *slash = strrchr(path, '/');
+    if (slash != NULL)
+    {
+        char *parent_path = strndup(path, slash - path);
+        parent = parent_path ? open_source_dir(dirs, root, parent_path) : NULL;
+        free(parent_path);
+        name = slash + 1;
+    }
+
+    // Without the memory to remember the directory, its files are left alone
+    d = malloc(sizeof(struct source_dir));
+    if (d == NULL || (d->path = strdup(path)) == NULL)
+    {
+        log_error("Out of memory opening directory: %s\n", path);
+        count_error(ERROR_MEMORY);
+        free(d);
+        return NULL;
+    }
+    d->dir = parent ? walk_dir_open(parent, name) : NULL;
+    if (d->dir != NULL)
+        d->dir->prune = 1;
+    else if (parent != NULL)
+        log_error("Error opening directory: %s/%s (%s)\n", parent->path, name, strerror(errno));
+    HASH_ADD_KEYPTR(hh, *dirs, d->path, strlen(d->path), d);
+    return d->dir;
+}
+
+void apply_operation(const struct plan_operation *op, struct walk_dir *dir, const char *name,
+                     const char *sorted_root_directory)
+{
+    char *path = walk_path(dir, name);
+    if (op->action == PLAN_DELETE)
+    {
+        if (link_mode)
+        {
+            free(path);
+            return;
+        }
+        log_info("Deleting file: %s\n", path);
+        if (unlinkat(dir->fd, name, 0) == 0)
+            log_event("deleted", path, NULL, 0, NULL);
+        free(path);
+        return;
+    }
+
+    int src_fd = openat(dir->fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (src_fd == -1 || fstat(src_fd, &st) == -1)
+    {
+        log_error("Error opening source file: %s (%s)\n", path, strerror(errno));
+        file_error(ERROR_OPEN, path, 0);
+    }
+    else if (st.st_size != op->size || st.st_ino != op->ino || st.st_mtim.tv_sec != op->mtime.tv_sec ||
+             st.st_mtim.tv_nsec != op->mtime.tv_nsec || st.st_ctim.tv_sec != op->ctime.tv_sec ||
+             st.st_ctim.tv_nsec != op->ctime.tv_nsec)
+    {
+        // Trusting the planned hash is only safe for files that haven't changed since
+        log_info("Skipping file changed since it was planned: %s\n", path);
+    }
+    else
+    {
+        count(COUNTER_FILES, 1);
+        count(COUNTER_BYTES, st.st_size);
+        store_file(dir, name, src_fd, &st, path, sorted_root_directory, op->destination, op->digest, "", 1);
+    }
+
+    if (src_fd != -1)
+        close(src_fd);
+    free(path);
+}
+
+// Carry out a plan: create the destination directories together, then store or drop the files in
+// disk order
+int run_apply(struct plan_operation *operations, long count, const char *ingest_directory,
+              const char *sorted_root_directory)
+{
+    struct walk_dir *root = walk_dir_open(NULL, ingest_directory);
+    if (root == NULL)
+    {
+        log_error("Error opening directory: %s (%s)\n", ingest_directory, strerror(errno));
+        return -1;
+    }
+
+    char **destinations = malloc((count + 1) * sizeof(char *));
+    if (destinations == NULL)
+    {
+        log_error("Out of memory applying plan\n");
+        walk_dir_release(root);
+        return -1;
+    }
+    long destination_count = 0;
+    for (long i = 0; i < count; i++)
+    {
+        if (operations[i].action == PLAN_STORE)
+            destinations[destination_count++] = operations[i].destination;
+    }
+    qsort(destinations, destination_count, sizeof(char *), compare_strings);
+    uint64_t start = now_ns();
+    for (long i = 0; i < destination_count; i++)
+    {
+        if (i > 0 && strcmp(destinations[i], destinations[i - 1]) == 0)
+            continue;
+
+        char relative_dir[PATH_MAX];
+        char newdir[PATH_MAX];
+        destination_path(destinations[i], relative_dir, sizeof(relative_dir));
+        if (format_path(newdir, sizeof(newdir), "%s/%s", sorted_root_directory, relative_dir) != 0 ||
+            !ensure_directory(newdir))
+            log_error("Error creating destination directory: %s/%s (%s)\n", sorted_root_directory, relative_dir,
+                      strerror(errno));
+    }
+    stage_end(STAGE_DIRECTORIES, start);
+    free(destinations);
+
+    qsort(operations, count, sizeof(struct plan_operation), compare_plan_locality);
+
+    struct source_dir *dirs = NULL;
+    for (long i = 0; i < count; i++)
+    {
+        struct plan_operation *op = &operations[i];
+        if (op->action == PLAN_SKIP)
+            continue;
+
+        const char *slash = strrchr(op->source, '/');
+        char *dir_path = slash ? strndup(op->source, slash - op->source) : strdup("");
+        struct walk_dir *dir = dir_path ? open_source_dir(&dirs, root, dir_path) : NULL;
+        free(dir_path);
+        if (dir != NULL)
+            apply_operation(op, dir, slash ? slash + 1 : op->source, sorted_root_directory);
+    }
+
+    // Emptied directories are pruned as the last references to them go
+    struct source_dir *d, *tmp;
+    HASH_ITER(hh, dirs, d, tmp)
+    {
+        HASH_DEL(dirs, d);
+        if (d->dir != NULL)
+            walk_dir_release(d->dir);
+        free(d->path);
+        free(d);
+    }
+    walk_dir_release(root);
+    return 0;
+}
+
+// Where layout puts the MIME directory of the object hash in relative_dir: the length of the part of
+// relative_dir before the layout's levels, or -1 if relative_dir doesn't end in them
+int layout_prefix(const char *relative_dir, const struct layout *layout, const char *hash)
+{
+    size_t end = strlen(relative_dir);
+    int offset = 0;
+    for (int i = 0; i < layout->levels; i++)
+        offset += layout->widths[i];
+
+    for (int i = layout->levels - 1; i >= 0; i--)
+    {
+        offset -= layout->widths[i];
+        const char *slash = memrchr(relative_dir, '/', end);
+        if (slash == NULL || relative_dir + end - slash - 1 != layout->widths[i] ||
+            strncmp(slash + 1, hash + offset, layout->widths[i]) != 0)
+            return -1;
+        end = slash - relative_dir;
+    }
+    return end > 0 ? (int)end : -1;
+}
+
+// The path an object at relative_path has in the to layout, if it is still laid out as in the from
+// layout. Returns 1 if it has to move, 0 if it is in place already or isn't an object.
+int relayout_path(const char *relative_path, const struct layout *from, const struct layout *to, char *buffer,
+                  size_t size)
+{
+    const char *name = strrchr(relative_path, '/');
+    if (name == NULL)
+        return 0;
+    name++;
+    for (int i = 0; i < 2 * DIGEST_LENGTH; i++)
+    {
+        if (!isxdigit((unsigned char)name[i]))
+            return 0;
+    }
+
+    char relative_dir[PATH_MAX];
+    snprintf(relative_dir, sizeof(relative_dir), "%.*s", (int)(name - 1 - relative_path), relative_path);
+
+    // Any directory looks like the flat layout, so a store becoming flat is checked against its old
+    // layout instead
+    int placed = to->levels > 0 ? layout_prefix(relative_dir, to, name) >= 0 : layout_prefix(relative_dir, from, name) < 0;
+    int mime_length = layout_prefix(relative_dir, from, name);
+    if (placed || mime_length < 0)
+        return 0;
+
+    char shards[64];
+    shard_directory(to, name, shards, sizeof(shards));
+    snprintf(buffer, size, "%.*s%s%s/%s", mime_length, relative_dir, shards[0] ? "/" : "", shards, name);
+    return 1;
+}
+
+struct migration
+{
+    const char *sorted_root_directory;
+    long moved;
+    long errors;
+};
+
+void migrate_object(struct walk_dir *dir, const char *name, void *ctx)
+{
+    struct migration *migration = ctx;
+
+    // Objects are never kept in the root, only Vortex's own files
+    if (dir->parent == NULL)
+        return;
+
+    char relative_path[PATH_MAX];
+    char new_path[PATH_MAX];
+    if (format_path(relative_path, sizeof(relative_path), "%s/%s",
+                    dir->path + strlen(migration->sorted_root_directory) + 1, name) != 0)
+    {
+        log_error("Error moving object: %s/%s (%s)\n", dir->path, name, strerror(errno));
+        count_error(ERROR_PLACEMENT);
+        migration->errors++;
+        return;
+    }
+    if (strncmp(relative_path, CHUNK_DIR_NAME "/", strlen(CHUNK_DIR_NAME) + 1) == 0 ||
+        !relayout_path(relative_path, &migrating_from, &store_layout, new_path, sizeof(new_path)))
+        return;
+
+    char newname[PATH_MAX];
+    int created = 0;
+    if (format_path(newname, sizeof(newname), "%s/%s", migration->sorted_root_directory, new_path) == 0)
+    {
+        char *slash = strrchr(newname, '/');
+        *slash = '\0';
+        created = ensure_directory(newname);
+        *slash = '/';
+    }
+    if (!created || renameat(dir->fd, name, AT_FDCWD, newname) != 0)
+    {
+        log_error("Error moving object: %s (%s)\n", relative_path, strerror(errno));
+        count_error(ERROR_PLACEMENT);
+        migration->errors++;
+        return;
+    }
+    log_debug("Moved object: %s to %s\n", relative_path, new_path);
+    migration->moved++;
+}
+
+// Point the index at the objects' new locations. They keep their inodes and times, so the entries
+// stay valid otherwise.
+int relayout_index(const char *sorted_root_directory)
+{
+    char index_path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (format_path(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME) != 0 ||
+        format_path(tmp_path, sizeof(tmp_path), "%s.tmp", index_path) != 0)
+    {
+        log_error("Error writing index: %s (%s)\n", sorted_root_directory, strerror(errno));
+        return -1;
+    }
+
+    FILE *file = fopen(index_path, "r");
+    if (file == NULL)
+        return 0;
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL)
+    {
+        log_error("Error writing index: %s (%s)\n", tmp_path, strerror(errno));
+        fclose(file);
+        return -1;
+    }
+
+    char line[PATH_MAX + 128];
+    if (fgets(line, sizeof(line), file))
+        fputs(line, out);
+    while (fgets(line, sizeof(line), file))
+    {
+        struct file_hash s;
+        struct stat st;
+        const char *relative_path;
+        char new_path[PATH_MAX];
+        if (parse_index_line(line, s.digest, &st, &relative_path) != 0)
+            continue;
+        s.size = st.st_size;
+        s.mtime = st.st_mtime;
+        s.ino = st.st_ino;
+        s.path = relayout_path(relative_path, &migrating_from, &store_layout, new_path, sizeof(new_path)) ?
+                 new_path : (char *)relative_path;
+        write_index_entry(out, &s);
+    }
+    fclose(file);
+
+    if (fclose(out) != 0 || rename(tmp_path, index_path) != 0)
+    {
+        log_error("Error writing index: %s (%s)\n", index_path, strerror(errno));
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Move every object in the sorted root to the layout in store_layout, pruning the directories of the
+// old layout as they empty. The settings record the old layout until every object has moved, so an
+// interrupted migration is finished by running it again.
+int run_migrate(const char *sorted_root_directory)
+{
+    char layout_name[64];
+    format_layout(&store_layout, layout_name, sizeof(layout_name));
+
+    struct migration migration = {sorted_root_directory, 0, 0};
+    struct walk walk = {.on_file = migrate_object, .prune = 1, .ctx = &migration};
+    if (walk_tree(sorted_root_directory, &walk) != 0 || migration.errors > 0)
+    {
+        log_error("Moved %ld objects to the %s layout, %ld could not be moved; run migrate again to finish\n",
+                  migration.moved, layout_name, migration.errors);
+        return -1;
+    }
+    if (relayout_index(sorted_root_directory) != 0)
+        return -1;
+
+    migrating = 0;
+    if (write_store_settings(sorted_root_directory) != 0)
+        return -1;
+    log_info("Moved %ld objects to the %s layout\n", migration.moved, layout_name);
+    return 0;
+}
+
+// Find the location of the object with a digest in the index. Returns -1 if it isn't there.
+int find_indexed_object(const char *sorted_root_directory, const unsigned char *digest, char *relative_path, size_t size)
+{
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME);
+    FILE *file = fopen(index_path, "r");
+    if (file == NULL)
+        return -1;
+
+    char line[PATH_MAX + 128];
+    int found = -1;
+    while (found != 0 && fgets(line, sizeof(line), file))
+    {
+        unsigned char entry[DIGEST_LENGTH];
+        struct stat st;
+        const char *path;
+        if (parse_index_line(line, entry, &st, &path) == 0 && memcmp(entry, digest, DIGEST_LENGTH) == 0)
+        {
+            snprintf(relative_path, size, "%s", path);
+            found = 0;
+        }
+    }
+    fclose(file);
+    return found;
+}
+
+// Write a stored object's content, reassembled from its pack or chunks or decompressed if need be, to
+// output ("-" for stdout). object is a hash or a location in the sorted root. The content is hashed as
+// it is written, and an object that doesn't match its hash is an error.
+int run_export(const char *sorted_root_directory, const char *object, const char *output)
+{
+    char relative_path[PATH_MAX];
+    unsigned char expected[DIGEST_LENGTH];
+    if (strlen(object) == 2 * DIGEST_LENGTH && hex_to_digest(object, expected) == 0)
+    {
+        if (find_indexed_object(sorted_root_directory, expected, relative_path, sizeof(relative_path)) != 0)
+        {
+            log_error("No such object: %s\n", object);
+            return -1;
+        }
+    }
+    else
+    {
+        snprintf(relative_path, sizeof(relative_path), "%s", object);
+        if (object_digest(sorted_root_directory, relative_path, expected) != 0)
+        {
+            log_error("Not an object: %s\n", object);
+            return -1;
+        }
+    }
+
+    // Read through a manifest or a decompressor, or straight from the object's file or pack
+    struct manifest m;
+#ifdef VORTEX_WITH_ZSTD
+    struct compressed_object c;
+#endif
+    int fd = -1;
+    off_t offset = 0, size = 0;
+    struct stat st;
+    content_reader read;
+    void *ctx;
+    if (is_manifest(relative_path))
+    {
+        if (load_manifest(sorted_root_directory, relative_path, &m) != 0)
+        {
+            log_error("Error reading manifest: %s (%s)\n", relative_path, strerror(errno));
+            return -1;
+        }
+        size = m.size;
+        read = read_manifest_content;
+        ctx = &m;
+    }
+#ifdef VORTEX_WITH_ZSTD
+    else if (is_compressed(relative_path))
+    {
+        if (open_compressed(sorted_root_directory, relative_path, &c) != 0)
+        {
+            log_error("Error opening object: %s (%s)\n", relative_path, strerror(errno));
+            return -1;
+        }
+        size = c.size;
+        read = read_compressed_content;
+        ctx = &c;
+    }
+#endif
+    else
+    {
+        fd = open_object(sorted_root_directory, relative_path, &offset, &size, &st);
+        if (fd == -1)
+        {
+            log_error("Error opening object: %s (%s)\n", relative_path, strerror(errno));
+            return -1;
+        }
+        read = read_fd_content;
+        ctx = &fd;
+    }
+
+    // Logging goes to stdout, so it moves to stderr while the object is written there
+    int out_fd;
+    if (strcmp(output, "-") == 0)
+    {
+        fflush(stdout);
+        out_fd = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    else
+    {
+        out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+
+    int result = out_fd == -1 ? -1 : 0;
+    char *buffer = get_io_buffer();
+    struct hasher hasher = {0};
+    hasher_init(&hasher);
+    for (off_t done = 0; result == 0 && done < size;)
+    {
+        size_t wanted = size - done < IO_BUF_SIZE ? size - done : IO_BUF_SIZE;
+        ssize_t n = buffer ? read(ctx, buffer, wanted, offset + done) : -1;
+        if (n <= 0 || write_all(out_fd, buffer, n) != 0)
+            result = -1;
+        else
+        {
+            hasher_update(&hasher, buffer, n);
+            done += n;
+        }
+    }
+    unsigned char digest[DIGEST_LENGTH];
+    hasher_final(&hasher, digest);
+
+    if (out_fd != -1 && close(out_fd) != 0)
+        result = -1;
+    if (result != 0)
+        log_error("Error exporting object: %s to %s (%s)\n", relative_path, output, strerror(errno));
+    else if (memcmp(digest, expected, DIGEST_LENGTH) != 0)
+    {
+        log_error("Object doesn't match its hash: %s\n", relative_path);
+        result = -1;
+    }
+    else
+        log_info("Exported object: %s to %s\n", relative_path, output);
+
+    if (fd != -1)
+        close(fd);
+    else if (is_manifest(relative_path))
+        free_manifest(&m);
+#ifdef VORTEX_WITH_ZSTD
+    else
+        close_compressed(&c);
+#endif
+    return result;
+}
+
+#ifdef VORTEX_WITH_ZSTD
+// Read up to len bytes from the start of a stored object that isn't chunked. Returns how many, or -1.
+ssize_t read_object_head(const char *sorted_root_directory, const char *relative_path, void *buffer, size_t len)
+{
+    if (is_compressed(relative_path))
+    {
+        struct compressed_object c;
+        if (open_compressed(sorted_root_directory, relative_path, &c) != 0)
+            return -1;
+        ssize_t n = read_compressed_content(&c, buffer, len, 0);
+        close_compressed(&c);
+        return n;
+    }
+
+    off_t offset, size;
+    struct stat st;
+    int fd = open_object(sorted_root_directory, relative_path, &offset, &size, &st);
+    if (fd == -1)
+        return -1;
+    ssize_t n = pread(fd, buffer, len < (size_t)size ? len : (size_t)size, offset);
+    close(fd);
+    return n;
+}
+
+// Train a dictionary for a MIME type from the objects stored in its directory, and compress objects of
+// that type with it from now on. Dictionaries are kept for good, as the objects compressed with them
+// can't be read without them.
+int run_train(const char *sorted_root_directory, const char *type)
+{
+    // The type's directory is the type itself
+    if (strchr(type, '/') == NULL || strchr(type, '*') != NULL || strstr(type, "..") != NULL)
+    {
+        log_error("Not a MIME type: %s\n", type);
+        return -1;
+    }
+    const char *mime_dir = type;
+    size_t mime_length = strlen(mime_dir);
+
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME);
+    FILE *file = fopen(index_path, "r");
+    if (file == NULL)
+    {
+        log_error("Error opening index: %s (%s)\n", index_path, strerror(errno));
+        return -1;
+    }
+
+    // The first block of each object makes a sample, up to DICTIONARY_SAMPLES_MAX in all
+    unsigned char *samples = malloc(DICTIONARY_SAMPLES_MAX);
+    size_t *sizes = NULL;
+    unsigned count = 0, capacity = 0;
+    size_t total = 0;
+    char line[PATH_MAX + 128];
+    while (samples != NULL && total + DICTIONARY_SAMPLE_SIZE <= DICTIONARY_SAMPLES_MAX && fgets(line, sizeof(line), file))
+    {
+        unsigned char digest[DIGEST_LENGTH];
+        struct stat st;
+        const char *relative_path;
+        if (parse_index_line(line, digest, &st, &relative_path) != 0 ||
+            strncmp(relative_path, mime_dir, mime_length) != 0 || relative_path[mime_length] != '/' ||
+            is_manifest(relative_path))
+            continue;
+        ssize_t n = read_object_head(sorted_root_directory, relative_path, samples + total, DICTIONARY_SAMPLE_SIZE);
+        if (n <= 0)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            size_t *grown = realloc(sizes, capacity * sizeof(*sizes));
+            if (grown == NULL)
+                break;
+            sizes = grown;
+        }
+        sizes[count++] = n;
+        total += n;
+    }
+    fclose(file);
+
+    unsigned char *dictionary = malloc(DICTIONARY_MAX_SIZE);
+    size_t size = samples && sizes && dictionary ? ZDICT_trainFromBuffer(dictionary, DICTIONARY_MAX_SIZE, samples, sizes, count) : 0;
+    free(samples);
+    free(sizes);
+    if (dictionary == NULL || ZDICT_isError(size) || size == 0)
+    {
+        log_error("Error training a dictionary for %s from %u objects: %s\n", type, count,
+                  dictionary && size ? ZDICT_getErrorName(size) : "not enough objects");
+        free(dictionary);
+        return -1;
+    }
+
+    // Store the dictionary under its id, then point the type's rule at it
+    unsigned id = ZDICT_getDictID(dictionary, size);
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX] = "";
+    int fd = format_path(path, sizeof(path), "%s/%s%u", sorted_root_directory, DICTIONARY_PREFIX, id) == 0 &&
+                     format_path(tmp_path, sizeof(tmp_path), "%s.tmp", path) == 0
+                 ? open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)
+                 : -1;
+    int written = fd != -1 && write_all(fd, dictionary, size) == 0 && fsync(fd) == 0;
+    free(dictionary);
+    if (fd != -1 && close(fd) != 0)
+        written = 0;
+    if (!written || rename(tmp_path, path) != 0)
+    {
+        log_error("Error writing dictionary: %s (%s)\n", path, strerror(errno));
+        remove(tmp_path);
+        return -1;
+    }
+
+    const struct compression_rule *rule;
+    int level = compression_level(type, &rule);
+    if (level == 0)
+        level = compress_level > 0 ? compress_level : ZSTD_CLEVEL_DEFAULT;
+    compressed_store = 1;
+    if (set_compression_rule(type, level, id) != 0 || write_store_settings(sorted_root_directory) != 0)
+        return -1;
+    log_info("Trained dictionary %u for %s from %u objects, %zu bytes\n", id, type, count, size);
+    return 0;
+}
+#endif
+
+// Hash a file named by a query with the store's engine. Files of a size no stored object has can't be
+// in the store, so *known is cleared for them instead of hashing them. Returns -1 on errors.
+int query_file_digest(const char *path, unsigned char *digest, int *known)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        log_error("Error opening file: %s (%s)\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        log_error("Not a regular file: %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    *known = digest_index_may_contain_size(st.st_size);
+    int result = *known ? content_hash_fd(fd, st.st_size, NULL, 0, digest) : 0;
+    if (result != 0)
+        log_error("Error hashing file: %s\n", path);
+    close(fd);
+    return result;
+}
+
+// Answer whether files or digests are in the store from the digest index, without touching the
+// objects. Queries are the arguments, or the lines of stdin if there are none. A query of 2 *
+// DIGEST_LENGTH hex digits is a digest, anything else a file to hash. With locations set (lookup),
+// each query is printed to out with the location of its object, or "-"; otherwise (contains) only the
+// queries that are stored are printed, and 1 is returned if any isn't. Returns -1 on errors.
+int run_query(const char *sorted_root_directory, int locations, char **queries, int query_count, FILE *out)
+{
+    // Locations are read from the text index the records point into
+    char index_path[PATH_MAX];
+    snprintf(index_path, sizeof(index_path), "%s/%s", sorted_root_directory, INDEX_FILE_NAME);
+    int index_fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    struct stat index_st;
+    const char *index_map = MAP_FAILED;
+    if (index_fd != -1 && fstat(index_fd, &index_st) == 0 && index_st.st_size > 0)
+        index_map = mmap(NULL, index_st.st_size, PROT_READ, MAP_SHARED, index_fd, 0);
+    if (index_fd != -1)
+        close(index_fd);
+    if (index_map == MAP_FAILED)
+    {
+        log_error("Error mapping index: %s (%s)\n", index_path, strerror(errno));
+        return -1;
+    }
+    madvise((void *)index_map, index_st.st_size, MADV_RANDOM);
+
+    static char out_buffer[1 << 20];
+    setvbuf(out, out_buffer, _IOFBF, sizeof(out_buffer));
+
+    char *line = NULL;
+    size_t capacity = 0;
+    long answered = 0, missing = 0, errors = 0;
+    for (long i = 0; query_count == 0 || i < query_count; i++)
+    {
+        const char *query;
+        if (query_count > 0)
+            query = queries[i];
+        else
+        {
+            ssize_t n = getline(&line, &capacity, stdin);
+            if (n < 0)
+                break;
+            if (n > 0 && line[n - 1] == '\n')
+                line[--n] = '\0';
+            if (n == 0)
+                continue;
+            query = line;
+        }
+
+        unsigned char digest[DIGEST_LENGTH];
+        int known = 1;
+        if ((strlen(query) != 2 * DIGEST_LENGTH || hex_to_digest(query, digest) != 0) &&
+            query_file_digest(query, digest, &known) != 0)
+        {
+            errors++;
+            continue;
+        }
+        const struct digest_record *record = known ? digest_index_find(digest) : NULL;
+        answered++;
+
+        if (!locations)
+        {
+            if (record != NULL)
+                fprintf(out, "%s\n", query);
+            else
+                missing++;
+            continue;
+        }
+
+        // The record's line in the text index holds the object's location
+        char entry[PATH_MAX + 128];
+        unsigned char entry_digest[DIGEST_LENGTH];
+        struct stat st;
+        const char *relative_path = "-";
+        if (record != NULL)
+        {
+            const char *start = index_map + record->location;
+            const char *end = record->location < (uint64_t)index_st.st_size ?
+                              memchr(start, '\n', index_st.st_size - record->location) : NULL;
+            size_t length = end ? (size_t)(end - start) : 0;
+            if (length >= sizeof(entry))
+                length = 0;
+            memcpy(entry, start, length);
+            entry[length] = '\0';
+            if (parse_index_line(entry, entry_digest, &st, &relative_path) != 0 ||
+                memcmp(entry_digest, digest, DIGEST_LENGTH) != 0)
+            {
+                log_error("The digest index doesn't match the index, rebuild it with --reindex: %s\n", sorted_root_directory);
+                errors++;
+                break;
+            }
+        }
+        else
+            missing++;
+        fprintf(out, "%s\t%s\n", query, relative_path);
+    }
+    free(line);
+    munmap((void *)index_map, index_st.st_size);
+
+    if (fflush(out) != 0)
+    {
+        log_error("Error writing results (%s)\n", strerror(errno));
+        errors++;
+    }
+    log_debug("Answered %ld queries, %ld not stored, %ld errors\n", answered, missing, errors);
+    return errors ? -1 : !locations && missing ? 1 : 0;
+}
+
+#ifdef __linux__
+// Watch mode: keep the index loaded and ingest files as they arrive. Every directory of the ingest
+// tree is watched with inotify through its open descriptor. A file is only handed to the workers once
+// it has gone watch_settle_seconds without changing, so files written in several goes are ingested
+// once, complete.
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+double watch_settle_seconds = 1.0;
+
+struct watched_dir
+{
+    int wd; // key
+    struct walk_dir *dir;
+    UT_hash_handle hh;
+};
+
+// A file that has been written or moved in, waiting to settle
+struct settling_file
+{
+    char *key; // "<wd>/<name>"
+    struct walk_dir *dir;
+    char *name;
+    double due;             // when it may be ingested, if it hasn't changed by then
+    off_t size;
+    struct timespec mtime;
+    UT_hash_handle hh;
+};
+
+struct watcher
+{
+    int fd;
+    struct watched_dir *dirs;
+    struct settling_file *settling;
+};
+
+volatile sig_atomic_t watch_stop = 0;
+
+void stop_watching(int sig)
+{
+    (void)sig;
+    watch_stop = 1;
+}
+
+double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Start or restart the settle timer of a file
+void settle_file(struct watcher *watcher, int wd, struct walk_dir *dir, const char *name)
+{
+    char key[NAME_MAX + 32];
+    snprintf(key, sizeof(key), "%d/%s", wd, name);
+
+    struct settling_file *f;
+    HASH_FIND_STR(watcher->settling, key, f);
+    if (f == NULL)
+    {
+        f = calloc(1, sizeof(struct settling_file));
+        if (f != NULL)
+        {
+            f->key = strdup(key);
+            f->name = strdup(name);
+        }
+        if (f == NULL || f->key == NULL || f->name == NULL)
+        {
+            log_error("Out of memory, dropping the event for: %s/%s\n", dir->path, name);
+            if (f != NULL)
+            {
+                free(f->key);
+                free(f->name);
+                free(f);
+            }
+            return;
+        }
+        f->dir = dir;
+        walk_dir_ref(dir);
+        HASH_ADD_KEYPTR(hh, watcher->settling, f->key, strlen(f->key), f);
+    }
+
+    struct stat st;
+    if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+        f->size = st.st_size;
+        f->mtime = st.st_mtim;
+    }
+    f->due = monotonic_seconds() + watch_settle_seconds;
+}
+
+void drop_settling_file(struct watcher *watcher, struct settling_file *f)
+{
+    HASH_DEL(watcher->settling, f);
+    walk_dir_release(f->dir);
+    free(f->key);
+    free(f->name);
+    free(f);
+}
+
+void watch_directory(struct watcher *watcher, struct walk_dir *dir);
+
+// A watched directory being listed
+struct watch_scan
+{
+    struct watcher *watcher;
+    int wd;
+};
+
+int watch_entry(struct walk_dir *dir, const char *name, unsigned char type, void *ctx)
+{
+    struct watch_scan *scan = ctx;
+
+    if (type == DT_DIR)
+    {
+        struct walk_dir *sub = walk_dir_open(dir, name);
+        if (sub == NULL)
+            log_error("Error opening directory: %s/%s (%s)\n", dir->path, name, strerror(errno));
+        else
+            watch_directory(scan->watcher, sub);
+    }
+    else if (type == DT_REG)
+    {
+        settle_file(scan->watcher, scan->wd, dir, name);
+    }
+
+    return 0;
+}
+
+// Watch a directory and everything below it, and queue the files already there. Takes over the
+// caller's reference to dir.
+void watch_directory(struct watcher *watcher, struct walk_dir *dir)
+{
+    // inotify wants a path; the descriptor's /proc link names the directory without a path walk
+    char fd_path[64];
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", dir->fd);
+    int wd = inotify_add_watch(watcher->fd, fd_path, WATCH_EVENTS | IN_ONLYDIR);
+    if (wd == -1)
+    {
+        log_error("Error watching directory: %s (%s)\n", dir->path, strerror(errno));
+        walk_dir_release(dir);
+        return;
+    }
+
+    // A directory seen again, after an overflow or a move, keeps its existing watch
+    struct watched_dir *w;
+    HASH_FIND_INT(watcher->dirs, &wd, w);
+    if (w == NULL)
+    {
+        w = calloc(1, sizeof(struct watched_dir));
+        w->wd = wd;
+        w->dir = dir;
+        HASH_ADD_INT(watcher->dirs, wd, w);
+    }
+
+    // Watch first, then list, so nothing that arrives in between is missed
+    struct watch_scan scan = {watcher, wd};
+    read_directory(w->dir, watch_entry, &scan);
+
+    if (w->dir != dir)
+        walk_dir_release(dir);
+}
+
+void handle_watch_event(struct watcher *watcher, const struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        // Events were lost; look at every watched directory again
+        log_info("Watch queue overflowed, rescanning\n");
+        struct watched_dir *w, *tmp;
+        HASH_ITER(hh, watcher->dirs, w, tmp)
+        {
+            struct watch_scan scan = {watcher, w->wd};
+            read_directory(w->dir, watch_entry, &scan);
+        }
+        return;
+    }
+
+    struct watched_dir *w;
+    HASH_FIND_INT(watcher->dirs, &event->wd, w);
+    if (w == NULL)
+        return;
+
+    if (event->mask & IN_IGNORED)
+    {
+        // The directory is gone, or was moved away
+        HASH_DEL(watcher->dirs, w);
+        walk_dir_release(w->dir);
+        free(w);
+    }
+    else if (event->mask & IN_MOVE_SELF)
+    {
+        if (w->dir->parent != NULL)
+            inotify_rm_watch(watcher->fd, w->wd);
+    }
+    else if (event->len > 0 && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+    {
+        struct walk_dir *sub = walk_dir_open(w->dir, event->name);
+        if (sub != NULL)
+            watch_directory(watcher, sub);
+    }
+    else if (event->len > 0 && !(event->mask & IN_ISDIR) && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+    {
+        settle_file(watcher, w->wd, w->dir, event->name);
+    }
+}
+
+// Queue every file that has settled. Returns the time the next one is due, or -1 if none are waiting.
+double queue_settled_files(struct watcher *watcher)
+{
+    double now = monotonic_seconds();
+    double next = -1;
+
+    struct settling_file *f, *tmp;
+    HASH_ITER(hh, watcher->settling, f, tmp)
+    {
+        if (f->due > now)
+        {
+            if (next < 0 || f->due < next)
+                next = f->due;
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(f->dir->fd, f->name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode))
+        {
+            drop_settling_file(watcher, f);
+            continue;
+        }
+
+        if (st.st_size != f->size || st.st_mtim.tv_sec != f->mtime.tv_sec || st.st_mtim.tv_nsec != f->mtime.tv_nsec)
+        {
+            // Still being written
+            f->size = st.st_size;
+            f->mtime = st.st_mtim;
+            f->due = now + watch_settle_seconds;
+            if (next < 0 || f->due < next)
+                next = f->due;
+            continue;
+        }
+
+        queue_ingest_file(f->dir, f->name, NULL);
+        drop_settling_file(watcher, f);
+    }
+
+    return next;
+}
+
+// Watch the ingest directory until interrupted, feeding new files to a pool of workers
+int run_watch(const char *ingest_directory, const char *sorted_root_directory, int jobs)
+{
+    // Only the watcher takes SIGINT and SIGTERM, and only while it waits for events
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    struct sigaction action = {0};
+    action.sa_handler = stop_watching;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct watcher watcher = {0};
+    watcher.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watcher.fd == -1)
+    {
+        log_error("Error starting inotify (%s)\n", strerror(errno));
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+
+    struct walk_dir *root = walk_dir_open(NULL, ingest_directory);
+    if (root == NULL)
+    {
+        log_error("Error opening directory: %s (%s)\n", ingest_directory, strerror(errno));
+        close(watcher.fd);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+
+    struct ingest_job job = {ingest_directory, sorted_root_directory, ingest_file, 1};
+    pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+    int queued = work_queue_init(&ingest_queue, WORK_QUEUE_CAPACITY) == 0;
+    int started = workers != NULL && queued ? start_workers(workers, jobs, &job) : 0;
+    if (started == 0)
+    {
+        log_error("No workers to store files with\n");
+        if (queued)
+            work_queue_destroy(&ingest_queue);
+        free(workers);
+        walk_dir_release(root);
+        close(watcher.fd);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        return -1;
+    }
+
+    watch_directory(&watcher, root);
+    log_info("Watching: %s\n", ingest_directory);
+    fflush(stdout);
+
+    // Events are read in batches; the buffer is aligned for struct inotify_event
+    char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!watch_stop)
+    {
+        double next = queue_settled_files(&watcher);
+        fflush(stdout);
+
+        struct timespec timeout, *wait = NULL;
+        if (next >= 0)
+        {
+            double delay = next - monotonic_seconds();
+            if (delay < 0)
+                delay = 0;
+            timeout.tv_sec = (time_t)delay;
+            timeout.tv_nsec = (long)((delay - timeout.tv_sec) * 1e9);
+            wait = &timeout;
+        }
+
+        struct pollfd pfd = {watcher.fd, POLLIN, 0};
+        int ready = ppoll(&pfd, 1, wait, &old_mask);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            log_error("Error waiting for events (%s)\n", strerror(errno));
+            break;
+        }
+        if (ready == 0)
+            continue;
+
+        ssize_t n;
+        while ((n = read(watcher.fd, buffer, sizeof(buffer))) > 0)
+        {
+            for (char *p = buffer; p < buffer + n;)
+            {
+                const struct inotify_event *event = (const struct inotify_event *)p;
+                handle_watch_event(&watcher, event);
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+
+    log_info("Stopping\n");
+
+    // Files that hadn't settled are picked up by the next run
+    struct settling_file *f, *ftmp;
+    HASH_ITER(hh, watcher.settling, f, ftmp)
+        drop_settling_file(&watcher, f);
+    struct watched_dir *w, *wtmp;
+    HASH_ITER(hh, watcher.dirs, w, wtmp)
+    {
+        HASH_DEL(watcher.dirs, w);
+        walk_dir_release(w->dir);
+        free(w);
+    }
+    close(watcher.fd);
+
+    work_queue_close(&ingest_queue);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    work_queue_destroy(&ingest_queue);
+    free(workers);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return 0;
+}
+#else
+int run_watch(const char *ingest_directory, const char *sorted_root_directory, int jobs)
+{
+    log_error("Watch mode is only supported on Linux\n");
+    return -1;
+}
+#endif
+
+
+__thread magic_t worker_magic = NULL;
+__thread int worker_magic_failed = 0;
+
+void free_worker_magic(void)
+{
+    if (worker_magic != NULL)
+        magic_close(worker_magic);
+    worker_magic = NULL;
+}
+
+// Classify a file from its first block with the thread's libmagic handle. The result is written to
+// buffer in the backslash-separated form the extension rules use.
+const char *detect_mime_type(const unsigned char *head, size_t head_len, char *buffer, size_t size)
+{
+    const char *type = NULL;
+
+    if (worker_magic == NULL && !worker_magic_failed)
+    {
+        worker_magic = magic_open(MAGIC_MIME_TYPE);
+        if (worker_magic != NULL && magic_load(worker_magic, NULL) != 0)
+        {
+            log_error("Error loading magic database: %s\n", magic_error(worker_magic));
+            free_worker_magic();
+        }
+        worker_magic_failed = worker_magic == NULL;
+    }
+
+    if (worker_magic != NULL)
+        type = magic_buffer(worker_magic, head, head_len);
+    if (type == NULL || strchr(type, '/') == NULL || strstr(type, "..") != NULL)
+        type = "application/octet-stream";
+
+    snprintf(buffer, size, "%s", type);
+    for (int i = 0; buffer[i]; i++) {
+        if (buffer[i] == '/')
+            buffer[i] = '\\';
+    }
+    return buffer;
+}
+
+// Turn a destination in MIME form into a path under the sorted root. MIME types use backslashes,
+// paths use forward slashes.
+void destination_path(const char *destination, char *path, size_t size)
+{
+    snprintf(path, size, "%s", destination);
+    for (int i = 0; path[i]; i++) {
+        if (path[i] == '\\')
+            path[i] = '/';
+    }
+}
+
+// FastCDC: a gear hash rolls over the content, and a chunk ends where its top bits are all zero.
+// Below CHUNK_AVG_SIZE more bits have to be zero than above it, which pulls chunk sizes towards the
+// average. The gear table is generated from a fixed seed, as changing it moves every boundary.
+#define CHUNK_MASK_SMALL (((1ULL << 18) - 1) << 46)
+#define CHUNK_MASK_LARGE (((1ULL << 14) - 1) << 50)
+
+uint64_t gear_table[256];
+pthread_once_t gear_table_once = PTHREAD_ONCE_INIT;
+
+void init_gear_table(void)
+{
+    uint64_t state = 0x766f72746578ULL;
+    for (int i = 0; i < 256; i++)
+    {
+        // splitmix64
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the chunk at the start of data, given len bytes of it
+size_t next_chunk_length(const unsigned char *data, size_t len)
+{
+    if (len <= CHUNK_MIN_SIZE)
+        return len;
+    size_t normal = len < CHUNK_AVG_SIZE ? len : CHUNK_AVG_SIZE;
+    size_t max = len < CHUNK_MAX_SIZE ? len : CHUNK_MAX_SIZE;
+
+    uint64_t hash = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for (; i < normal; i++)
+    {
+        hash = (hash << 1) + gear_table[data[i]];
+        if (!(hash & CHUNK_MASK_SMALL))
+            return i + 1;
+    }
+    for (; i < max; i++)
+    {
+        hash = (hash << 1) + gear_table[data[i]];
+        if (!(hash & CHUNK_MASK_LARGE))
+            return i + 1;
+    }
+    return i;
+}
+
+// Files at or above the chunk threshold are chunked, unless --link is keeping them where they are
+int chunkable(const struct stat *st)
+{
+    return chunk_threshold > 0 && st->st_size >= chunk_threshold && !link_mode;
+}
+
+// Store a chunk unless the store has it already. Returns 1 if it was new, 0 if not, -1 on errors.
+int store_chunk(const char *sorted_root_directory, const unsigned char *data, size_t length, const unsigned char *digest)
+{
+    char path[PATH_MAX];
+    chunk_path(sorted_root_directory, digest, path, sizeof(path));
+    if (access(path, F_OK) == 0)
+        return 0;
+
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    int created = ensure_directory(path);
+    *slash = '/';
+    if (!created)
+        return -1;
+
+    // Written under a temporary name, so a chunk is either complete or absent. Workers storing the same
+    // chunk at once both rename identical content into place.
+    char temp_path[PATH_MAX];
+    int fd = create_temp_file(sorted_root_directory, "chunk-", temp_path, sizeof(temp_path));
+    if (fd == -1)
+        return -1;
+    int written = write_all(fd, data, length) == 0;
+    if (close(fd) != 0 || !written || rename(temp_path, path) != 0)
+    {
+        remove(temp_path);
+        return -1;
+    }
+    return 1;
+}
+
+// Cut an open file, which must still match digest, into chunks, store the new ones, and write its
+// manifest to dest. Returns -1 on errors.
+int chunk_object(int src_fd, const struct stat *st, const char *filename, const char *sorted_root_directory,
+                 const unsigned char *digest, const char *dest)
+{
+    pthread_once(&gear_table_once, init_gear_table);
+
+    char temp_path[PATH_MAX];
+    int manifest_fd = create_temp_file(sorted_root_directory, "manifest-", temp_path, sizeof(temp_path));
+    FILE *manifest = manifest_fd == -1 ? NULL : fdopen(manifest_fd, "w");
+    unsigned char *buffer = (unsigned char *)get_io_buffer();
+    if (manifest == NULL || buffer == NULL)
+    {
+        log_error("Error creating manifest: %s (%s)\n", temp_path, strerror(errno));
+        if (manifest_fd != -1)
+        {
+            close(manifest_fd);
+            remove(temp_path);
+        }
+        return -1;
+    }
+
+    char hex[2 * DIGEST_LENGTH + 1];
+    digest_to_hex(digest, hex);
+    fprintf(manifest, "vortex-manifest %d %lld %s\n", MANIFEST_VERSION, (long long)st->st_size, hex);
+
+    // Keep at least a maximum-sized chunk in the buffer until the end of the file
+    struct hasher whole = {0};
+    hasher_init(&whole);
+    size_t start = 0, end = 0;
+    off_t read_offset = 0;
+    int eof = 0, result = 0;
+    long chunks = 0, new_chunks = 0;
+    while (result == 0)
+    {
+        if (!eof && end - start < CHUNK_MAX_SIZE)
+        {
+            memmove(buffer, buffer + start, end - start);
+            end -= start;
+            start = 0;
+            while (!eof && end < IO_BUF_SIZE)
+            {
+                ssize_t n = pread(src_fd, buffer + end, IO_BUF_SIZE - end, read_offset);
+                if (n < 0)
+                {
+                    log_error("Error reading file: %s (%s)\n", filename, strerror(errno));
+                    result = -1;
+                    break;
+                }
+                eof = n == 0;
+                end += n;
+                read_offset += n;
+            }
+        }
+        if (result != 0 || start == end)
+            break;
+
+        size_t length = next_chunk_length(buffer + start, end - start);
+        unsigned char chunk_digest[DIGEST_LENGTH];
+        struct hasher hasher = {0};
+        hasher_init(&hasher);
+        hasher_update(&hasher, buffer + start, length);
+        hasher_final(&hasher, chunk_digest);
+        hasher_update(&whole, buffer + start, length);
+
+        int stored = store_chunk(sorted_root_directory, buffer + start, length, chunk_digest);
+        if (stored < 0)
+        {
+            log_error("Error storing chunk of file: %s (%s)\n", filename, strerror(errno));
+            result = -1;
+            break;
+        }
+        digest_to_hex(chunk_digest, hex);
+        fprintf(manifest, "%s %zu\n", hex, length);
+        chunks++;
+        new_chunks += stored;
+        start += length;
+    }
+
+    unsigned char check[DIGEST_LENGTH];
+    hasher_final(&whole, check);
+    if (result == 0 && (read_offset != st->st_size || memcmp(check, digest, DIGEST_LENGTH) != 0))
+    {
+        log_error("File changed while being ingested: %s\n", filename);
+        result = -1;
+    }
+    if (fclose(manifest) != 0 || (result == 0 && rename(temp_path, dest) != 0))
+        result = -1;
+    if (result != 0)
+    {
+        remove(temp_path);
+        return -1;
+    }
+
+    log_debug("Chunked file: %s (%ld chunks, %ld new)\n", filename, chunks, new_chunks);
+    return 0;
+}
+
+// The pack being appended to for one MIME directory. Appends to it are serialised, so each pack
+// grows strictly sequentially.
+struct pack_writer
+{
+    char *mime_dir; // key, relative to the sorted root
+    int number;     // of the pack being appended to, -1 before the first
+    int fd;
+    off_t size;
+    pthread_mutex_t lock;
+    UT_hash_handle hh;
+};
+
+struct pack_writer *pack_writers = NULL;
+pthread_mutex_t pack_writers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Objects below the pack threshold are packed, unless --link is keeping them where they are
+int packable(const struct stat *st)
+{
+    return pack_threshold > 0 && st->st_size < pack_threshold && !link_mode && !chunkable(st);
+}
+
+struct pack_writer *get_pack_writer(const char *mime_dir)
+{
+    struct pack_writer *w;
+    pthread_mutex_lock(&pack_writers_lock);
+    HASH_FIND_STR(pack_writers, mime_dir, w);
+    if (w == NULL && (w = calloc(1, sizeof(*w))) != NULL)
+    {
+        w->mime_dir = strdup(mime_dir);
+        w->number = -1;
+        w->fd = -1;
+        pthread_mutex_init(&w->lock, NULL);
+        HASH_ADD_KEYPTR(hh, pack_writers, w->mime_dir, strlen(w->mime_dir), w);
+    }
+    pthread_mutex_unlock(&pack_writers_lock);
+    return w;
+}
+
+// Open the pack a writer appends to next: the last one in its directory, if it has room, or a new one.
+// A record cut short by a crash is cut off the end, so the next append follows the last whole object.
+// Called with the writer's lock held. Returns -1 on errors.
+int open_pack(struct pack_writer *w, const char *pack_dir)
+{
+    if (w->fd != -1)
+    {
+        close(w->fd);
+        w->fd = -1;
+        w->number++;
+    }
+    else
+    {
+        DIR *d = opendir(pack_dir);
+        struct dirent *entry;
+        int number;
+        w->number = 0;
+        while (d != NULL && (entry = readdir(d)) != NULL)
+        {
+            if (sscanf(entry->d_name, "pack-%d", &number) == 1 && number > w->number)
+                w->number = number;
+        }
+        if (d != NULL)
+            closedir(d);
+    }
+
+    for (;;)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/pack-%06d", pack_dir, w->number);
+        w->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        struct stat st;
+        if (w->fd == -1 || fstat(w->fd, &st) == -1)
+        {
+            log_error("Error opening pack: %s (%s)\n", path, strerror(errno));
+            if (w->fd != -1)
+                close(w->fd);
+            w->fd = -1;
+            return -1;
+        }
+
+        struct pack_record header;
+        off_t next;
+        w->size = 0;
+        while ((next = read_pack_record(w->fd, w->size, st.st_size, &header)) != -1)
+            w->size = next;
+        if (w->size < st.st_size)
+        {
+            log_info("Cutting off incomplete object at the end of pack: %s\n", path);
+            if (ftruncate(w->fd, w->size) != 0)
+                w->size = st.st_size;
+        }
+        if (w->size < PACK_MAX_SIZE)
+            return 0;
+
+        close(w->fd);
+        w->fd = -1;
+        w->number++;
+    }
+}
+
+// Append an open file, which must still match digest, to the pack of its MIME directory. Fills in the
+// object's relative_path and the journal sequence number of the placement. Returns -1 on errors.
+int pack_object(int src_fd, const struct stat *st, const char *filename, const char *sorted_root_directory,
+                const char *mime_dir, const char *extension, const unsigned char *digest, char *relative_path,
+                size_t size, uint64_t *seq)
+{
+    // Small objects are read whole, and hashed again so that what is packed is what was hashed
+    unsigned char *data = read_packed_content(src_fd, 0, st->st_size);
+    if (data == NULL)
+        return -1;
+    unsigned char check[DIGEST_LENGTH];
+    struct hasher hasher = {0};
+    hasher_init(&hasher);
+    hasher_update(&hasher, data, st->st_size);
+    hasher_final(&hasher, check);
+    if (memcmp(check, digest, DIGEST_LENGTH) != 0)
+    {
+        log_error("File changed while being ingested: %s\n", filename);
+        free(data);
+        return -1;
+    }
+
+    char pack_dir[PATH_MAX];
+    snprintf(pack_dir, sizeof(pack_dir), "%s/%s/%s", sorted_root_directory, mime_dir, PACK_DIR_NAME);
+    struct pack_writer *w = get_pack_writer(mime_dir);
+    uint64_t start = now_ns();
+    int created = w != NULL && ensure_directory(pack_dir);
+    stage_end(STAGE_DIRECTORIES, start);
+    if (!created)
+    {
+        free(data);
+        return -1;
+    }
+
+    struct pack_record header = {.extension_length = strlen(extension), .size = st->st_size};
+    memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+    memcpy(header.digest, digest, DIGEST_LENGTH);
+    struct iovec iov[3] = {{&header, sizeof(header)}, {(void *)extension, header.extension_length},
+                           {data, st->st_size}};
+    ssize_t length = sizeof(header) + header.extension_length + st->st_size;
+
+    pthread_mutex_lock(&w->lock);
+    int result = (w->fd == -1 || w->size >= PACK_MAX_SIZE) ? open_pack(w, pack_dir) : 0;
+    if (result == 0)
+    {
+        snprintf(relative_path, size, "%s/%s/pack-%06d#%lld", mime_dir, PACK_DIR_NAME, w->number, (long long)w->size);
+        *seq = journal_begin(relative_path, filename);
+        if (pwritev(w->fd, iov, 3, w->size) == length)
+        {
+            w->size += length;
+        }
+        else
+        {
+            log_error("Error writing pack: %s (%s)\n", relative_path, strerror(errno));
+            ftruncate(w->fd, w->size);
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(data);
+    return result;
+}
+
+// Close the packs written to this run
+void close_packs(void)
+{
+    struct pack_writer *w, *tmp;
+    HASH_ITER(hh, pack_writers, w, tmp)
+    {
+        HASH_DEL(pack_writers, w);
+        if (w->fd != -1)
+            close(w->fd);
+        pthread_mutex_destroy(&w->lock);
+        free(w->mime_dir);
+        free(w);
+    }
+}
+
+// Only objects stored as files of their own are compressed, so not packed, chunked or linked ones.
+// Files are judged by the type their extension gives, or else by their destination, which is then
+// the type detected from their content. Returns the level, or 0 to store the file as it is.
+int compressible(const struct stat *st, const char *name, const char *destination, const struct compression_rule **rule)
+{
+    *rule = NULL;
+    if (!compressed_store || link_mode || packable(st) || chunkable(st))
+        return 0;
+    const char *type = get_mime_type(name);
+    return compression_level(type ? type : destination, rule);
+}
+
+#ifdef VORTEX_WITH_ZSTD
+__thread ZSTD_CCtx *worker_cctx = NULL;
+
+void free_worker_cctx(void)
+{
+    ZSTD_freeCCtx(worker_cctx);
+    worker_cctx = NULL;
+}
+
+// Load the dictionaries the compression rules use, so workers share one digested copy of each.
+// Returns -1 if one is missing.
+int load_compression_dictionaries(const char *sorted_root_directory)
+{
+    for (int i = 0; i < compression_rule_count; i++)
+    {
+        struct compression_rule *rule = &compression_rules[i];
+        if (rule->dictionary == 0 || rule->cdict != NULL)
+            continue;
+        size_t size;
+        void *data = read_dictionary(sorted_root_directory, rule->dictionary, &size);
+        if (data == NULL)
+            return -1;
+        rule->cdict = ZSTD_createCDict(data, size, rule->level);
+        free(data);
+        if (rule->cdict == NULL)
+        {
+            log_error("Error loading dictionary %u for %s\n", rule->dictionary, rule->pattern);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Compress an open file, which must still match digest, into a new temporary file under the sorted
+// root, named in temp_path. The frame records the file's size, so stat_object can tell it without
+// decompressing anything. Returns 0, 1 if the file doesn't compress well enough to be worth storing
+// compressed, or -1 on errors.
+int compress_object(int src_fd, const struct stat *st, const char *filename, const char *sorted_root_directory,
+                    const unsigned char *digest, int level, const struct compression_rule *rule, char *temp_path,
+                    size_t temp_size)
+{
+    if (worker_cctx == NULL)
+        worker_cctx = ZSTD_createCCtx();
+    int fd = create_temp_file(sorted_root_directory, "compressed-", temp_path, temp_size);
+    size_t output_size = ZSTD_CStreamOutSize();
+    unsigned char *output = fd != -1 && worker_cctx != NULL ? malloc(output_size) : NULL;
+    char *buffer = get_io_buffer();
+    if (output == NULL || buffer == NULL)
+    {
+        log_error("Error creating destination file: %s (%s)\n", temp_path, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+            remove(temp_path);
+        }
+        free(output);
+        return -1;
+    }
+
+    ZSTD_CCtx *cctx = worker_cctx;
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    if (rule != NULL && rule->cdict != NULL)
+        ZSTD_CCtx_refCDict(cctx, rule->cdict);
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    if (st->st_size >= COMPRESS_THREADED_SIZE && compress_threads > 1)
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, compress_threads); // ignored by builds without threads
+    ZSTD_CCtx_setPledgedSrcSize(cctx, st->st_size);
+
+    struct hasher hasher = {0};
+    hasher_init(&hasher);
+    off_t read_offset = 0, written = 0;
+    int result = 0;
+    for (int last = 0; result == 0 && !last;)
+    {
+        ssize_t n = pread(src_fd, buffer, IO_BUF_SIZE, read_offset);
+        if (n < 0)
+        {
+            log_error("Error reading file: %s (%s)\n", filename, strerror(errno));
+            result = -1;
+            break;
+        }
+        last = n == 0;
+        if (read_offset + n > st->st_size || (last && read_offset != st->st_size))
+        {
+            log_error("File changed while being ingested: %s\n", filename);
+            result = -1;
+            break;
+        }
+        hasher_update(&hasher, buffer, n);
+        read_offset += n;
+
+        ZSTD_inBuffer input = {buffer, n, 0};
+        size_t remaining;
+        do
+        {
+            ZSTD_outBuffer out = {output, output_size, 0};
+            remaining = ZSTD_compressStream2(cctx, &out, &input, last ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(remaining))
+            {
+                log_error("Error compressing file: %s (%s)\n", filename, ZSTD_getErrorName(remaining));
+                result = -1;
+            }
+            else if (write_all(fd, output, out.pos) != 0)
+            {
+                log_error("Error writing to destination file: %s (%s)\n", temp_path, strerror(errno));
+                result = -1;
+            }
+            written += out.pos;
+        } while (result == 0 && (last ? remaining != 0 : input.pos < input.size));
+    }
+    free(output);
+
+    unsigned char check[DIGEST_LENGTH];
+    hasher_final(&hasher, check);
+    if (result == 0 && memcmp(check, digest, DIGEST_LENGTH) != 0)
+    {
+        log_error("File changed while being ingested: %s\n", filename);
+        result = -1;
+    }
+    if (close(fd) != 0 && result == 0)
+    {
+        log_error("Error writing to destination file: %s (%s)\n", temp_path, strerror(errno));
+        result = -1;
+    }
+    if (result == 0 && written >= st->st_size - st->st_size / 16)
+    {
+        log_debug("Not compressing file, it only compresses to %lld of %lld bytes: %s\n", (long long)written,
+                  (long long)st->st_size, filename);
+        result = 1;
+    }
+    if (result != 0)
+        remove(temp_path);
+    else
+        log_debug("Compressed file: %s (%lld to %lld bytes)\n", filename, (long long)st->st_size, (long long)written);
+    return result;
+}
+#endif
+
+// Hash, deduplicate and place one open ingested file
+void process_open_file(struct walk_dir *dir, const char *name, int src_fd, const struct stat *st, const char *filename,
+                       const char *sorted_root_directory, const char *destination)
+{
+    // Read the first block once. It is used for content-based MIME detection, as the head sample
+    // of the duplicate check, and as the start of the full hash.
+    unsigned char head[PARTIAL_BLOCK_SIZE];
+    ssize_t head_len = pread(src_fd, head, sizeof(head), 0);
+    if (head_len < 0)
+    {
+        log_error("Error reading file: %s (%s)\n", filename, strerror(errno));
+        file_error(ERROR_READ, filename, st->st_size);
+        return;
+    }
+
+    uint64_t start = now_ns();
+    char detected_type[256];
+    if (destination == NULL)
+    {
+        destination = detect_mime_type(head, head_len, detected_type, sizeof(detected_type));
+        stage_end(STAGE_MIME, start);
+    }
+
+    // Rule out duplicates by size and sampled blocks before committing to a full hash
+    start = now_ns();
+    int candidate = may_be_duplicate(src_fd, head, head_len, st->st_size, sorted_root_directory);
+    stage_end(STAGE_DUPLICATE_CHECK, start);
+
+    // Hash the file. Unique files still need the full hash, as it becomes their name, so when they
+    // have to be copied into the store anyway the hash is taken from the same read as the copy.
+    char temp_path[PATH_MAX] = "";
+    unsigned char digest[DIGEST_LENGTH];
+    int hashed;
+    start = now_ns();
+    const struct compression_rule *rule;
+    if (!candidate && st->st_dev != sorted_root_device && !packable(st) && !chunkable(st) &&
+        !compressible(st, name, destination, &rule))
+        hashed = copy_and_hash_file(src_fd, head, head_len, filename, sorted_root_directory, temp_path, sizeof(temp_path), digest);
+    else
+        hashed = content_hash_fd(src_fd, st->st_size, head, head_len, digest);
+    stage_end(STAGE_HASHING, start);
+    if (hashed != 0)
+    {
+        log_error("Error hashing file: %s\n", filename);
+        file_error(ERROR_HASH, filename, st->st_size);
+        return;
+    }
+
+    store_file(dir, name, src_fd, st, filename, sorted_root_directory, destination, digest, temp_path, candidate);
+}
+
+// Store a hashed file as an object, or drop it if the store already has it. temp_path names a copy of
+// it already made in the store, if it isn't empty. candidate is set if it was expected to be a duplicate.
+void store_file(struct walk_dir *dir, const char *name, int src_fd, const struct stat *st, const char *filename,
+                const char *sorted_root_directory, const char *destination, const unsigned char *digest,
+                const char *temp_path, int candidate)
+{
+    // Only the full hash decides the content address. Claiming it is atomic, so a worker racing
+    // us on identical content either waits for our copy or we wait for theirs.
+    int duplicate;
+    char stored_path[PATH_MAX];
+    ino_t stored_ino;
+    struct file_hash *stored = claim_hash(digest, &duplicate, stored_path, sizeof(stored_path), &stored_ino);
+    if (stored == NULL)
+    {
+        log_error("Out of memory adding hash: %s\n", filename);
+        file_error(ERROR_MEMORY, filename, st->st_size);
+        if (temp_path[0] != '\0')
+            remove(temp_path);
+        return;
+    }
+    if (duplicate)
+    {
+        if (candidate)
+            log_info("Duplicate file found: %s\n", filename);
+        else
+            log_info("Duplicate file found, stored concurrently by another worker: %s\n", filename);
+        log_event("duplicate", filename, stored_path[0] ? stored_path : NULL, st->st_size, digest);
+        count(COUNTER_DUPLICATES, 1);
+        count(COUNTER_DUPLICATE_BYTES, st->st_size);
+        if (temp_path[0] != '\0')
+            remove(temp_path);
+        if (!link_mode)
+            journal_commit_later(0, dir, name, filename, NULL);
+        else if (st->st_dev == sorted_root_device && stored_path[0] != '\0' && stored_ino != st->st_ino &&
+                 strstr(stored_path, "/" PACK_DIR_NAME "/") == NULL && !is_manifest(stored_path) &&
+                 !is_compressed(stored_path))
+        {
+            // Keep the duplicate's name but share the stored object's data. Duplicates on other
+            // filesystems, or of packed, chunked or compressed objects, can't share it, and are left
+            // as they are.
+            char object[PATH_MAX];
+            if (format_path(object, sizeof(object), "%s/%s", sorted_root_directory, stored_path) == 0)
+                journal_commit_later(0, dir, name, filename, object);
+            else
+                log_error("Error linking file: %s (%s)\n", filename, strerror(errno));
+        }
+        return;
+    }
+
+    // Prepare the destination directory: the MIME directory, then any levels of the store's layout.
+    // Small objects are appended to a pack in the MIME directory instead.
+    int packed = temp_path[0] == '\0' && packable(st);
+    int chunked = temp_path[0] == '\0' && chunkable(st);
+    char hash[2 * DIGEST_LENGTH + 1];
+    digest_to_hex(digest, hash);
+    char mime_dir[PATH_MAX];
+    char shards[64];
+    char relative_dir[PATH_MAX];
+    destination_path(destination, mime_dir, sizeof(mime_dir));
+    shard_directory(&store_layout, hash, shards, sizeof(shards));
+
+    char newdir[PATH_MAX];
+    uint64_t start = now_ns();
+    int created =
+        format_path(relative_dir, sizeof(relative_dir), "%s%s%s", mime_dir, shards[0] ? "/" : "", shards) == 0 &&
+        format_path(newdir, sizeof(newdir), "%s/%s", sorted_root_directory, relative_dir) == 0 &&
+        (packed || ensure_directory(newdir));
+    stage_end(STAGE_DIRECTORIES, start);
+    if (!created)
+    {
+        log_error("Error creating destination directory: %s/%s (%s)\n", sorted_root_directory, mime_dir,
+                  strerror(errno));
+        file_error(ERROR_DIRECTORY, filename, st->st_size);
+        if (temp_path[0] != '\0')
+            remove(temp_path);
+        release_hash(stored);
+        return;
+    }
+
+    // Compressed objects are written to a temporary file first, and placed like a copy. Files that
+    // hardly compress are stored as they are.
+    int compressed = 0;
+#ifdef VORTEX_WITH_ZSTD
+    char compressed_path[PATH_MAX];
+    const struct compression_rule *rule;
+    int level = temp_path[0] == '\0' ? compressible(st, name, destination, &rule) : 0;
+    if (level > 0)
+    {
+        start = now_ns();
+        int result = compress_object(src_fd, st, filename, sorted_root_directory, digest, level, rule,
+                                     compressed_path, sizeof(compressed_path));
+        stage_end(STAGE_PLACEMENT, start);
+        if (result < 0)
+        {
+            file_error(ERROR_PLACEMENT, filename, st->st_size);
+            release_hash(stored);
+            return;
+        }
+        compressed = result == 0;
+        if (compressed)
+            temp_path = compressed_path;
+    }
+#endif
+
+    // Generate the new file path in the sorted directory. Files without an extension keep none.
+    const char *file_extension = strrchr(name, '.');
+    if (file_extension == NULL)
+        file_extension = "";
+    char relative_path[PATH_MAX];
+    char newname[PATH_MAX];
+    if (!packed && (format_path(relative_path, sizeof(relative_path), "%s/%s%s%s", relative_dir, hash, file_extension,
+                                chunked ? MANIFEST_SUFFIX : compressed ? COMPRESSED_SUFFIX : "") != 0 ||
+                    format_path(newname, sizeof(newname), "%s/%s", sorted_root_directory, relative_path) != 0))
+    {
+        log_error("Error placing file: %s (%s)\n", filename, strerror(errno));
+        file_error(ERROR_PLACEMENT, filename, st->st_size);
+        if (temp_path[0] != '\0')
+            remove(temp_path);
+        release_hash(stored);
+        return;
+    }
+
+    // Move the file into the store, or the copy we already made of it. Copied sources are only
+    // deleted once the copy is known to be on disk.
+    start = now_ns();
+    uint64_t seq = packed ? 0 : journal_begin(relative_path, filename);
+    int copied = 1;
+    if (packed)
+    {
+        if (pack_object(src_fd, st, filename, sorted_root_directory, mime_dir, file_extension, digest, relative_path,
+                        sizeof(relative_path), &seq) != 0)
+        {
+            log_error("Error packing file: %s\n", filename);
+            file_error(ERROR_PLACEMENT, filename, st->st_size);
+            release_hash(stored);
+            return;
+        }
+    }
+    else if (chunked)
+    {
+        if (chunk_object(src_fd, st, filename, sorted_root_directory, digest, newname) != 0)
+        {
+            log_error("Error chunking file: %s\n", filename);
+            file_error(ERROR_PLACEMENT, filename, st->st_size);
+            forget_directory(newdir);
+            release_hash(stored);
+            return;
+        }
+    }
+    else if (temp_path[0] != '\0')
+    {
+        log_debug("Destination: %s\n", newname);
+        if (rename(temp_path, newname) != 0)
+        {
+            log_error("Error renaming file: %s (%s)\n", temp_path, strerror(errno));
+            file_error(ERROR_PLACEMENT, filename, st->st_size);
+            remove(temp_path);
+            forget_directory(newdir);
+            release_hash(stored);
+            return;
+        }
+    }
+    else if ((copied = link_mode ? place_linked(dir->fd, name, src_fd, filename, newname, st) :
+                                   place_file(dir->fd, name, src_fd, filename, newname, st)) < 0)
+    {
+        log_error("Error placing file: %s\n", filename);
+        file_error(ERROR_PLACEMENT, filename, st->st_size);
+        forget_directory(newdir);
+        release_hash(stored);
+        return;
+    }
+
+    // Remember the stored object so the next run doesn't have to rehash it
+    record_stored_object(stored, sorted_root_directory, relative_path);
+    journal_commit_later(seq, copied && !link_mode ? dir : NULL, name, filename, NULL);
+    stage_end(STAGE_PLACEMENT, start);
+    log_info("Stored file: %s as %s\n", filename, relative_path);
+    log_event("stored", filename, relative_path, st->st_size, digest);
+    count(COUNTER_STORED_FILES, 1);
+    count(COUNTER_STORED_BYTES, st->st_size);
+}
+
+// Ingest one file into destination, a directory under the sorted root in MIME form. destination is
+// NULL when the extension didn't identify the file, which is then classified from its content.
+void process_file(struct walk_dir *dir, const char *name, const char *filename, const char *sorted_root_directory, const char *destination)
+{
+    // Skip "desktop.ini" files, which --link leaves where they are
+    if (strcmp(name, "desktop.ini") == 0)
+    {
+        if (link_mode)
+            return;
+        log_info("Deleting file: %s\n", filename);
+        if (unlinkat(dir->fd, name, 0) == 0)
+            log_event("deleted", filename, NULL, 0, NULL);
+        return;
+    }
+
+    int src_fd = openat(dir->fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src_fd == -1)
+    {
+        log_error("Error opening source file: %s (%s)\n", filename, strerror(errno));
+        file_error(ERROR_OPEN, filename, 0);
+        return;
+    }
+
+    struct stat st;
+    if (fstat(src_fd, &st) == -1)
+    {
+        log_error("Error getting file/directory information: %s (%s)\n", filename, strerror(errno));
+        file_error(ERROR_OPEN, filename, 0);
+    }
+    else
+    {
+        count(COUNTER_FILES, 1);
+        count(COUNTER_BYTES, st.st_size);
+        process_open_file(dir, name, src_fd, &st, filename, sorted_root_directory, destination);
+    }
+
+    close(src_fd);
+}
+
+// Extension rules. The built-in table below can be extended or overridden from a types file, then
+// everything is compiled into a perfect hash so a lookup is one case-folded hash of the extension
+// and at most one comparison.
+struct mime_rule
+{
+    char *extension;     // lower case, including the dot
+    size_t length;
+    char *mime_type;     // backslash separated, like "image\jpeg"
+    char *destination;   // directory under the sorted root, or NULL to use the MIME type
+};
+
+static const char *default_mime_rules[][2] = {
+    {".jpg", "image\\jpeg"},
+    {".jpeg", "image\\jpeg"},
+    {".png", "image\\png"},
+    {".gif", "image\\gif"},
+    {".webp", "image\\webp"},
+    {".svg", "image\\svg+xml"},
+    {".mp4", "video\\mp4"},
+    {".psd", "image\\vnd.adobe.photoshop"},
+    {".pdf", "application\\pdf"},
+    {".docx", "application\\vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {".doc", "application\\msword"},
+    {".xlsx", "application\\vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {".xlsm", "application\\vnd.ms-excel.sheet.macroEnabled.12"},
+    {".pptx", "application\\vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {".php", "application\\x-httpd-php"},
+    {".jnlp", "application\\x-java-jnlp-file"},
+    {".zip", "application\\zip"},
+    {".rdp", "application\\rdp"},
+    {".rtf", "application\\rtf"},
+    {".msg", "application\\vnd. ms-outlook"},
+    {".iso", "application\\x-iso9660-image"},
+    {".ini", "text\\plain"},
+    {".c", "text\\plain"},
+    {".cs", "text\\plain"},
+    {".css", "text\\plain"},
+    {".txt", "text\\plain"},
+    {".sql", "text\\plain"},
+    {".js", "text\\javascript"},
+    {".htm", "text\\html"},
+    {".html", "text\\html"},
+    {".env", "text\\plain"},
+    {".yml", "text\\plain"},
+    {".md", "text\\markdown"},
+    {".otf", "font\\otf"},
+    {".msi", "application\\x-ms-installer"},
+    {".exe", "application\\vnd.microsoft.portable-executable"},
+    {".sh", "text\\x-shellscript"},
+    {".csv", "text\\csv"},
+};
+
+struct mime_rule *mime_rules = NULL;
+size_t mime_rule_count = 0;
+size_t mime_rule_capacity = 0;
+
+struct mime_rule **mime_table = NULL;
+unsigned int mime_table_mask = 0;
+unsigned int mime_table_seed = 0;
+
+static inline unsigned char fold_case(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// Seeded FNV-1a over the case-folded bytes of an extension
+static inline unsigned int extension_hash(const char *extension, size_t length, unsigned int seed)
+{
+    unsigned int h = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++)
+    {
+        h ^= fold_case((unsigned char)extension[i]);
+        h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+// Add a rule, replacing any earlier rule for the same extension
+int add_mime_rule(const char *extension, const char *mime_type, const char *destination)
+{
+    char normalised[64];
+    int length = snprintf(normalised, sizeof(normalised), "%s%s", extension[0] == '.' ? "" : ".", extension);
+    if (length < 2 || length >= (int)sizeof(normalised))
+        return -1;
+    for (int i = 0; i < length; i++)
+        normalised[i] = fold_case((unsigned char)normalised[i]);
+
+    struct mime_rule *rule = NULL;
+    for (size_t i = 0; i < mime_rule_count; i++)
+    {
+        if (strcmp(mime_rules[i].extension, normalised) == 0)
+        {
+            rule = &mime_rules[i];
+            free(rule->extension);
+            free(rule->mime_type);
+            free(rule->destination);
+            break;
+        }
+    }
+    if (rule == NULL)
+    {
+        if (mime_rule_count == mime_rule_capacity)
+        {
+            size_t capacity = mime_rule_capacity ? mime_rule_capacity * 2 : 64;
+            struct mime_rule *rules = realloc(mime_rules, capacity * sizeof(*rules));
+            if (rules == NULL)
+                return -1;
+            mime_rules = rules;
+            mime_rule_capacity = capacity;
+        }
+        rule = &mime_rules[mime_rule_count++];
+    }
+
+    rule->extension = strdup(normalised);
+    rule->length = length;
+    rule->mime_type = strdup(mime_type);
+    rule->destination = destination ? strdup(destination) : NULL;
+    return 0;
+}
+
+void load_default_mime_rules(void)
+{
+    for (size_t i = 0; i < sizeof(default_mime_rules) / sizeof(default_mime_rules[0]); i++)
+        add_mime_rule(default_mime_rules[i][0], default_mime_rules[i][1], NULL);
+}
+
+// Read extension rules from a types file. Each line holds an extension, a MIME type and optionally a
+// destination directory, separated by whitespace; '#' starts a comment. Returns -1 on errors.
+int load_mime_rules(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        log_error("Error opening types file: %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    char line[PATH_MAX * 2];
+    int line_number = 0;
+    int result = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        char *saveptr;
+        char *extension = strtok_r(line, " \t\r\n", &saveptr);
+        if (extension == NULL)
+            continue;
+        char *mime_type = strtok_r(NULL, " \t\r\n", &saveptr);
+        char *destination = strtok_r(NULL, " \t\r\n", &saveptr);
+
+        if (mime_type == NULL || strtok_r(NULL, " \t\r\n", &saveptr) != NULL ||
+            strstr(mime_type, "..") != NULL || (destination && strstr(destination, "..") != NULL) ||
+            add_mime_rule(extension, mime_type, destination) != 0)
+        {
+            log_error("Invalid rule in types file: %s:%d\n", path, line_number);
+            result = -1;
+        }
+    }
+
+    fclose(file);
+    return result;
+}
+
+// Build the lookup table, searching for a seed that puts every extension in its own slot
+int compile_mime_rules(void)
+{
+    for (unsigned int size = 4; size <= (1u << 20); size *= 2)
+    {
+        if (size < mime_rule_count * 2)
+            continue;
+
+        struct mime_rule **table = malloc(size * sizeof(*table));
+        if (table == NULL)
+            return -1;
+
+        for (unsigned int seed = 0; seed < 1024; seed++)
+        {
+            memset(table, 0, size * sizeof(*table));
+
+            size_t i;
+            for (i = 0; i < mime_rule_count; i++)
+            {
+                struct mime_rule *rule = &mime_rules[i];
+                unsigned int slot = extension_hash(rule->extension, rule->length, seed) & (size - 1);
+                if (table[slot] != NULL)
+                    break;
+                table[slot] = rule;
+            }
+
+            if (i == mime_rule_count)
+            {
+                free(mime_table);
+                mime_table = table;
+                mime_table_mask = size - 1;
+                mime_table_seed = seed;
+                return 0;
+            }
+        }
+
+        free(table);
+    }
+
+    log_error("Error building the extension table\n");
+    return -1;
+}
+
+const struct mime_rule *find_mime_rule(const char *filename)
+{
     const char *extension = strrchr(filename, '.');
-    if (extension == NULL)
+    if (extension == NULL || mime_table == NULL)
+        return NULL;
+
+    size_t length = strlen(extension);
+    struct mime_rule *rule = mime_table[extension_hash(extension, length, mime_table_seed) & mime_table_mask];
+    if (rule == NULL || rule->length != length)
         return NULL;
 
-    // Duplicate the extension and convert to lower case
-    char *lower_ext = strdup(extension);
-    strlower(lower_ext);
-
-    if (strcmp(lower_ext, ".jpg") == 0 || strcmp(lower_ext, ".jpeg") == 0)
-        return "image\\jpeg";
-    else if (strcmp(lower_ext, ".png") == 0)
-        return "image\\png";
-    else if (strcmp(lower_ext, ".gif") == 0)
-        return "image\\gif";
-    else if (strcmp(lower_ext, ".webp") == 0)
-        return "image\\webp";
-    else if (strcmp(lower_ext, ".svg") == 0)
-        return "image\\svg+xml";
-    else if (strcmp(lower_ext, ".mp4") == 0)
-        return "video\\mp4";
-    else if (strcmp(lower_ext, ".psd") == 0)
-        return "image\\vnd.adobe.photoshop";
-    else if (strcmp(lower_ext, ".pdf") == 0)
-        return "application\\pdf";
-    else if (strcmp(lower_ext, ".docx") == 0)
-        return "application\\vnd.openxmlformats-officedocument.wordprocessingml.document";
-    else if (strcmp(lower_ext, ".doc") == 0)
-        return "application\\msword";
-    else if (strcmp(lower_ext, ".xlsx") == 0)
-        return "application\\vnd.openxmlformats-officedocument.spreadsheetml.sheet";
-    else if (strcmp(lower_ext, ".xlsm") == 0)
-        return "application\\vnd.ms-excel.sheet.macroEnabled.12";
-    else if (strcmp(lower_ext, ".pptx") == 0)
-        return "application\\vnd.openxmlformats-officedocument.presentationml.presentation";
-    else if (strcmp(lower_ext, ".php") == 0)
-        return "application\\x-httpd-php";
-    else if (strcmp(lower_ext, ".jnlp") == 0)
-        return "application\\x-java-jnlp-file";
-    else if (strcmp(lower_ext, ".zip") == 0)
-        return "application\\zip";
-    else if (strcmp(lower_ext, ".rdp") == 0)
-        return "application\\rdp";
-    else if (strcmp(lower_ext, ".rtf") == 0)
-        return "application\\rtf";
-    else if (strcmp(lower_ext, ".msg") == 0)
-        return "application\\vnd. ms-outlook";
-    else if (strcmp(lower_ext, ".iso") == 0)
-        return "application\\x-iso9660-image";
-    else if (strcmp(lower_ext, ".ini") == 0)
-        return "text\\plain";
-    else if (strcmp(lower_ext, ".c") == 0)
-        return "text\\plain";
-    else if (strcmp(lower_ext, ".cs") == 0)
-        return "text\\plain";
-    else if (strcmp(lower_ext, ".css") == 0)
-        return "text\\plain";
-    else if (strcmp(lower_ext, ".txt") == 0)
-        return "text\\plain";
-    else if (strcmp(lower_ext, ".sql") == 0)
-        return "text\\plain";
-    else if (strcmp(lower_ext, ".js") == 0)
-        return "text\\javascript";
-    else if (strcmp(lower_ext, ".htm") == 0)
-        return "text\\html";
-    else if (strcmp(lower_ext, ".html") == 0)
-        return "text\\html";
-    else if (strcmp(lower_ext, ".env") == 0)
-        return "text\\plain";
-    else if (strcmp(lower_ext, ".yml") == 0)
-        return "text\\plain";
-    else if (strcmp(lower_ext, ".md") == 0)
-        return "text\\markdown";
-    else if (strcmp(lower_ext, ".otf") == 0)
-        return "font\\otf";
-    else if (strcmp(lower_ext, ".msi") == 0)
-        return "application\\x-ms-installer";
-    else if (strcmp(lower_ext, ".exe") == 0)
-        return "application\\vnd.microsoft.portable-executable";
-    else if (strcmp(lower_ext, ".sh") == 0)
-        return "text\\x-shellscript";
-    else if (strcmp(lower_ext, ".csv") == 0)
-        return "text\\csv";
-    else
+    for (size_t i = 0; i < length; i++)
+    {
+        if (fold_case((unsigned char)extension[i]) != (unsigned char)rule->extension[i])
+            return NULL;
+    }
+    return rule;
+}
+
+// Where a file goes under the sorted root, judging by its extension: the rule's destination if it has
+// one, otherwise its MIME type. NULL when the extension isn't known.
+const char *get_destination(const char *filename) {
+    if (strcmp(filename, "desktop.ini") == 0)
+        return NULL;
+
+    const struct mime_rule *rule = find_mime_rule(filename);
+    if (rule == NULL)
         return NULL;
+    return rule->destination ? rule->destination : rule->mime_type;
+}
+
+// The MIME type a file's extension gives it, whatever its destination. NULL when the extension isn't known.
+const char *get_mime_type(const char *filename)
+{
+    const struct mime_rule *rule = find_mime_rule(filename);
+    return rule ? rule->mime_type : NULL;
+}
+
+// Benchmark corpus: a reproducible ingest tree drawn from weighted size and extension mixes
+struct bench_choice
+{
+    char *value;
+    unsigned long long size; // for size choices
+    double weight;
+};
+
+struct bench_spec
+{
+    long files;
+    double duplicate_ratio;
+    int depth;
+    unsigned long long seed;
+    struct bench_choice *sizes;
+    int size_count;
+    struct bench_choice *extensions;
+    int extension_count;
+};
+
+struct bench_spec bench = {2000, 0.2, 3, 1, NULL, 0, NULL, 0};
+const char *bench_sizes = "4K:70,256K:25,4M:5";
+const char *bench_extensions = "jpg:30,txt:30,pdf:10,bin:15,:15";
+
+// Parse a size such as 512, 64K or 4G. Returns -1 if there is anything else in text.
+int parse_size(const char *text, unsigned long long *value)
+{
+    char *end;
+    *value = strtoull(text, &end, 10);
+    if (end == text)
+        return -1;
+    switch (*end)
+    {
+    case 'T': case 't': *value <<= 10; // fall through
+    case 'G': case 'g': *value <<= 10; // fall through
+    case 'M': case 'm': *value <<= 10; // fall through
+    case 'K': case 'k': *value <<= 10; end++; break;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+// Parse "value:weight,value:weight,...". Returns the number of choices, or -1 on errors.
+int parse_bench_choices(const char *text, int sizes, struct bench_choice **choices)
+{
+    char *copy = strdup(text);
+    char *saveptr;
+    int count = 0;
+    *choices = NULL;
+    if (copy == NULL)
+        goto out_of_memory;
+    for (char *item = strtok_r(copy, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr))
+    {
+        char *colon = strrchr(item, ':');
+        if (colon == NULL)
+            goto invalid;
+        *colon = '\0';
+
+        struct bench_choice choice = {strdup(item), 0, strtod(colon + 1, NULL)};
+        if (choice.value == NULL)
+            goto out_of_memory;
+        if (choice.weight <= 0 || (sizes && (parse_size(item, &choice.size) != 0 || choice.size == 0)))
+        {
+            free(choice.value);
+            goto invalid;
+        }
+
+        struct bench_choice *grown = realloc(*choices, (count + 1) * sizeof(struct bench_choice));
+        if (grown == NULL)
+        {
+            free(choice.value);
+            goto out_of_memory;
+        }
+        *choices = grown;
+        (*choices)[count++] = choice;
+    }
+    free(copy);
+    if (count > 0)
+        return count;
+    goto invalid;
+
+out_of_memory:
+    log_error("Out of memory reading benchmark choices: %s\n", text);
+invalid:
+    for (int i = 0; i < count; i++)
+        free((*choices)[i].value);
+    free(*choices);
+    *choices = NULL;
+    free(copy);
+    return -1;
+}
+
+// xorshift64*, so a seed always produces the same corpus
+static inline uint64_t bench_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static double bench_uniform(uint64_t *state)
+{
+    return (bench_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static const struct bench_choice *bench_pick(const struct bench_choice *choices, int count, uint64_t *state)
+{
+    double total = 0;
+    for (int i = 0; i < count; i++)
+        total += choices[i].weight;
+
+    double r = bench_uniform(state) * total;
+    for (int i = 0; i < count - 1; i++)
+    {
+        if (r < choices[i].weight)
+            return &choices[i];
+        r -= choices[i].weight;
+    }
+    return &choices[count - 1];
+}
+
+// Write size bytes generated from content_seed
+int write_bench_file(const char *path, unsigned long long size, uint64_t content_seed)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1)
+        return -1;
+
+    char *buffer = get_io_buffer();
+    uint64_t state = mix64(content_seed) | 1;
+    int result = buffer ? 0 : -1;
+    while (result == 0 && size > 0)
+    {
+        size_t n = size < IO_BUF_SIZE ? size : IO_BUF_SIZE;
+        for (size_t i = 0; i < n; i += sizeof(uint64_t))
+        {
+            uint64_t word = bench_random(&state);
+            memcpy(buffer + i, &word, n - i < sizeof(word) ? n - i : sizeof(word));
+        }
+        result = write_all(fd, buffer, n);
+        size -= n;
+    }
+
+    if (close(fd) != 0)
+        result = -1;
+    return result;
+}
+
+// Generate the ingest tree under directory. Duplicates repeat the size, extension and content of an
+// earlier file. Returns -1 on errors.
+int generate_bench_corpus(const char *directory, unsigned long long *total_bytes)
+{
+    uint64_t state = mix64(bench.seed) | 1;
+    struct bench_original
+    {
+        unsigned long long size;
+        const char *extension;
+        uint64_t content_seed;
+    } *originals = malloc(bench.files * sizeof(*originals));
+    long original_count = 0;
+    if (originals == NULL)
+    {
+        log_error("Out of memory generating %ld files\n", bench.files);
+        return -1;
+    }
+
+    *total_bytes = 0;
+    for (long i = 0; i < bench.files; i++)
+    {
+        struct bench_original file;
+        if (original_count > 0 && bench_uniform(&state) < bench.duplicate_ratio)
+        {
+            file = originals[bench_random(&state) % original_count];
+        }
+        else
+        {
+            // Sizes vary from half to one and a half times the chosen size
+            const struct bench_choice *size = bench_pick(bench.sizes, bench.size_count, &state);
+            file.size = size->size / 2 + bench_random(&state) % (size->size + 1);
+            file.extension = bench_pick(bench.extensions, bench.extension_count, &state)->value;
+            file.content_seed = bench_random(&state);
+            originals[original_count++] = file;
+        }
+
+        char path[PATH_MAX];
+        int length = snprintf(path, sizeof(path), "%s", directory);
+        for (int level = 0; level < bench.depth; level++)
+            length += snprintf(path + length, sizeof(path) - length, "/d%02d", (int)(bench_random(&state) % 8));
+        if (!create_directory(path))
+        {
+            free(originals);
+            return -1;
+        }
+
+        snprintf(path + length, sizeof(path) - length, "/file%07ld%s%s", i, file.extension[0] ? "." : "", file.extension);
+        if (write_bench_file(path, file.size, file.content_seed) != 0)
+        {
+            log_error("Error writing file: %s (%s)\n", path, strerror(errno));
+            free(originals);
+            return -1;
+        }
+        *total_bytes += file.size;
+    }
+
+    free(originals);
+    return 0;
+}
+
+void print_bench_report(long files, unsigned long long bytes, double seconds)
+{
+    struct metrics total;
+    collect_metrics(&total);
+    uint64_t total_ns = 0;
+    for (int i = 0; i < STAGE_COUNT; i++)
+        total_ns += total.stage_ns[i];
+
+    printf("Files:      %ld (%.1f%% duplicates requested)\n", files, bench.duplicate_ratio * 100);
+    printf("Data:       %.1f MB\n", bytes / 1e6);
+    printf("Wall time:  %.3f s\n", seconds);
+    printf("Throughput: %.0f files/s, %.1f MB/s\n", files / seconds, bytes / 1e6 / seconds);
+    printf("Time by stage, summed over threads:\n");
+    for (int i = 0; i < STAGE_COUNT; i++)
+        printf("  %-16s %9.3f s  %5.1f%%\n", stage_names[i], total.stage_ns[i] / 1e9,
+               total_ns ? 100.0 * total.stage_ns[i] / total_ns : 0);
+}
+
+void print_usage(const char *program)
+{
+    printf("Usage: %s [options] <ingest_directory> <sorted_root_directory>\n", program);
+    printf("       %s [options] watch <ingest_directory> <sorted_root_directory>\n", program);
+    printf("       %s [options] bench <scratch_directory>\n", program);
+    printf("       %s [options] plan <ingest_directory> <sorted_root_directory> <plan_file>\n", program);
+    printf("       %s [options] apply <plan_file>\n", program);
+    printf("       %s [options] migrate --layout LAYOUT <sorted_root_directory>\n", program);
+    printf("       %s [options] export <sorted_root_directory> <hash|object> <output_file|->\n", program);
+    printf("       %s [options] train <sorted_root_directory> <mime_type>\n", program);
+    printf("       %s [options] lookup <sorted_root_directory> [file|hash...]\n", program);
+    printf("       %s [options] contains <sorted_root_directory> [file|hash...]\n", program);
+    printf("  -q, --quiet                      only print errors\n");
+    printf("  -v, --verbose                    print details of every file\n");
+    printf("  --event-log FILE                 append a JSON line per ingested file to FILE\n");
+    printf("  --reindex                        rebuild the index of the sorted directory\n");
+    printf("  --link                           leave the ingest directory as it is, storing files\n");
+    printf("                                   as reflinks or hard links and linking duplicates\n");
+    printf("  -j, --jobs N                     number of worker threads\n");
+    printf("  --hash sha256|blake2s256|blake3  hash engine for a new sorted directory (default sha256)\n");
+    printf("  --prefilter sampled|xxh3         how files of the same size as stored ones are compared\n");
+    printf("  --layout flat|N/N...             directory levels below each MIME directory for a new\n");
+    printf("                                   sorted directory, in hex digits of the hash (default flat)\n");
+    printf("  --pack SIZE                      append objects smaller than SIZE to pack files from now\n");
+    printf("                                   on (at most 16M, 0 to stop)\n");
+    printf("  --chunk SIZE                     store files of SIZE and up as chunks shared between\n");
+    printf("                                   similar files from now on (at least 256K, 0 to stop)\n");
+    printf("  --compress LEVEL                 compress objects of compressible types with zstd at\n");
+    printf("                                   LEVEL from now on (0 to stop)\n");
+    printf("  --hash-io auto|read|mmap|direct  how files are read for hashing\n");
+    printf("  --io sync|uring                  I/O backend for hashing and copying\n");
+    printf("  --queue-depth N                  I/O requests in flight per worker with io_uring\n");
+    printf("  --max-memory SIZE                keep the index on disk, buffering at most about SIZE\n");
+    printf("                                   (e.g. 512M) of new objects in memory\n");
+    printf("  --settle SECONDS                 in watch mode, how long a file must stay unchanged\n");
+    printf("  --stats FILE                     write run statistics to FILE as JSON, - for stderr\n");
+    printf("  --stats-interval SECONDS         also write them every SECONDS during the run\n");
+    printf("  --types FILE                     extension rules (default: <sorted_root>/%s)\n", TYPES_FILE_NAME);
+    printf("Benchmark corpus:\n");
+    printf("  --files N                        files to generate (default %ld)\n", bench.files);
+    printf("  --sizes SIZE:WEIGHT,...          file size mix (default %s)\n", bench_sizes);
+    printf("  --extensions EXT:WEIGHT,...      extension mix, empty for none (default %s)\n", bench_extensions);
+    printf("  --duplicates RATIO               fraction of files that repeat another (default %.1f)\n", bench.duplicate_ratio);
+    printf("  --depth N                        directory levels (default %d)\n", bench.depth);
+    printf("  --seed N                         corpus seed (default %llu)\n", bench.seed);
 }
 
 // Main function
 int main(int argc, char *argv[])
 {
-    if (argc < 3)
+    static struct option long_options[] = {
+        {"reindex", no_argument, NULL, 'r'},
+        {"link", no_argument, NULL, 'l'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"hash-io", required_argument, NULL, 'h'},
+        {"io", required_argument, NULL, 'i'},
+        {"queue-depth", required_argument, NULL, 'Q'},
+        {"quiet", no_argument, NULL, 'q'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"event-log", required_argument, NULL, 'e'},
+        {"types", required_argument, NULL, 't'},
+        {"max-memory", required_argument, NULL, 'm'},
+        {"settle", required_argument, NULL, 's'},
+        {"hash", required_argument, NULL, 'H'},
+        {"prefilter", required_argument, NULL, 'P'},
+        {"layout", required_argument, NULL, 'Y'},
+        {"pack", required_argument, NULL, 'k'},
+        {"chunk", required_argument, NULL, 'C'},
+        {"compress", required_argument, NULL, 'Z'},
+        {"stats", required_argument, NULL, 'o'},
+        {"stats-interval", required_argument, NULL, 'I'},
+        {"files", required_argument, NULL, 'F'},
+        {"sizes", required_argument, NULL, 'S'},
+        {"extensions", required_argument, NULL, 'E'},
+        {"duplicates", required_argument, NULL, 'D'},
+        {"depth", required_argument, NULL, 'L'},
+        {"seed", required_argument, NULL, 'R'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int reindex = 0;
+    const char *types_path = NULL;
+    const char *event_log_path = NULL;
+    int chosen_hash = -1;
+    struct layout requested_layout;
+    const struct layout *chosen_layout = NULL;
+    long long chosen_pack = -1;
+    long long chosen_chunk = -1;
+    long chosen_compress = -1;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:qv", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            reindex = 1;
+            break;
+        case 'l':
+            link_mode = 1;
+            break;
+        case 'j':
+            jobs = strtol(optarg, NULL, 10);
+            if (jobs < 1)
+            {
+                log_error("Invalid number of jobs: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'h':
+            if (strcmp(optarg, "auto") == 0)
+                hash_io_strategy = HASH_IO_AUTO;
+            else if (strcmp(optarg, "read") == 0)
+                hash_io_strategy = HASH_IO_READ;
+            else if (strcmp(optarg, "mmap") == 0)
+                hash_io_strategy = HASH_IO_MMAP;
+            else if (strcmp(optarg, "direct") == 0)
+                hash_io_strategy = HASH_IO_DIRECT;
+            else
+            {
+                log_error("Unknown hash I/O strategy: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "sync") == 0)
+                io_backend = IO_BACKEND_SYNC;
+            else if (strcmp(optarg, "uring") == 0)
+                io_backend = IO_BACKEND_URING;
+            else
+            {
+                log_error("Unknown I/O backend: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+#ifndef VORTEX_HAVE_IO_URING
+            if (io_backend == IO_BACKEND_URING)
+            {
+                log_info("io_uring is not supported by this build, using synchronous I/O\n");
+                io_backend = IO_BACKEND_SYNC;
+            }
+#endif
+            break;
+        case 'Q':
+            uring_queue_depth = strtoul(optarg, NULL, 10);
+            if (uring_queue_depth < 1 || uring_queue_depth > 4096)
+            {
+                log_error("Invalid queue depth: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            types_path = optarg;
+            break;
+        case 'H':
+            for (int i = 0; i < HASH_ALGORITHM_COUNT; i++)
+            {
+                if (strcmp(optarg, hash_algorithm_names[i]) == 0)
+                    chosen_hash = i;
+            }
+            if (chosen_hash == -1 || !hash_algorithm_available(chosen_hash))
+            {
+                log_error("Unknown hash engine: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            hash_algorithm = chosen_hash;
+            break;
+        case 'P':
+            if (strcmp(optarg, "sampled") == 0)
+                prefilter = PREFILTER_SAMPLED;
+#ifdef VORTEX_WITH_XXHASH
+            else if (strcmp(optarg, "xxh3") == 0)
+                prefilter = PREFILTER_XXH3;
+#endif
+            else
+            {
+                log_error("Unknown prefilter: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'k':
+        {
+            unsigned long long value;
+            if (parse_size(optarg, &value) != 0 || value > PACK_THRESHOLD_LIMIT)
+            {
+                log_error("Invalid pack threshold, at most 16M: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            chosen_pack = value;
+            break;
+        }
+        case 'C':
+        {
+            unsigned long long value;
+            if (parse_size(optarg, &value) != 0 || (value != 0 && value < CHUNK_MAX_SIZE))
+            {
+                log_error("Invalid chunking threshold, at least 256K: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            chosen_chunk = value;
+            break;
+        }
+        case 'Z':
+        {
+#ifdef VORTEX_WITH_ZSTD
+            char *end;
+            chosen_compress = strtol(optarg, &end, 10);
+            if (*end != '\0' || chosen_compress < 0 || chosen_compress > ZSTD_maxCLevel())
+            {
+                log_error("Invalid compression level, 0 to %d: %s\n", ZSTD_maxCLevel(), optarg);
+                return EXIT_FAILURE;
+            }
+#else
+            log_error("Compression is not supported by this build\n");
+            return EXIT_FAILURE;
+#endif
+            break;
+        }
+        case 'Y':
+            if (parse_layout(optarg, &requested_layout) != 0)
+            {
+                log_error("Invalid layout, expected flat or hex digits per level such as 2/2: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            chosen_layout = &requested_layout;
+            break;
+        case 'q':
+            log_verbosity = LOG_ERROR;
+            break;
+        case 'v':
+            log_verbosity = LOG_DEBUG;
+            break;
+        case 'e':
+            event_log_path = optarg;
+            break;
+#ifdef __linux__
+        case 's':
+            watch_settle_seconds = strtod(optarg, NULL);
+            if (watch_settle_seconds < 0)
+            {
+                log_error("Invalid settle time: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+#endif
+        case 'o':
+            if (stats_file != NULL && stats_file != stderr)
+                fclose(stats_file);
+            stats_file = strcmp(optarg, "-") == 0 ? stderr : fopen(optarg, "w");
+            if (stats_file == NULL)
+            {
+                log_error("Error opening stats file: %s (%s)\n", optarg, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'I':
+            stats_interval = strtod(optarg, NULL);
+            if (stats_interval <= 0)
+            {
+                log_error("Invalid stats interval: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm':
+        {
+            unsigned long long value;
+            if (parse_size(optarg, &value) != 0 || value < (16ULL << 20))
+            {
+                log_error("Invalid memory limit, at least 16M is needed: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            max_memory = value;
+            break;
+        }
+        case 'F':
+            bench.files = strtol(optarg, NULL, 10);
+            break;
+        case 'S':
+            bench_sizes = optarg;
+            break;
+        case 'E':
+            bench_extensions = optarg;
+            break;
+        case 'D':
+            bench.duplicate_ratio = strtod(optarg, NULL);
+            break;
+        case 'L':
+            bench.depth = atoi(optarg);
+            break;
+        case 'R':
+            bench.seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const char *command = argc - optind >= 1 ? argv[optind] : "";
+    int watch = strcmp(command, "watch") == 0;
+    int benchmark = strcmp(command, "bench") == 0;
+    int planning = strcmp(command, "plan") == 0;
+    int applying = strcmp(command, "apply") == 0;
+    int migrate = strcmp(command, "migrate") == 0;
+    int exporting = strcmp(command, "export") == 0;
+    int training = strcmp(command, "train") == 0;
+    int lookup = strcmp(command, "lookup") == 0;
+    int querying = lookup || strcmp(command, "contains") == 0;
+    if (watch || benchmark || planning || applying || migrate || exporting || training || querying)
+        optind++;
+
+    // Planning, exporting and queries only read the sorted directory
+    int read_only = planning || exporting || querying;
+    int arguments = benchmark || applying || migrate || querying ? 1 : planning || exporting ? 3 : 2;
+    if (argc - optind < arguments)
+    {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (jobs < 1)
+        jobs = 1;
+#ifdef VORTEX_WITH_ZSTD
+    // Workers compress large objects on threads of their own as well
+    compress_threads = sysconf(_SC_NPROCESSORS_ONLN) / jobs;
+    if (compress_threads < 2)
+        compress_threads = 2;
+#else
+    if (training)
+    {
+        log_error("Compression is not supported by this build\n");
+        return EXIT_FAILURE;
+    }
+#endif
+    if (link_mode && (watch || planning))
     {
-        printf("Usage: %s <ingest_directory> <sorted_root_directory>\n", argv[0]);
+        // Watching would see our own links replacing duplicates, and planning changes nothing anyway
+        log_error("--link can't be used with %s\n", command);
         return EXIT_FAILURE;
     }
 
-    const char *ingest_directory = argv[1];
-    const char *sorted_root_directory = argv[2];
+    const char *ingest_directory = argv[optind];
+    const char *sorted_root_directory = migrate || exporting || training || querying ? argv[optind] : argv[optind + 1];
+    const char *plan_path = planning ? argv[optind + 2] : argv[optind];
 
-    // Populate hash table with existing files.
-    build_hash_table(sorted_root_directory);
+    // A plan names the directories it was made for
+    struct plan_operation *operations = NULL;
+    long operation_count = 0;
+    if (applying)
+    {
+        char *plan_ingest, *plan_sorted;
+        int plan_hash = -1;
+        operation_count = read_plan(plan_path, &operations, &plan_ingest, &plan_sorted, &plan_hash);
+        if (operation_count < 0)
+            return EXIT_FAILURE;
+        if (chosen_hash != -1 && chosen_hash != plan_hash)
+        {
+            log_error("The plan was made with %s, not %s: %s\n", hash_algorithm_names[plan_hash],
+                      hash_algorithm_names[chosen_hash], plan_path);
+            return EXIT_FAILURE;
+        }
+        chosen_hash = hash_algorithm = plan_hash;
+        ingest_directory = plan_ingest;
+        sorted_root_directory = plan_sorted;
+    }
+
+    // A benchmark generates its ingest tree in a fresh scratch directory and sorts it into another
+    char bench_ingest[PATH_MAX];
+    char bench_sorted[PATH_MAX];
+    unsigned long long bench_bytes = 0;
+    int saved_stdout = -1;
+    if (benchmark)
+    {
+        struct stat scratch_st;
+        if (stat(argv[optind], &scratch_st) == 0)
+        {
+            log_error("Scratch directory already exists: %s\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+        if (bench.files < 1 || bench.depth < 0 || bench.duplicate_ratio < 0 || bench.duplicate_ratio >= 1 ||
+            (bench.size_count = parse_bench_choices(bench_sizes, 1, &bench.sizes)) < 0 ||
+            (bench.extension_count = parse_bench_choices(bench_extensions, 0, &bench.extensions)) < 0)
+        {
+            log_error("Invalid benchmark corpus options\n");
+            return EXIT_FAILURE;
+        }
 
-    // Process files recursively
-    process_files_recursive(ingest_directory, sorted_root_directory);
+        snprintf(bench_ingest, sizeof(bench_ingest), "%s/ingest", argv[optind]);
+        snprintf(bench_sorted, sizeof(bench_sorted), "%s/sorted", argv[optind]);
+        log_info("Generating %ld files: %s\n", bench.files, bench_ingest);
+        fflush(stdout);
+        if (!create_directory(bench_ingest) || generate_bench_corpus(bench_ingest, &bench_bytes) != 0)
+            return EXIT_FAILURE;
+        free_io_buffer();
 
-    return 0;
+        // Page cache state is left alone; drop caches beforehand for cold-cache numbers
+        ingest_directory = bench_ingest;
+        sorted_root_directory = bench_sorted;
+
+        // Per-file messages would only measure the terminal
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+
+    // Answers go to stdout, so messages go to stderr
+    FILE *query_out = NULL;
+    if (querying)
+    {
+        fflush(stdout);
+        int out_fd = dup(STDOUT_FILENO);
+        if (out_fd == -1 || (query_out = fdopen(out_fd, "w")) == NULL)
+        {
+            log_error("Error opening standard output (%s)\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    uint64_t run_start = now_ns();
+    if (log_start(event_log_path) != 0)
+        return EXIT_FAILURE;
+    if (stats_interval > 0 && stats_file == NULL)
+        stats_file = stderr;
+    stats_start_run();
+
+    // Planning leaves the sorted root alone, and plans against an empty store if there isn't one yet
+    struct stat root_st;
+    int empty_store = planning && stat(sorted_root_directory, &root_st) == -1 && errno == ENOENT;
+    if (!empty_store && ((!read_only && !create_directory(sorted_root_directory)) || stat(sorted_root_directory, &root_st) == -1))
+    {
+        log_error("Error getting file/directory information: %s (%s)\n", sorted_root_directory, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    sorted_root_device = root_st.st_dev;
+    if (!read_only && lock_store(sorted_root_directory) != 0)
+        return EXIT_FAILURE;
+    if (!empty_store && open_store_settings(sorted_root_directory, chosen_hash, migrate ? NULL : chosen_layout, read_only) != 0)
+        return EXIT_FAILURE;
+    if ((chosen_pack != -1 && chosen_pack != pack_threshold) || (chosen_chunk != -1 && chosen_chunk != chunk_threshold) ||
+        (chosen_compress != -1 && chosen_compress != compress_level))
+    {
+        // The thresholds and compression level are kept with the store, so later runs go on packing,
+        // chunking and compressing
+        pack_threshold = chosen_pack != -1 ? chosen_pack : pack_threshold;
+        chunk_threshold = chosen_chunk != -1 ? chosen_chunk : chunk_threshold;
+        compress_level = chosen_compress != -1 ? chosen_compress : compress_level;
+        compressed_store |= compress_level > 0;
+        if (!read_only && !empty_store && write_store_settings(sorted_root_directory) != 0)
+            return EXIT_FAILURE;
+    }
+    if (migrating && !migrate)
+    {
+        log_error("A layout migration of the sorted directory is unfinished; run migrate again: %s\n", sorted_root_directory);
+        return EXIT_FAILURE;
+    }
+    if (migrate)
+    {
+        // Start a migration, or finish an interrupted one
+        if (migrating && chosen_layout != NULL && !same_layout(chosen_layout, &store_layout))
+        {
+            log_error("The sorted directory is being migrated to another layout; finish that first: %s\n", sorted_root_directory);
+            return EXIT_FAILURE;
+        }
+        if (!migrating && chosen_layout == NULL)
+        {
+            log_error("migrate needs --layout\n");
+            return EXIT_FAILURE;
+        }
+        if (!migrating && same_layout(chosen_layout, &store_layout))
+        {
+            log_info("The sorted directory already uses that layout: %s\n", sorted_root_directory);
+            return 0;
+        }
+        if (!migrating)
+        {
+            migrating_from = store_layout;
+            store_layout = *chosen_layout;
+            migrating = 1;
+            if (write_store_settings(sorted_root_directory) != 0)
+                return EXIT_FAILURE;
+        }
+    }
+
+    // Extension rules: the built-in defaults, then the types file on top of them
+    load_default_mime_rules();
+    char default_types_path[PATH_MAX];
+    if (types_path == NULL)
+    {
+        if (format_path(default_types_path, sizeof(default_types_path), "%s/%s", sorted_root_directory,
+                        TYPES_FILE_NAME) == 0 &&
+            access(default_types_path, F_OK) == 0)
+            types_path = default_types_path;
+    }
+    if ((types_path != NULL && load_mime_rules(types_path) != 0) || compile_mime_rules() != 0)
+        return EXIT_FAILURE;
+
+#ifndef _WIN32
+    // Walks hold a descriptor for the directories of the files being worked on, and leave half of
+    // what is allowed for the files themselves and everything else
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        if (limit.rlim_cur < limit.rlim_max)
+        {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+        if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / 2 < (rlim_t)walk_max_open_dirs)
+            walk_max_open_dirs = limit.rlim_cur / 2 > WALK_OPEN_DEPTH ? limit.rlim_cur / 2 : WALK_OPEN_DEPTH;
+    }
+#endif
+    if (!read_only)
+    {
+        clean_temp_directory(sorted_root_directory);
+        if (recover_journal(sorted_root_directory) != 0)
+            return EXIT_FAILURE;
+    }
+
+#ifdef VORTEX_WITH_ZSTD
+    if (!read_only && !migrate && !training && load_compression_dictionaries(sorted_root_directory) != 0)
+        return EXIT_FAILURE;
+#endif
+
+    if (empty_store || migrate || exporting || training)
+    {
+        // Nothing is stored yet, so nothing to index, or objects are only being moved or read
+    }
+    else if (querying)
+    {
+        // Queries are answered from the digest index, or a private copy of it brought up to date with
+        // the text index, and change nothing in the sorted directory
+        if (reindex)
+        {
+            log_error("--reindex can't be used with %s, which only reads the sorted directory\n", command);
+            return EXIT_FAILURE;
+        }
+        unsigned long long budget = max_memory != 0 ? max_memory : QUERY_MEMORY;
+        batch_limit = budget / 2 / (sizeof(struct file_hash) + sizeof(uint32_t) + 1 + 64);
+        if (open_external_index_read_only(sorted_root_directory) != 0)
+            return EXIT_FAILURE;
+    }
+    else if (max_memory != 0)
+    {
+        // Leave half the budget for the filters and records of the digest index that lookups
+        // pull in, and buffer new objects in the other half
+        batch_limit = max_memory / 2 / (sizeof(struct file_hash) + sizeof(uint32_t) + 1 + 64);
+        if (planning && reindex)
+        {
+            // Rebuilding the text index would change the sorted directory
+            log_error("--reindex can't be used with --max-memory when planning\n");
+            return EXIT_FAILURE;
+        }
+        if ((planning ? open_external_index_read_only(sorted_root_directory) :
+                        open_external_index(sorted_root_directory, reindex)) != 0)
+            return EXIT_FAILURE;
+    }
+    else
+    {
+        // Load the index of existing files, only rehashing the whole store when there isn't one
+        int stale = reindex ? -1 : load_index(sorted_root_directory);
+        if (stale == -1)
+        {
+            log_info("Building index: %s\n", sorted_root_directory);
+            build_hash_table(sorted_root_directory);
+            stale = 1;
+        }
+        if (stale && !planning)
+            save_index(sorted_root_directory);
+    }
+
+    // Process files with a directory walker feeding a pool of workers, or as they arrive
+    int result = 0;
+    if (planning)
+    {
+        result = run_plan(ingest_directory, sorted_root_directory, plan_path, (int)jobs);
+    }
+    else if (migrate)
+    {
+        result = run_migrate(sorted_root_directory);
+    }
+    else if (exporting)
+    {
+        result = run_export(sorted_root_directory, argv[optind + 1], argv[optind + 2]);
+    }
+    else if (querying)
+    {
+        result = run_query(sorted_root_directory, lookup, argv + optind + 1, argc - optind - 1, query_out);
+        fclose(query_out);
+    }
+#ifdef VORTEX_WITH_ZSTD
+    else if (training)
+    {
+        result = run_train(sorted_root_directory, argv[optind + 1]);
+    }
+#endif
+    else
+    {
+        index_file = open_index(sorted_root_directory);
+        journal_start(sorted_root_directory);
+        if (watch)
+            result = run_watch(ingest_directory, sorted_root_directory, (int)jobs);
+        else if (applying)
+            result = run_apply(operations, operation_count, ingest_directory, sorted_root_directory);
+        else
+        {
+            struct ingest_job job = {ingest_directory, sorted_root_directory, ingest_file, 1};
+            result = run_ingest(&job, (int)jobs);
+        }
+        journal_stop();
+        close_packs();
+    }
+    if (!migrate && !exporting && !training && !querying)
+        report_hash_table_memory();
+
+    // Merge what's left of this run's objects into the digest index
+    if (max_memory != 0)
+    {
+        flush_digest_batch();
+        if (external_index.header != NULL)
+            log_info("Digest index: %llu objects\n", (unsigned long long)external_index.header->count);
+    }
+    stats_end_run();
+
+    if (index_file != NULL)
+        fclose(index_file);
+
+    log_stop();
+    if (benchmark)
+    {
+        double seconds = (now_ns() - run_start) / 1e9;
+        fflush(stdout);
+        if (saved_stdout != -1)
+        {
+            dup2(saved_stdout, STDOUT_FILENO);
+            close(saved_stdout);
+        }
+        print_bench_report(bench.files, bench_bytes, seconds);
+    }
+
+    return result == 0 ? 0 : EXIT_FAILURE;
 }